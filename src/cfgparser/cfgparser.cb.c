@@ -26,6 +26,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <arpa/inet.h>
 #include <glib.h>
 
 #include "cfgparser.h"
@@ -83,6 +84,33 @@ bool cfg_options_callback(cfg_options_t *section)
     if ( section->buffered_frames == 0 )
         section->buffered_frames = 16;
 
+    if ( section->describe_cache_size == 0 )
+        section->describe_cache_size = 1024;
+
+    if ( section->output_high_water == 0 )
+        section->output_high_water = 256;
+
+    if ( section->worker_dispatch == NULL )
+        section->worker_dispatch = cfg_default_string("round-robin");
+    else if ( strcmp(section->worker_dispatch, "round-robin") != 0 &&
+              strcmp(section->worker_dispatch, "least-load") != 0 ) {
+        yyerror("invalid worker-dispatch value '%s'", section->worker_dispatch);
+        return false;
+    }
+
+    /* the history is indexed by the low bits of the 16-bit
+       sequence numbers */
+    if ( section->rtx_history > 32768 ||
+         (section->rtx_history & (section->rtx_history - 1)) != 0 ) {
+        yyerror("invalid rtx-history value %u", section->rtx_history);
+        return false;
+    }
+
+    if ( section->aac_max_latency > 1000 ) {
+        yyerror("invalid aac-max-latency value %u", section->aac_max_latency);
+        return false;
+    }
+
     if ( section->log_level == 0 )
         section->log_level = FNC_LOG_WARN;
 
@@ -148,6 +176,77 @@ bool cfg_vhost_callback(cfg_vhost_t *section)
     if ( section->max_connections == 0 )
         section->max_connections = FENG_MAX_SESSION_DEFAULT;
 
+    if ( section->shared_join_window == 0 )
+        section->shared_join_window = 2;
+
+    if ( section->pacing == NULL )
+        section->pacing = cfg_default_string("burst");
+    else if ( strcmp(section->pacing, "burst") != 0 &&
+              strcmp(section->pacing, "frame") != 0 &&
+              strcmp(section->pacing, "bitrate") != 0 ) {
+        yyerror("invalid pacing value '%s'", section->pacing);
+        return false;
+    }
+
+    if ( section->pacing_spread == 0 )
+        section->pacing_spread = 50;
+    else if ( section->pacing_spread > 100 ) {
+        yyerror("invalid pacing-spread value %u", section->pacing_spread);
+        return false;
+    }
+
+    if ( strcmp(section->pacing, "bitrate") == 0 &&
+         section->pacing_bitrate == 0 ) {
+        yyerror("missing pacing-bitrate for bitrate pacing");
+        return false;
+    }
+
+    if ( section->multicast_group != NULL ) {
+        struct in_addr group;
+
+        if ( section->multicast_groups == 0 )
+            section->multicast_groups = 16;
+
+        /* the whole pool has to be within 224.0.0.0/4 */
+        if ( inet_pton(AF_INET, section->multicast_group, &group) != 1 ||
+             !IN_MULTICAST(ntohl(group.s_addr)) ||
+             !IN_MULTICAST(ntohl(group.s_addr) + section->multicast_groups - 1) ) {
+            yyerror("invalid multicast-group value '%s'",
+                    section->multicast_group);
+            return false;
+        }
+
+        if ( section->multicast_port == 0 )
+            section->multicast_port = RTP_DEFAULT_PORT;
+        else if ( section->multicast_port % 2 != 0 ||
+                  section->multicast_port >= G_MAXUINT16 ) {
+            yyerror("invalid multicast-port value %u",
+                    section->multicast_port);
+            return false;
+        }
+
+        if ( section->multicast_ttl == 0 )
+            section->multicast_ttl = 16;
+        else if ( section->multicast_ttl > 255 ) {
+            yyerror("invalid multicast-ttl value %u",
+                    section->multicast_ttl);
+            return false;
+        }
+    }
+
+    if ( section->abr_loss == 0 )
+        section->abr_loss = 5;
+    else if ( section->abr_loss > 100 ) {
+        yyerror("invalid abr-loss value %u", section->abr_loss);
+        return false;
+    }
+
+    if ( section->abr_jitter == 0 )
+        section->abr_jitter = 30;
+
+    if ( section->abr_reports == 0 )
+        section->abr_reports = 3;
+
     configured_vhosts = g_list_append(configured_vhosts,
                                       g_slice_dup(cfg_vhost_t, section));
 
@@ -39,9 +39,19 @@
 
 extern const char feng_signature[];
 
+struct RTSP_Worker;
+
 typedef struct feng_socket_listener {
     int fd;
     ev_io io;
+
+    /**
+     * @brief Worker accepting on the listener
+     *
+     * When NULL the listener is served by @ref feng_loop, and the
+     * accepted connections are dispatched to the workers.
+     */
+    struct RTSP_Worker *worker;
 } feng_socket_listener;
 
 extern cfg_options_t feng_srv;
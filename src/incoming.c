@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <ev.h>
 
@@ -103,23 +104,24 @@ static void CLEANUP_DESTRUCTOR feng_sockets_cleanup()
 #endif
 
 /**
- * @brief Bind a socket to a given address information
+ * @brief Open a listening socket for a given address information
  *
  * @param ai Address to bind the socket to
- * @param s The specific vhost configuration to bind for
+ * @param s The specific socket configuration to bind for
+ * @param ipproto The protocol to open the socket for
+ *
+ * @return The listening socket descriptor, or -1 in case of error.
  */
-static gboolean feng_bind_addr(struct addrinfo *ai,
-                               cfg_socket_t *s,
-                               int ipproto)
+static int feng_open_listener(struct addrinfo *ai,
+                              cfg_socket_t *s,
+                              int ipproto)
 {
     int sock;
     static const int on = 1;
-    feng_socket_listener *listener = NULL;
-    ev_io *io;
 
     if ( (sock = socket(ai->ai_family, SOCK_STREAM, ipproto)) < 0 ) {
         fnc_perror("opening socket");
-        return false;
+        return -1;
     }
 
 #if ENABLE_SCTP
@@ -154,6 +156,25 @@ static gboolean feng_bind_addr(struct addrinfo *ai,
         goto open_error;
     }
 
+#ifdef SO_REUSEPORT
+    /* Each worker gets its own listener on the same address, the
+       kernel balances the incoming connections between them; since
+       the accept happens within the worker's loop, make sure it
+       never blocks it. */
+    if ( s->reuseport ) {
+        if ( setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                        &on, sizeof(on)) < 0 ) {
+            fnc_perror("setsockopt(SO_REUSEPORT)");
+            goto open_error;
+        }
+
+        if ( fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0 ) {
+            fnc_perror("fcntl(O_NONBLOCK)");
+            goto open_error;
+        }
+    }
+#endif
+
 #if defined(IPV6_V6ONLY) && defined(IPPROTO_IPV6)
     if (ai->ai_addr->sa_family == AF_INET6) {
         if ( setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY,
@@ -174,23 +195,56 @@ static gboolean feng_bind_addr(struct addrinfo *ai,
         goto open_error;
     }
 
-    listener = g_slice_new0(feng_socket_listener);
-    listener->fd = sock;
-    io = &listener->io;
+    return sock;
+
+ open_error:
+    close(sock);
+    return -1;
+}
+
+/**
+ * @brief Bind a socket to a given address information
+ *
+ * @param ai Address to bind the socket to
+ * @param s The specific socket configuration to bind for
+ * @param ipproto The protocol to bind the socket for
+ *
+ * When @ref cfg_socket_t::reuseport is set, one listener is opened
+ * for each worker, and accepts connections directly in the worker's
+ * loop; otherwise a single listener is served by @ref feng_loop.
+ */
+static gboolean feng_bind_addr(struct addrinfo *ai,
+                               cfg_socket_t *s,
+                               int ipproto)
+{
+    guint i, count = s->reuseport ? clients_workers_count() : 1;
+
+    for ( i = 0; i < count; i++ ) {
+        feng_socket_listener *listener;
+        ev_io *io;
+        int sock;
 
-    io->data = listener;
-    ev_io_init(io, rtsp_client_incoming_cb, sock, EV_READ);
-    ev_io_start(feng_loop, io);
+        if ( (sock = feng_open_listener(ai, s, ipproto)) < 0 )
+            return false;
+
+        listener = g_slice_new0(feng_socket_listener);
+        listener->fd = sock;
+        io = &listener->io;
+
+        io->data = listener;
+        ev_io_init(io, rtsp_client_incoming_cb, sock, EV_READ);
+
+        if ( s->reuseport )
+            clients_worker_listen(i, listener);
+        else
+            ev_io_start(feng_loop, io);
 
 #ifdef CLEANUP_DESTRUCTOR
-    listeners = g_slist_prepend(listeners, listener);
+        listeners = g_slist_prepend(listeners, listener);
 #endif
+    }
 
     return true;
-
- open_error:
-    close(sock);
-    return false;
 }
 
 /**
@@ -216,11 +270,20 @@ void feng_bind_socket(gpointer socket_p, ATTR_UNUSED gpointer user_data)
         .ai_flags = AI_PASSIVE
     };
 
-    fnc_log(FNC_LOG_INFO, "Listening to port %s (%sTCP/%sipv4) on %s",
+#ifndef SO_REUSEPORT
+    if ( socket->reuseport ) {
+        fnc_log(FNC_LOG_WARN, "SO_REUSEPORT not supported, ignoring reuseport for port %s",
+                socket->port);
+        socket->reuseport = false;
+    }
+#endif
+
+    fnc_log(FNC_LOG_INFO, "Listening to port %s (%sTCP/%sipv4) on %s%s",
             socket->port,
             (socket->sctp? "SCTP+" : ""),
             (socket->ipv6? "ipv6+" : ""),
-            ((socket->listen_on == NULL)? "all interfaces" : socket->listen_on));
+            ((socket->listen_on == NULL)? "all interfaces" : socket->listen_on),
+            (socket->reuseport? ", one listener per worker" : ""));
 
     if ( socket->ipv6 ) {
         if ( (n = getaddrinfo(socket->listen_on, socket->port, &hints_ipv6, &res)) < 0 ) {
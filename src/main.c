@@ -303,17 +303,20 @@ int main(int argc, char **argv)
 
     feng_handle_signals();
 
-    g_list_foreach(configured_sockets, feng_bind_socket, NULL);
     accesslog_init(feng_default_vhost, NULL);
 
     stats_init();
 
-    feng_drop_privs();
-
     http_tunnel_initialise();
 
+    /* The workers have to be running before binding the sockets, as
+       they might be accepting connections directly. */
     clients_init();
 
+    g_list_foreach(configured_sockets, feng_bind_socket, NULL);
+
+    feng_drop_privs();
+
     ev_loop (feng_loop, 0);
 
     /* This is explicit to send disconnections! */
@@ -34,12 +34,21 @@
 struct feng;
 struct RTP_session;
 struct AVFormatContext;
+struct hint_file;
 
 #define RESOURCE_OK 0
 #define RESOURCE_ERR -1
 #define RESOURCE_EOF -2
+#define RESOURCE_BUSY -3
 #define DEFAULT_MTU 1440
 
+/**
+ * @brief Maximum size of the payload header of a buffer
+ *
+ * @see MParserBuffer::prefix
+ */
+#define MPARSER_PREFIX_MAX 16
+
 typedef enum {
     MP_undef = -1,
     MP_audio,
@@ -60,6 +69,30 @@ typedef GList *TrackList;
 typedef struct Resource Resource;
 typedef struct Track Track;
 
+/**
+ * @brief Renditions of the same media, encoded at different bitrates
+ * @ingroup resources
+ *
+ * Loaded from a manifest file by @ref r_open, and shared by the
+ * resources opened for each of its renditions, so that a session can
+ * switch between them (see @ref r_prepare_rendition).
+ */
+typedef struct ResourceRenditions {
+    /** Reference counter, one for each resource opened */
+    gint refs;
+    /** Number of renditions in @ref entries */
+    guint count;
+    /** Renditions, sorted by decreasing bitrate */
+    struct ResourceRendition {
+        /** Resolved URL of the rendition within the vhost */
+        char *url;
+        /** Bitrate of the rendition, in kilobits per second */
+        unsigned int bitrate;
+    } *entries;
+} ResourceRenditions;
+
+typedef struct ResourcePending ResourcePending;
+
 /**
  * @brief Descriptor structure of a resource
  * @ingroup resources
@@ -93,6 +126,15 @@ struct Resource {
     /* Multiformat related things */
     TrackList tracks;
 
+    /**
+     * @brief Renditions the resource is one of
+     *
+     * NULL unless the resource was opened from a renditions
+     * manifest, in which case @ref rendition is its index in there.
+     */
+    ResourceRenditions *renditions;
+    guint rendition;
+
     union {
         struct {
             /**
@@ -110,6 +152,14 @@ struct Resource {
             struct AVFormatContext *avfc;
             Track **tracks;
 
+            /**
+             * @brief Mapped hint file the resource is served from
+             *
+             * Set instead of @ref avfc for resources opened by @ref
+             * hint_open.
+             */
+            struct hint_file *hint;
+
             /**
              * @brief Pool of one thread for filling up data for the session
              *
@@ -128,6 +178,29 @@ struct Resource {
              * (@ref r_free_cb).
              */
             GThreadPool *fill_pool;
+
+            /**
+             * @brief Key of the resource in the shared resources table
+             *
+             * Only set for resources opened with shared demuxing
+             * enabled (see @ref r_open); NULL for private resources.
+             */
+            gchar *shared_url;
+
+            /**
+             * @brief Reference counter for the sessions using a
+             *        shared resource
+             */
+            gint count;
+
+            /**
+             * @brief Count of sessions playing a shared resource
+             *
+             * Changed with @ref lock held, by @ref r_play and @ref
+             * r_stop; the fill thread keeps running as long as this
+             * is not zero.
+             */
+            gint playing;
         } stored;
     };
 };
@@ -165,11 +238,46 @@ struct Track {
     /**
      * @brief The actual buffer queue
      *
-     * This double-ended queue contains the actual buffer elements
-     * that the BufferQueue framework deals with.
+     * This fixed-size ring contains the actual buffer elements that
+     * the BufferQueue framework deals with; it is indexed by the
+     * sequence numbers between @ref head and @ref tail.
+     */
+    struct MParserBuffer **ring;
+
+    /**
+     * @brief Sequence number of the oldest queued element
+     *
+     * Only changed by the producer, with @ref lock held, and
+     * published with atomic operations for the consumers.
      */
-    GQueue *queue;
+    gint head;
 
+    /**
+     * @brief Sequence number of the next element to queue
+     *
+     * Only changed by the producer, with @ref lock held, and
+     * published with atomic operations for the consumers, after the
+     * element is stored in the ring.
+     */
+    gint tail;
+
+    /**
+     * @brief Registered consumers
+     *
+     * List of @ref RTP_session objects reading from the ring, used
+     * to check their hazard pointers before freeing elements; only
+     * accessed with @ref lock held.
+     */
+    GSList *readers;
+
+    /**
+     * @brief Elements dropped from the ring but still in use
+     *
+     * Elements whose slot was released while a consumer was still
+     * using them; they are freed as soon as no hazard pointer refers
+     * to them anymore.
+     */
+    GSList *deferred;
 
     /**
      * @brief Stopped flag
@@ -200,9 +308,11 @@ struct Track {
      * @brief Serial number for the queue
      *
      * This is the serial number of the queue inside the producer,
-     * starts from zero and is increased each time the queue is reset.
+     * starts from one and is increased each time the queue is reset.
+     *
+     * @note gint is used to be able to use g_atomic_int_get function.
      */
-    gulong queue_serial;
+    gint queue_serial;
 
     /**
      * @brief Count of registered consumers
@@ -223,6 +333,71 @@ struct Track {
      */
     GCond *last_consumer;
 
+    /**
+     * @brief Demuxed packet being parsed
+     *
+     * Set by the demuxer for the duration of the @ref parse call, so
+     * that @ref mparser_buffer_new_slice can reference its data
+     * instead of copying it.
+     */
+    struct MParserBlock *block;
+
+    /**
+     * @brief Random access point indication
+     *
+     * Set by the demuxer when the packet being parsed is a keyframe;
+     * it's copied on the first buffer created from the packet only.
+     */
+    gboolean keyframe;
+
+    /**
+     * @brief Whether the queue keeps the last group of pictures
+     *
+     * When set, the elements from the last keyframe queued on are
+     * kept even once all the consumers have seen them, and new
+     * consumers start from that keyframe rather than from the head of
+     * the queue (see @ref bq_consumer_new). Set for live tracks when
+     * the live-gop-cache option is enabled.
+     */
+    gboolean gop_cache;
+
+    /** Whether @ref gop_start is the sequence number of a queued keyframe */
+    gboolean gop_valid;
+
+    /** Ring sequence number of the last keyframe queued */
+    gint gop_start;
+
+    /**
+     * @brief Size of the packet being parsed
+     *
+     * Set by the demuxer for the duration of the @ref parse call and
+     * copied on all the buffers created from the packet, so that the
+     * RTP sessions can pace the fragments of a frame.
+     */
+    uint32_t frame_size;
+
+    /**
+     * @brief Alternative destination for the parsed buffers
+     *
+     * When set, @ref track_write hands the buffers (and the reference
+     * to them) to this function, together with @ref sink_data,
+     * instead of queueing them; it's used to record hint files.
+     */
+    void (*sink)(Track *track, struct MParserBuffer *buffer, gpointer data);
+    gpointer sink_data;
+
+    /**
+     * @brief Recently queued buffers, by sequence number
+     *
+     * Ring of references to the last rtx-history buffers queued,
+     * indexed by the low bits of their sequence number, used to
+     * answer retransmission requests; only accessed with @ref lock
+     * held. NULL when the option is disabled.
+     *
+     * @see track_history_get
+     */
+    struct MParserBuffer **history;
+
     Resource *parent;
 
     /**
@@ -302,18 +477,62 @@ struct Track {
             uint8_t nal_length_size; // used in avc
         } h264;
 
+        /** Access units waiting to be aggregated, see aac-max-latency */
+        struct {
+            GByteArray *headers;    //!< AU-headers, NULL if disabled
+            GByteArray *data;       //!< access units
+            double timestamp;       //!< of the first access unit
+            double delivery;        //!< of the first access unit
+            double duration;        //!< of all the access units
+        } aac;
+
+        struct {
+            bool is_hvcc;
+            uint8_t nal_length_size; // used in hvcc
+        } h265;
+
         struct {
             char *mq_path;
+            /** RTP timestamp of the last packet flagged as keyframe */
+            uint32_t keyframe_timestamp;
         } live;
     };
 };
 
+/**
+ * @brief Reference-counted chunk of media data
+ *
+ * Usually wraps a packet coming from the demuxer, so that the
+ * buffers produced by the parsers can refer to slices of it instead
+ * of copying the payload.
+ */
+struct MParserBlock {
+    gint refs;          /*!< reference count, atomic */
+    uint8_t *data;      /*!< the data of the block */
+    size_t size;        /*!< size of @ref data */
+
+    GDestroyNotify free_func; /*!< called on @ref free_data on release */
+    gpointer free_data;
+};
+
 /**
  * @brief Buffer passed between parsers and RTP sessions
  *
- * This is what is being encapsulated by @ref BufferQueue_Element.
+ * The RTP payload is made of @ref prefix (the payload header written
+ * by the parser, if any) followed by @ref data, which points inside
+ * @ref block; the transports send the two parts with scatter-gather
+ * I/O after the RTP header, without copying them.
  */
 struct MParserBuffer {
+    /**
+     * @brief Reference count
+     *
+     * The buffer queue holds one reference, transports can take more
+     * with @ref mparser_buffer_ref to keep the buffer around after
+     * it's been reclaimed from the queue.
+     */
+    gint refs;
+
     /**
      * @brief Seen count
      *
@@ -322,31 +541,51 @@ struct MParserBuffer {
      * the consumers of its producer, the buffer is deleted and the
      * queue is shifted further on.
      *
-     * @note Since once the counter reaches the number of consumers
-     *       the element is deleted and freed, before increasing the
-     *       counter it is necessary to hold the @ref
-     *       BufferQueue_Producer lock.
+     * @note The counter is increased by the consumers with atomic
+     *       operations, without holding @ref Track::lock; the
+     *       element is only reclaimed by the producer.
      */
-    gulong seen;
+    gint seen;
 
     double timestamp;   /*!< presentation time of packet */
     double delivery;    /*!< decoding time of packet */
     double duration;    /*!< packet duration */
 
     gboolean marker;    /*!< marker bit, set if we are sending the last frag */
+    gboolean keyframe;  /*!< first buffer of a random access point */
+    uint32_t frame_size; /*!< size of the frame the buffer is part of, 0 if unknown */
     uint32_t rtp_timestamp; /*!< RTP version of the presenation time, used only by live */
     uint16_t seq_no;    /*!< Packet sequence number, used only by live */
 
-    size_t data_size;   /*!< packet size */
+    uint8_t prefix[MPARSER_PREFIX_MAX]; /*!< payload header */
+    size_t prefix_size; /*!< payload header size */
+
+    struct MParserBlock *block; /*!< block owning @ref data */
+    size_t data_size;   /*!< packet size, without the payload header */
     uint8_t *data;      /*!< actual packet data */
 };
 
+/**
+ * @brief Size of the RTP payload of a buffer
+ */
+static inline size_t mparser_buffer_size(const struct MParserBuffer *buffer)
+{
+    return buffer->prefix_size + buffer->data_size;
+}
+
 // --- functions --- //
 
 Resource *r_open(const char *inner_path);
 
 int r_read(Resource *resource);
 int r_seek(Resource *resource, double time);
+int r_play(Resource *resource, double time);
+void r_stop(Resource *resource);
+Resource *r_unshare(Resource *resource);
+ResourcePending *r_prepare_rendition(Resource *resource, guint rendition,
+                                     double time);
+int r_rendition_ready(ResourcePending *pending, Resource **resource);
+void r_rendition_cancel(ResourcePending *pending);
 
 void r_close(Resource *resource);
 void r_pause(Resource *resource);
@@ -359,9 +598,28 @@ Track *track_new(char *name);
 void track_free(Track *track);
 void track_reset_queue(struct Track *);
 void track_write(Track *tr, struct MParserBuffer *buffer);
-
+struct MParserBuffer *track_history_get(Track *tr, uint16_t seq_no);
+
+struct MParserBlock *mparser_block_new(uint8_t *data, size_t size,
+                                       GDestroyNotify free_func,
+                                       gpointer free_data);
+struct MParserBlock *mparser_block_ref(struct MParserBlock *block);
+void mparser_block_unref(struct MParserBlock *block);
+
+struct MParserBuffer *mparser_buffer_new(Track *tr, size_t size);
+struct MParserBuffer *mparser_buffer_new_slice(Track *tr, const uint8_t *data,
+                                               size_t size);
+struct MParserBuffer *mparser_buffer_new_prefixed(const struct MParserBuffer *buffer,
+                                                  const uint8_t *prefix,
+                                                  size_t size);
+struct MParserBuffer *mparser_buffer_ref(struct MParserBuffer *buffer);
+void mparser_buffer_unref(struct MParserBuffer *buffer);
+
+void bq_consumer_new(struct RTP_session *consumer);
 struct MParserBuffer *bq_consumer_get(struct RTP_session *consumer);
 gulong bq_consumer_unseen(struct RTP_session *consumer);
+struct MParserBuffer *bq_consumer_sync(struct RTP_session *consumer);
+gulong bq_producer_unseen(Track *producer);
 gboolean bq_consumer_move(struct RTP_session *consumer);
 gboolean bq_consumer_stopped(struct RTP_session *consumer);
 void bq_consumer_free(struct RTP_session *consumer);
@@ -395,6 +653,9 @@ int h263_parse(Track *track, uint8_t *data, ssize_t len);
 int h264_init(Track *track);
 int h264_parse(Track *track, uint8_t *data, ssize_t len);
 
+int h265_init(Track *track);
+int h265_parse(Track *track, uint8_t *data, ssize_t len);
+
 int mp4ves_init(Track *track);
 int mp4ves_parse(Track *track, uint8_t *data, ssize_t len);
 
@@ -402,6 +663,9 @@ int mpa_parse(Track *track, uint8_t *data, ssize_t len);
 
 int mpv_parse(Track *track, uint8_t *data, ssize_t len);
 
+int opus_init(Track *track);
+int opus_parse(Track *track, uint8_t *data, ssize_t len);
+
 int speex_parse(Track *track, uint8_t *data, ssize_t len);
 
 int vp8_init(Track *track);
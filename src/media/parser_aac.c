@@ -24,10 +24,21 @@
 
 #include <string.h>
 #include <stdbool.h>
+#include <math.h>
 
+#include "feng.h"
 #include "media/media.h"
 #include "fnc_log.h"
 
+static void aac_uninit(Track *track)
+{
+    if (track->aac.headers == NULL)
+        return;
+
+    g_byte_array_free(track->aac.headers, true);
+    g_byte_array_free(track->aac.data, true);
+}
+
 int aac_init(Track *track)
 {
     sdp_descr_append_rtpmap(track);
@@ -42,30 +53,151 @@ int aac_init(Track *track)
     sdp_descr_append_config(track);
     g_string_append(track->sdp_description, "\r\n");
 
+    if (feng_srv.aac_max_latency > 0) {
+        track->aac.headers = g_byte_array_new();
+        track->aac.data = g_byte_array_new();
+        track->uninit = aac_uninit;
+    }
+
     return 0;
 }
 
+/*  AAC-hbr payload (RFC 3640, section 3.3.6)
+ *
+ *  +---------------+---------------+- - - - - - - - - - - - - - - -
+ *  |  AU-headers-length (bits)     | AU-header 1 ...
+ *  +---------------+---------------+- - - - - - - - - - - - - - - -
+ *
+ *  each AU-header being a 13 bits AU-size and a 3 bits AU-Index (or
+ *  AU-Index-delta, for all but the first), followed by the AUs in
+ *  the same order. The AUs of a packet are consecutive, so all the
+ *  indexes are zero.
+ */
+
+#define AU_HEADER_SIZE 2
+#define AU_SIZE_MAX 0x1fff
 #define HEADER_SIZE 4
 #define MAX_PAYLOAD_SIZE (DEFAULT_MTU - HEADER_SIZE)
 
+/**
+ * @brief Send the access units waiting to be aggregated in a single
+ *        packet
+ */
+static void aac_flush(Track *tr)
+{
+    const guint headers_length = tr->aac.headers->len;
+    struct MParserBuffer *buffer;
+
+    if (headers_length == 0)
+        return;
+
+    buffer = mparser_buffer_new(tr, AU_HEADER_SIZE + headers_length +
+                                    tr->aac.data->len);
+
+    buffer->data[0] = (headers_length * 8) >> 8;
+    buffer->data[1] = (headers_length * 8) & 0xff;
+    memcpy(buffer->data + AU_HEADER_SIZE, tr->aac.headers->data,
+           headers_length);
+    memcpy(buffer->data + AU_HEADER_SIZE + headers_length,
+           tr->aac.data->data, tr->aac.data->len);
+
+    /* The packet starts with its first access unit */
+    buffer->timestamp = tr->aac.timestamp;
+    buffer->delivery = tr->aac.delivery;
+    buffer->duration = tr->aac.duration;
+    buffer->frame_size = buffer->data_size;
+    buffer->keyframe = true;
+
+    /* only complete access units */
+    buffer->marker = true;
+
+    fnc_log(FNC_LOG_VERBOSE, "[aac] %u AUs aggregated",
+            headers_length / AU_HEADER_SIZE);
+
+    track_write(tr, buffer);
+
+    g_byte_array_set_size(tr->aac.headers, 0);
+    g_byte_array_set_size(tr->aac.data, 0);
+}
+
+/**
+ * @brief Queue an access unit to be aggregated with the following ones
+ *
+ * @retval false The access unit cannot be aggregated, and has to be
+ *               sent on its own.
+ *
+ * The access units are sent once they would not fit in the same
+ * packet anymore, or once they span the aac-max-latency option.
+ */
+static gboolean aac_aggregate(Track *tr, uint8_t *data, size_t len)
+{
+    const double max_latency = feng_srv.aac_max_latency / 1000.0;
+    const uint8_t au_header[AU_HEADER_SIZE] = {
+        (len & 0x1fe0) >> 5, (len & 0x1f) << 3
+    };
+
+    if (tr->aac.headers == NULL)
+        return false;
+
+    /* The access units of a packet have to be consecutive; whatever
+     * is left from before a seek is stale */
+    if (tr->aac.headers->len > 0 &&
+        fabs(tr->dts - (tr->aac.delivery + tr->aac.duration)) >
+        tr->frame_duration / 2) {
+        g_byte_array_set_size(tr->aac.headers, 0);
+        g_byte_array_set_size(tr->aac.data, 0);
+    }
+
+    if (tr->aac.headers->len > 0 &&
+        (AU_HEADER_SIZE + tr->aac.headers->len + tr->aac.data->len +
+         AU_HEADER_SIZE + len > DEFAULT_MTU ||
+         tr->aac.duration + tr->frame_duration > max_latency))
+        aac_flush(tr);
+
+    if (tr->aac.headers->len == 0) {
+        /* Nothing to wait for */
+        if (HEADER_SIZE + len > DEFAULT_MTU ||
+            tr->frame_duration >= max_latency)
+            return false;
+
+        tr->aac.timestamp = tr->pts;
+        tr->aac.delivery = tr->dts;
+        tr->aac.duration = 0;
+    }
+
+    g_byte_array_append(tr->aac.headers, au_header, AU_HEADER_SIZE);
+    g_byte_array_append(tr->aac.data, data, len);
+    tr->aac.duration += tr->frame_duration;
+
+    if (tr->aac.duration >= max_latency)
+        aac_flush(tr);
+
+    return true;
+}
+
 int aac_parse(Track *tr, uint8_t *data, ssize_t len)
 {
     const uint8_t prefix[HEADER_SIZE] = { 0x00, 0x10, (len & 0x1fe0) >> 5, (len & 0x1f) << 3 };
 
+    if (len > AU_SIZE_MAX) {
+        fnc_log(FNC_LOG_WARN, "[aac] %zd bytes access unit too big, discarding",
+                len);
+        return -1;
+    }
+
+    if (aac_aggregate(tr, data, len))
+        return 0;
+
+    /* The AU-size of each fragment is the one of the whole access
+     * unit (RFC 3640, section 3.2.1) */
     do {
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        struct MParserBuffer *buffer =
+            mparser_buffer_new_slice(tr, data, MIN(MAX_PAYLOAD_SIZE, len));
 
-        buffer->timestamp = tr->pts;
-        buffer->delivery = tr->dts;
-        buffer->duration = tr->frame_duration;
         buffer->marker = (len <= MAX_PAYLOAD_SIZE);
 
-        buffer->data_size = MIN(MAX_PAYLOAD_SIZE, len) + HEADER_SIZE;
-        buffer->data = g_malloc(buffer->data_size);
-
-        memcpy(buffer->data, &prefix[0], HEADER_SIZE);
-        memcpy(buffer->data + HEADER_SIZE, data,
-               buffer->data_size - HEADER_SIZE);
+        memcpy(buffer->prefix, &prefix[0], HEADER_SIZE);
+        buffer->prefix_size = HEADER_SIZE;
 
         track_write(tr, buffer);
 
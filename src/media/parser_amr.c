@@ -80,7 +80,6 @@ typedef struct
 
 int amr_parse(Track *tr, uint8_t *data, ssize_t len)
 {
-    uint8_t *packet = g_slice_alloc0(DEFAULT_MTU);
     static const uint32_t packet_size[] = {12, 13, 15, 17, 19, 20, 26, 31, 5, 0, 0, 0, 0, 0, 0, 0};
 
     while (len > 0) {
@@ -104,13 +103,9 @@ int amr_parse(Track *tr, uint8_t *data, ssize_t len)
         if (frames <= 0) /* No frames - bad trailing data? */
             break;
 
-        buffer = g_slice_new0(struct MParserBuffer);
-
-        buffer->timestamp = tr->pts;
-        buffer->delivery = tr->dts;
-        buffer->duration = tr->frame_duration;
-
-        buffer->data = g_malloc(DEFAULT_MTU);
+        /* The frames are interleaved with their TOC entries, so the
+         * payload has to be rebuilt in a new buffer. */
+        buffer = mparser_buffer_new(tr, DEFAULT_MTU);
         buffer->data[0] = AMR_CMR;
 
         off = 1 + frames; /* Write the body data at this offset */
@@ -129,6 +124,5 @@ int amr_parse(Track *tr, uint8_t *data, ssize_t len)
         track_write(tr, buffer);
     }
 
-    g_slice_free1(DEFAULT_MTU, packet);
     return 0;
 }
@@ -46,29 +46,23 @@ int h263_parse(Track *tr, uint8_t *data, ssize_t len)
     }
 
     while (len - cur > 0) {
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
-        size_t payload, header_len;
-
-        buffer->timestamp = tr->pts;
-        buffer->delivery = tr->dts;
-        buffer->duration = tr->frame_duration;
-
-        buffer->data = g_malloc(buffer->data_size);
+        struct MParserBuffer *buffer;
+        size_t payload;
 
         if (cur == 0 && found_gob) {
+            /* The two zero bytes of the picture start code are
+             * replaced by the payload header with the P bit set. */
             payload = MIN(DEFAULT_MTU, len);
-            memcpy(buffer->data, data, payload);
-            memcpy(buffer->data, gob_start_code, sizeof(gob_start_code));
-            header_len = 0;
+            buffer = mparser_buffer_new_slice(tr, data + 2, payload - 2);
+            memcpy(buffer->prefix, gob_start_code, sizeof(gob_start_code));
         } else {
             payload = MIN(DEFAULT_MTU - 2, len - cur);
-            memset(buffer->data, 0, 2);
-            memcpy(buffer->data + 2, data + cur, payload);
-            header_len = 2;
+            buffer = mparser_buffer_new_slice(tr, data + cur, payload);
+            memset(buffer->prefix, 0, 2);
         }
+        buffer->prefix_size = 2;
 
         buffer->marker = (cur + payload >= len);
-        buffer->data_size = payload + header_len;
 
         track_write(tr, buffer);
         cur += payload;
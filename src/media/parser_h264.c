@@ -27,6 +27,7 @@
 
 #include "fnc_log.h"
 #include "media/media.h"
+#include "media/startcode.h"
 
 /* Generic Nal header
  *
@@ -45,7 +46,7 @@
  *  +---------------+
  */
 
-static void frag_fu_a(uint8_t *nal, int fragsize, Track *tr)
+static void frag_fu_a(uint8_t *nal, int fragsize, gboolean last, Track *tr)
 {
     int start = 1;
     const uint8_t fu_indicator = (nal[0] & 0xe0) | 28;
@@ -58,30 +59,23 @@ static void frag_fu_a(uint8_t *nal, int fragsize, Track *tr)
 
     while(fragsize>0) {
         const size_t fraglen = MIN(DEFAULT_MTU-2, fragsize);
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        struct MParserBuffer *buffer = mparser_buffer_new_slice(tr, nal, fraglen);
 
-        buffer->timestamp = tr->pts;
-        buffer->delivery = tr->dts;
-        buffer->duration = tr->frame_duration;
-
-        buffer->data_size = fraglen + 2;
-        buffer->data = g_malloc(buffer->data_size);
-
-        buffer->data[0] = fu_indicator;
-        buffer->data[1] = fu_header;
+        buffer->prefix[0] = fu_indicator;
+        buffer->prefix[1] = fu_header;
+        buffer->prefix_size = 2;
 
         if ( start ) {
-            buffer->data[1] |= (1<<7);
+            buffer->prefix[1] |= (1<<7);
             start = 0;
         }
 
         if (fraglen == fragsize) {
-            buffer->marker = true;
-            buffer->data[1] |= (1<<6);
+            buffer->marker = last;
+            buffer->prefix[1] |= (1<<6);
         }
 
-        memcpy(buffer->data + 2, nal, fraglen);
-        fnc_log(FNC_LOG_VERBOSE, "[h264] Frag %02x%02x", buffer->data[0], buffer->data[1]);
+        fnc_log(FNC_LOG_VERBOSE, "[h264] Frag %02x%02x", buffer->prefix[0], buffer->prefix[1]);
 
         track_write(tr, buffer);
 
@@ -150,48 +144,8 @@ static char *encode_avc1_header(uint8_t *p, unsigned int len, int packet_mode)
     return NULL;
 }
 
-//Ripped directly from ffmpeg...
-
-static const uint8_t *find_startcode_internal(const uint8_t *p,
-                                             const uint8_t *end)
-{
-        const uint8_t *a = p + 4 - ((intptr_t)p & 3);
-
-    for (end -= 3; p < a && p < end; p++) {
-        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-            return p;
-    }
-
-    for (end -= 3; p < end; p += 4) {
-        uint32_t x = *(const uint32_t*)p;
-//      if ((x - 0x01000100) & (~x) & 0x80008000) // little endian
-//      if ((x - 0x00010001) & (~x) & 0x00800080) // big endian
-        if ((x - 0x01010101) & (~x) & 0x80808080) { // generic
-            if (p[1] == 0) {
-                if (p[0] == 0 && p[2] == 1)
-                    return p;
-                if (p[2] == 0 && p[3] == 1)
-                    return p+1;
-            }
-            if (p[3] == 0) {
-                if (p[2] == 0 && p[4] == 1)
-                    return p+2;
-                if (p[4] == 0 && p[5] == 1)
-                    return p+3;
-            }
-        }
-    }
-
-    for (end += 3; p < end; p++) {
-        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-            return p;
-    }
-
-    return end + 3;
-}
-
 static const uint8_t *find_startcode(const uint8_t *p, const uint8_t *end){
-    const uint8_t *out = find_startcode_internal(p, end);
+    const uint8_t *out = startcode_find(p, end);
     if(p<out && out<end && !out[-1]) out--;
     return out;
 }
@@ -269,6 +223,121 @@ int h264_init(Track *track)
     return -1;
 }
 
+/*  STAP-A (RFC 6184, section 5.7.1)
+ *
+ *  +---------------+---------------+---------------+------ - -
+ *  |F|NRI| Type 24 |     NALU 1 size (16 bits)     | NALU 1 ...
+ *  +---------------+---------------+---------------+------ - -
+ *
+ *  followed by the size and data of each other NAL unit.
+ */
+
+#define STAP_A 24
+
+/**
+ * @brief Maximum number of NAL units aggregated in a single STAP-A
+ */
+#define H264_STAP_NALS 16
+
+/**
+ * @brief NAL units waiting to be sent in a single packet
+ */
+struct h264_stap {
+    uint8_t *nal[H264_STAP_NALS];
+    size_t size[H264_STAP_NALS];
+    unsigned int count;
+    /** Size of the STAP-A packet holding them all */
+    size_t length;
+};
+
+/**
+ * @brief Send the NAL units waiting in an aggregation
+ *
+ * A lone NAL unit is sent as is, more are sent in a STAP-A packet.
+ */
+static void h264_stap_flush(Track *tr, struct h264_stap *stap, gboolean last)
+{
+    struct MParserBuffer *buffer;
+
+    if (stap->count == 0)
+        return;
+
+    if (stap->count == 1) {
+        buffer = mparser_buffer_new_slice(tr, stap->nal[0], stap->size[0]);
+        fnc_log(FNC_LOG_VERBOSE, "[h264] single NAL %d",
+                stap->nal[0][0] & 0x1f);
+    } else {
+        uint8_t f = 0, nri = 0, *p;
+        unsigned int i;
+
+        buffer = mparser_buffer_new(tr, stap->length);
+        p = buffer->data + 1;
+
+        for (i = 0; i < stap->count; i++) {
+            /* F is set if any unit has it, NRI is the highest one */
+            f |= stap->nal[i][0] & 0x80;
+            nri = MAX(nri, stap->nal[i][0] & 0x60);
+
+            p[0] = stap->size[i] >> 8;
+            p[1] = stap->size[i] & 0xff;
+            memcpy(p + 2, stap->nal[i], stap->size[i]);
+            p += 2 + stap->size[i];
+        }
+
+        buffer->data[0] = f | nri | STAP_A;
+        fnc_log(FNC_LOG_VERBOSE, "[h264] STAP-A of %u NALs", stap->count);
+    }
+
+    buffer->marker = last;
+    track_write(tr, buffer);
+
+    stap->count = 0;
+    stap->length = 1;
+}
+
+/**
+ * @brief Packetize a NAL unit of the access unit being parsed
+ *
+ * @param tr The track being parsed
+ * @param stap The NAL units waiting to be aggregated
+ * @param nal The NAL unit to send
+ * @param nalsize Size of the NAL unit
+ * @param last Whether this is the last NAL unit of the access unit;
+ *             the marker is set on its last packet only.
+ *
+ * Small NAL units are aggregated in STAP-A packets as long as they
+ * fit; the units too big for a packet are fragmented with FU-A.
+ */
+static void h264_send_nal(Track *tr, struct h264_stap *stap,
+                          uint8_t *nal, size_t nalsize, gboolean last)
+{
+    if (stap->count == H264_STAP_NALS ||
+        stap->length + 2 + nalsize > DEFAULT_MTU)
+        h264_stap_flush(tr, stap, false);
+
+    if (stap->length + 2 + nalsize <= DEFAULT_MTU) {
+        stap->nal[stap->count] = nal;
+        stap->size[stap->count] = nalsize;
+        stap->count++;
+        stap->length += 2 + nalsize;
+    } else if (DEFAULT_MTU >= nalsize) {
+        struct MParserBuffer *buffer =
+            mparser_buffer_new_slice(tr, nal, nalsize);
+
+        buffer->marker = last;
+
+        track_write(tr, buffer);
+
+        fnc_log(FNC_LOG_VERBOSE, "[h264] single NAL %d", nal[0] & 0x1f);
+    } else {
+        // single NAL, to be fragmented, FU-A;
+        frag_fu_a(nal, nalsize, last, tr);
+    }
+
+    if (last)
+        h264_stap_flush(tr, stap, true);
+}
+
 // h264 has provisions for
 //  - collating NALS
 //  - fragmenting
@@ -278,7 +347,11 @@ int h264_parse(Track *tr, uint8_t *data, ssize_t len)
 {
 //    double nal_time; // see page 9 and 7.4.1.2
     size_t nalsize = 0, index = 0;
-    uint8_t *p, *q;
+    struct h264_stap stap = { .count = 0, .length = 1 };
+    /* Each NAL unit is sent once the next one is found, so that the
+     * last one of the access unit is known */
+    uint8_t *prev = NULL;
+    size_t prev_size = 0;
 
     if (tr->h264.is_avc) {
         const size_t nal_length_size = tr->h264.nal_length_size;
@@ -299,91 +372,43 @@ int h264_parse(Track *tr, uint8_t *data, ssize_t len)
                     break;
                 }
             }
-            if (DEFAULT_MTU >= nalsize) {
-                struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
-
-                buffer->timestamp = tr->pts;
-                buffer->delivery = tr->dts;
-                buffer->duration = tr->frame_duration;
-                buffer->marker = true;
-
-                buffer->data_size = nalsize;
-                buffer->data = g_memdup(data + index, buffer->data_size);
-
-                track_write(tr, buffer);
-
-                fnc_log(FNC_LOG_VERBOSE, "[h264] single NAL");
-            } else {
-            // single NAL, to be fragmented, FU-A;
-                frag_fu_a(data + index, nalsize, tr);
-            }
+            if (prev)
+                h264_send_nal(tr, &stap, prev, prev_size, false);
+            prev = data + index;
+            prev_size = nalsize;
             index += nalsize;
         }
     } else {
-        //seek to the first startcode
-        for (p = data; p<data + len - 3; p++) {
-            if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
-                break;
-            }
-        }
-        if (p >= data + len) return -1;
-
-        while (1) {
-        //seek to the next startcode [0 0 1]
-            for (q = p; q<data+len-3;q++) {
-                if (q[0] == 0 && q[1] == 0 && q[2] == 1) {
-                    break;
-                }
-            }
-
-            if (q >= data + len) break;
+        const uint8_t *end = data + len;
+        const uint8_t *nal = startcode_find(data, end);
 
-            if (DEFAULT_MTU >= q - p) {
-                struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        if (nal == end) return -1;
 
-                buffer->timestamp = tr->pts;
-                buffer->delivery = tr->dts;
-                buffer->duration = tr->frame_duration;
-                buffer->marker = true;
+        do {
+            const uint8_t *next = startcode_find(nal + 3, end);
+            const uint8_t *nal_end = next;
 
-                buffer->data_size = q - p;
-                buffer->data = g_memdup(p, buffer->data_size);
+            nal += 3;
 
-                track_write(tr, buffer);
+            /* trailing_zero_8bits, and the leading zero of four-byte
+             * start codes */
+            while (nal_end > nal && nal_end[-1] == 0)
+                nal_end--;
 
-                fnc_log(FNC_LOG_VERBOSE, "[h264] Sending single NAL %d",p[0]&0x1f);
-            } else {
-                //FU-A
-                fnc_log(FNC_LOG_VERBOSE, "[h264] frags");
-                frag_fu_a(p, q - p, tr);
+            if (nal_end > nal) {
+                if (prev)
+                    h264_send_nal(tr, &stap, prev, prev_size, false);
+                prev = (uint8_t *)nal;
+                prev_size = nal_end - nal;
             }
 
-            p = q;
-
-        }
-        // last NAL
-        fnc_log(FNC_LOG_VERBOSE, "[h264] last NAL %d",p[0]&0x1f);
-        if (DEFAULT_MTU >= len - (p - data)) {
-            struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
-
-            buffer->timestamp = tr->pts;
-            buffer->delivery = tr->dts;
-            buffer->duration = tr->frame_duration;
-            buffer->marker = true;
-
-            buffer->data_size = len - (p - data);
-            buffer->data = g_memdup(p, buffer->data_size);
-
-            track_write(tr, buffer);
-
-            fnc_log(FNC_LOG_VERBOSE, "[h264] no frags");
-        } else {
-            //FU-A
-            fnc_log(FNC_LOG_VERBOSE, "[h264] frags");
-            frag_fu_a(p, len - (p - data), tr);
-        }
+            nal = next;
+        } while (nal < end);
     }
 
+    if (prev)
+        h264_send_nal(tr, &stap, prev, prev_size, true);
+
     fnc_log(FNC_LOG_VERBOSE, "[h264] Frame completed");
     return 0;
 }
@@ -0,0 +1,431 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief H.265/HEVC parser (RFC 7798)
+ *
+ * Works like the H.264 parser: the access units come either with
+ * length-prefixed NAL units (hvcC extradata, as found in MP4 and
+ * Matroska files) or as an Annex B bitstream; small NAL units are
+ * aggregated (AP) and the ones too big for a packet are fragmented
+ * (FU).
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "fnc_log.h"
+#include "media/media.h"
+#include "media/startcode.h"
+
+/* NAL unit header
+ *
+ *  +---------------+---------------+
+ *  |0|1|2|3|4|5|6|7|0|1|2|3|4|5|6|7|
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |F|   Type    |  LayerId  | TID |
+ *  +-------------+-----------------+
+ *
+ */
+/*  FU header
+ *  +---------------+
+ *  |0|1|2|3|4|5|6|7|
+ *  +-+-+-+-+-+-+-+-+
+ *  |S|E|  FuType   |
+ *  +---------------+
+ */
+
+#define H265_NAL_HEADER_SIZE 2
+
+#define H265_NAL_TYPE(nal) (((nal)[0] >> 1) & 0x3f)
+#define H265_NAL_LAYER_ID(nal) ((((nal)[0] & 0x01) << 5) | ((nal)[1] >> 3))
+#define H265_NAL_TID(nal) ((nal)[1] & 0x07)
+
+#define H265_NAL_VPS 32
+#define H265_NAL_SPS 33
+#define H265_NAL_PPS 34
+
+#define H265_AP 48
+#define H265_FU 49
+
+#define RB16(x) ((((uint8_t*)(x))[0] << 8) | ((uint8_t*)(x))[1])
+
+static void frag_fu(uint8_t *nal, size_t fragsize, gboolean last, Track *tr)
+{
+    gboolean start = true;
+    const uint8_t payload_header[2] = {
+        (nal[0] & 0x81) | (H265_FU << 1),
+        nal[1]
+    };
+    const uint8_t fu_header = H265_NAL_TYPE(nal);
+
+    nal += H265_NAL_HEADER_SIZE;
+    fragsize -= H265_NAL_HEADER_SIZE;
+
+    while (fragsize > 0) {
+        const size_t fraglen = MIN(DEFAULT_MTU - 3, fragsize);
+        struct MParserBuffer *buffer = mparser_buffer_new_slice(tr, nal, fraglen);
+
+        buffer->prefix[0] = payload_header[0];
+        buffer->prefix[1] = payload_header[1];
+        buffer->prefix[2] = fu_header;
+        buffer->prefix_size = 3;
+
+        if ( start ) {
+            buffer->prefix[2] |= (1<<7);
+            start = false;
+        }
+
+        if (fraglen == fragsize) {
+            buffer->marker = last;
+            buffer->prefix[2] |= (1<<6);
+        }
+
+        fnc_log(FNC_LOG_VERBOSE, "[h265] Frag %02x%02x%02x", buffer->prefix[0],
+                buffer->prefix[1], buffer->prefix[2]);
+
+        track_write(tr, buffer);
+
+        fragsize -= fraglen;
+        nal      += fraglen;
+    }
+}
+
+/**
+ * @brief Find the next NAL unit of an Annex B bitstream
+ *
+ * @param p Where to start looking from; moved past the NAL unit found
+ * @param end End of the bitstream
+ * @param size Where to store the size of the NAL unit found
+ *
+ * @return The NAL unit found, without its start code nor trailing
+ *         zero bytes, or NULL if there is none left.
+ */
+static uint8_t *annexb_next_nal(uint8_t **p, uint8_t *end, size_t *size)
+{
+    uint8_t *nal = (uint8_t *)startcode_find(*p, end), *nal_end;
+
+    if (nal == end)
+        return NULL;
+
+    nal += 3;
+    nal_end = *p = (uint8_t *)startcode_find(nal, end);
+
+    /* trailing_zero_8bits, and the leading zero of four-byte start
+     * codes */
+    while (nal_end > nal && nal_end[-1] == 0)
+        nal_end--;
+
+    *size = nal_end - nal;
+    return nal;
+}
+
+/**
+ * @brief Add a parameter set to the sprop-vps, sprop-sps and
+ *        sprop-pps lists
+ */
+static void sprop_add(GString *sprops[3], const uint8_t *nal, size_t size)
+{
+    const unsigned int type = H265_NAL_TYPE(nal);
+    gchar *buf;
+
+    if (type < H265_NAL_VPS || type > H265_NAL_PPS)
+        return;
+
+    if (sprops[type - H265_NAL_VPS] == NULL)
+        sprops[type - H265_NAL_VPS] = g_string_new(NULL);
+    else
+        g_string_append_c(sprops[type - H265_NAL_VPS], ',');
+
+    buf = g_base64_encode(nal, size);
+    g_string_append(sprops[type - H265_NAL_VPS], buf);
+    g_free(buf);
+}
+
+/**
+ * @brief Collect the parameter sets of an hvcC configuration record
+ *
+ * @retval false The record is truncated
+ */
+static gboolean encode_hvcc_header(const uint8_t *p, size_t len,
+                                   GString *sprops[3])
+{
+    const uint8_t *end = p + len;
+    unsigned int arrays, i, j;
+
+    arrays = p[22];
+    p += 23;
+
+    for (i = 0; i < arrays; i++) {
+        unsigned int count;
+
+        if (end - p < 3)
+            return false;
+        count = RB16(p + 1);
+        p += 3;
+
+        for (j = 0; j < count; j++) {
+            size_t nalsize;
+
+            if (end - p < 2)
+                return false;
+            nalsize = RB16(p);
+            p += 2;
+
+            if ((size_t)(end - p) < nalsize)
+                return false;
+            if (nalsize >= H265_NAL_HEADER_SIZE)
+                sprop_add(sprops, p, nalsize);
+            p += nalsize;
+        }
+    }
+
+    return true;
+}
+
+int h265_init(Track *track)
+{
+    static const char *const sprop_names[3] = {
+        "sprop-vps", "sprop-sps", "sprop-pps"
+    };
+    GString *sprops[3] = { NULL, NULL, NULL };
+    GString *fmtp = g_string_new(NULL);
+    unsigned int i;
+    int res = -1;
+
+    if (track->extradata_len >= 23 && track->extradata[0] == 1) {
+        track->h265.nal_length_size = (track->extradata[21] & 0x03) + 1;
+        track->h265.is_hvcc = true;
+        if (!encode_hvcc_header(track->extradata, track->extradata_len,
+                                sprops))
+            goto err_alloc;
+    } else {
+        uint8_t *p = track->extradata, *nal;
+        uint8_t *end = p + track->extradata_len;
+        size_t nalsize;
+
+        while ((nal = annexb_next_nal(&p, end, &nalsize)) != NULL)
+            if (nalsize >= H265_NAL_HEADER_SIZE)
+                sprop_add(sprops, nal, nalsize);
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (sprops[i] == NULL)
+            continue;
+
+        g_string_append_printf(fmtp, "%s%s=%s", fmtp->len ? "; " : "",
+                               sprop_names[i], sprops[i]->str);
+    }
+
+    /* No parameter set to tell the clients about */
+    if (fmtp->len == 0)
+        goto err_alloc;
+
+    sdp_descr_append_rtpmap(track);
+    g_string_append_printf(track->sdp_description,
+                           "a=fmtp:%u %s\r\n",
+
+                           /* fmtp */
+                           track->payload_type,
+                           fmtp->str);
+
+    res = 0;
+
+ err_alloc:
+    for (i = 0; i < 3; i++)
+        if (sprops[i] != NULL)
+            g_string_free(sprops[i], true);
+    g_string_free(fmtp, true);
+
+    return res;
+}
+
+/*  Aggregation packet (RFC 7798, section 4.4.2)
+ *
+ *  +---------------+---------------+---------------+---------------+
+ *  |  PayloadHdr (Type=48)         |         NALU 1 size           |
+ *  +---------------+---------------+---------------+---------------+
+ *  |  NALU 1 ...
+ *  +---------------+------ - -
+ *
+ *  followed by the size and data of each other NAL unit.
+ */
+
+/**
+ * @brief Maximum number of NAL units aggregated in a single packet
+ */
+#define H265_AP_NALS 16
+
+/**
+ * @brief NAL units waiting to be sent in a single packet
+ */
+struct h265_ap {
+    uint8_t *nal[H265_AP_NALS];
+    size_t size[H265_AP_NALS];
+    unsigned int count;
+    /** Size of the aggregation packet holding them all */
+    size_t length;
+};
+
+/**
+ * @brief Send the NAL units waiting in an aggregation
+ *
+ * A lone NAL unit is sent as is, more are sent in an aggregation
+ * packet.
+ */
+static void h265_ap_flush(Track *tr, struct h265_ap *ap, gboolean last)
+{
+    struct MParserBuffer *buffer;
+
+    if (ap->count == 0)
+        return;
+
+    if (ap->count == 1) {
+        buffer = mparser_buffer_new_slice(tr, ap->nal[0], ap->size[0]);
+        fnc_log(FNC_LOG_VERBOSE, "[h265] single NAL %d",
+                H265_NAL_TYPE(ap->nal[0]));
+    } else {
+        uint8_t f = 0, layer_id = 0x3f, tid = 0x07, *p;
+        unsigned int i;
+
+        buffer = mparser_buffer_new(tr, ap->length);
+        p = buffer->data + H265_NAL_HEADER_SIZE;
+
+        for (i = 0; i < ap->count; i++) {
+            /* F is set if any unit has it, LayerId and TID are the
+             * lowest ones */
+            f |= ap->nal[i][0] & 0x80;
+            layer_id = MIN(layer_id, H265_NAL_LAYER_ID(ap->nal[i]));
+            tid = MIN(tid, H265_NAL_TID(ap->nal[i]));
+
+            p[0] = ap->size[i] >> 8;
+            p[1] = ap->size[i] & 0xff;
+            memcpy(p + 2, ap->nal[i], ap->size[i]);
+            p += 2 + ap->size[i];
+        }
+
+        buffer->data[0] = f | (H265_AP << 1) | (layer_id >> 5);
+        buffer->data[1] = ((layer_id & 0x1f) << 3) | tid;
+        fnc_log(FNC_LOG_VERBOSE, "[h265] AP of %u NALs", ap->count);
+    }
+
+    buffer->marker = last;
+    track_write(tr, buffer);
+
+    ap->count = 0;
+    ap->length = H265_NAL_HEADER_SIZE;
+}
+
+/**
+ * @brief Packetize a NAL unit of the access unit being parsed
+ *
+ * @param tr The track being parsed
+ * @param ap The NAL units waiting to be aggregated
+ * @param nal The NAL unit to send
+ * @param nalsize Size of the NAL unit
+ * @param last Whether this is the last NAL unit of the access unit;
+ *             the marker is set on its last packet only.
+ */
+static void h265_send_nal(Track *tr, struct h265_ap *ap,
+                          uint8_t *nal, size_t nalsize, gboolean last)
+{
+    if (ap->count == H265_AP_NALS ||
+        ap->length + 2 + nalsize > DEFAULT_MTU)
+        h265_ap_flush(tr, ap, false);
+
+    if (ap->length + 2 + nalsize <= DEFAULT_MTU) {
+        ap->nal[ap->count] = nal;
+        ap->size[ap->count] = nalsize;
+        ap->count++;
+        ap->length += 2 + nalsize;
+    } else if (DEFAULT_MTU >= nalsize) {
+        struct MParserBuffer *buffer =
+            mparser_buffer_new_slice(tr, nal, nalsize);
+
+        buffer->marker = last;
+
+        track_write(tr, buffer);
+
+        fnc_log(FNC_LOG_VERBOSE, "[h265] single NAL %d", H265_NAL_TYPE(nal));
+    } else {
+        frag_fu(nal, nalsize, last, tr);
+    }
+
+    if (last)
+        h265_ap_flush(tr, ap, true);
+}
+
+int h265_parse(Track *tr, uint8_t *data, ssize_t len)
+{
+    uint8_t *end = data + len;
+    struct h265_ap ap = { .count = 0, .length = H265_NAL_HEADER_SIZE };
+    /* Each NAL unit is sent once the next one is found, so that the
+     * last one of the access unit is known */
+    uint8_t *prev = NULL, *nal;
+    size_t prev_size = 0, nalsize;
+
+    if (tr->h265.is_hvcc) {
+        const size_t nal_length_size = tr->h265.nal_length_size;
+
+        while ((size_t)(end - data) > nal_length_size) {
+            unsigned int i;
+
+            nalsize = 0;
+            for (i = 0; i < nal_length_size; i++)
+                nalsize = (nalsize << 8) | *data++;
+
+            if (nalsize > (size_t)(end - data)) {
+                fnc_log(FNC_LOG_VERBOSE, "[h265] hvcC: nal size %zu", nalsize);
+                break;
+            }
+
+            if (nalsize >= H265_NAL_HEADER_SIZE) {
+                if (prev)
+                    h265_send_nal(tr, &ap, prev, prev_size, false);
+                prev = data;
+                prev_size = nalsize;
+            }
+            data += nalsize;
+        }
+    } else {
+        while ((nal = annexb_next_nal(&data, end, &nalsize)) != NULL) {
+            if (nalsize < H265_NAL_HEADER_SIZE)
+                continue;
+
+            if (prev)
+                h265_send_nal(tr, &ap, prev, prev_size, false);
+            prev = nal;
+            prev_size = nalsize;
+        }
+    }
+
+    if (prev == NULL)
+        return -1;
+
+    h265_send_nal(tr, &ap, prev, prev_size, true);
+
+    fnc_log(FNC_LOG_VERBOSE, "[h265] Frame completed");
+    return 0;
+}
@@ -46,17 +46,12 @@ int mp4ves_init(Track *track)
 int mp4ves_parse(Track *tr, uint8_t *data, ssize_t len)
 {
     do {
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        struct MParserBuffer *buffer =
+            mparser_buffer_new_slice(tr, data, MIN(DEFAULT_MTU, len));
 
-        buffer->timestamp = tr->pts;
-        buffer->delivery = tr->dts;
-        buffer->duration = tr->frame_duration;
         buffer->marker = (len <= DEFAULT_MTU);
 
-        buffer->data_size = MIN(DEFAULT_MTU, len);
-        buffer->data = g_malloc(buffer->data_size);
-
-        memcpy(buffer->data, data, buffer->data_size);
+        track_write(tr, buffer);
 
         len -= DEFAULT_MTU;
         data += DEFAULT_MTU;
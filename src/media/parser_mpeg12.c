@@ -26,36 +26,24 @@
 #include <arpa/inet.h>
 
 #include "media/media.h"
+#include "media/startcode.h"
 
-// Stolen from ffmpeg (mpegvideo.c)
+/**
+ * @brief Find the next start code and its value
+ *
+ * @return Pointer to the byte following the start code value, or @p
+ *         end if there is none; @p state is set to the whole start
+ *         code (0x000001xx) when found.
+ */
 static uint8_t *find_start_code(uint8_t *p, uint8_t *end, uint32_t *state)
 {
-    int i;
+    const uint8_t *r = startcode_find(p, end);
 
-    if(p>=end)
+    if (end - r < 4)
         return end;
 
-    for(i=0; i<3; i++){
-        uint32_t tmp= *state << 8;
-        *state= tmp + *(p++);
-        if(tmp == 0x100 || p==end)
-            return p;
-    }
-
-    while(p<end){
-        if     (p[-1] > 1      ) p+= 3;
-        else if(p[-2]          ) p+= 2;
-        else if(p[-3]|(p[-1]-1)) p++;
-        else{
-            p++;
-            break;
-        }
-    }
-
-    p= MIN(p, end)-4;
-    *state= (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | (p[3]);
-
-    return p+4;
+    *state = 0x100 | r[3];
+    return (uint8_t *)r + 4;
 }
 
 /* Source code taken from ff_rtp_send_mpegvideo (ffmpeg libavformat) and
@@ -144,18 +132,13 @@ int mpv_parse(Track *tr, uint8_t *data, ssize_t len)
                 ffc;
             uint32_t header_n = htonl(header_h);
 
-            struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+            struct MParserBuffer *buffer =
+                mparser_buffer_new_slice(tr, data, payload);
 
-            buffer->timestamp = tr->pts;
-            buffer->delivery = tr->dts;
-            buffer->duration = tr->frame_duration;
             buffer->marker = (payload == rem);
 
-            buffer->data_size = payload + 4;
-            buffer->data = g_malloc(buffer->data_size);
-
-            memcpy(buffer->data, &header_n, sizeof(header_n));
-            memcpy(buffer->data + 4, data, payload);
+            memcpy(buffer->prefix, &header_n, sizeof(header_n));
+            buffer->prefix_size = sizeof(header_n);
 
             track_write(tr, buffer);
 
@@ -0,0 +1,82 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Opus parser (RFC 7587)
+ *
+ * Each Opus packet coming from the demuxer is sent as is, in its own
+ * RTP packet; Opus packets are never fragmented nor aggregated.
+ */
+
+#include <config.h>
+
+#include <stdbool.h>
+
+#include "media/media.h"
+#include "fnc_log.h"
+
+int opus_init(Track *track)
+{
+    /* Multichannel streams need a mapping RFC 7587 does not cover */
+    if (track->audio_channels > 2) {
+        fnc_log(FNC_LOG_ERR, "[opus] %d channels are not supported",
+                track->audio_channels);
+        return -1;
+    }
+
+    /* The rtpmap is always the same, whatever the actual sampling
+     * rate and number of channels */
+    g_string_append_printf(track->sdp_description,
+                           "a=rtpmap:%u opus/48000/2\r\n"
+                           "a=fmtp:%u stereo=%d; sprop-stereo=%d; "
+                           "useinbandfec=1\r\n",
+                           track->payload_type,
+
+                           /* fmtp */
+                           track->payload_type,
+                           track->audio_channels == 2,
+                           track->audio_channels == 2);
+
+    return 0;
+}
+
+int opus_parse(Track *tr, uint8_t *data, ssize_t len)
+{
+    struct MParserBuffer *buffer;
+
+    if (len > DEFAULT_MTU) {
+        fnc_log(FNC_LOG_WARN, "[opus] %zd bytes packet too big, discarding",
+                len);
+        return -1;
+    }
+
+    buffer = mparser_buffer_new_slice(tr, data, len);
+
+    /* the marker only starts a talkspurt after discontinuous
+     * transmission, and the demuxer doesn't tell */
+    buffer->marker = false;
+
+    track_write(tr, buffer);
+
+    return 0;
+}
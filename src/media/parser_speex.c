@@ -33,16 +33,9 @@ int speex_parse(Track *tr, uint8_t *data, ssize_t len)
     if (len > DEFAULT_MTU)
         return -1;
 
-    buffer = g_slice_new0(struct MParserBuffer);
-
-    buffer->timestamp = tr->pts;
-    buffer->delivery = tr->dts;
-    buffer->duration = tr->frame_duration;
+    buffer = mparser_buffer_new_slice(tr, data, len);
     buffer->marker = true;
 
-    buffer->data_size = len;
-    buffer->data = g_memdup(data, buffer->data_size);
-
     track_write(tr, buffer);
 
     return 0;
@@ -58,19 +58,13 @@ int vp8_parse(Track *tr, uint8_t *data, ssize_t len)
     uint8_t prefix[HEADER_SIZE] = { (data[0] & 1 ? 0 : 2) | VP8_START_PACKET };
 
     do {
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        struct MParserBuffer *buffer =
+            mparser_buffer_new_slice(tr, data, MIN(MAX_PAYLOAD_SIZE, len));
 
-        buffer->timestamp = tr->pts;
-        buffer->delivery = tr->dts;
-        buffer->duration = tr->frame_duration;
         buffer->marker = (len <= MAX_PAYLOAD_SIZE);
 
-        buffer->data_size = MIN(MAX_PAYLOAD_SIZE, len) + HEADER_SIZE;
-        buffer->data = g_malloc(buffer->data_size);
-
-        memcpy(buffer->data, &prefix[0], HEADER_SIZE);
-        memcpy(buffer->data + HEADER_SIZE, data,
-               buffer->data_size - HEADER_SIZE);
+        memcpy(buffer->prefix, &prefix[0], HEADER_SIZE);
+        buffer->prefix_size = HEADER_SIZE;
 
         track_write(tr, buffer);
 
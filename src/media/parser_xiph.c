@@ -41,7 +41,8 @@ int xiph_parse(Track *tr, uint8_t *data, ssize_t len)
     do {
         uint16_t payload_size;
 
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        struct MParserBuffer *buffer =
+            mparser_buffer_new_slice(tr, data, MIN(MAX_PAYLOAD_SIZE, len));
 
         if ( fragment == 0 && len <= MAX_PAYLOAD_SIZE )
             fragment = 1;
@@ -52,27 +53,19 @@ int xiph_parse(Track *tr, uint8_t *data, ssize_t len)
         else
             fragment = 3 << 6; /* max frag */
 
-        buffer->timestamp = tr->pts;
-        buffer->delivery = tr->dts;
-        buffer->duration = tr->frame_duration;
         buffer->marker = (len <= MAX_PAYLOAD_SIZE);
 
-        buffer->data_size = MIN(MAX_PAYLOAD_SIZE, len) + HEADER_SIZE;
-        buffer->data = g_malloc(buffer->data_size);
-
-        payload_size = htons(buffer->data_size - HEADER_SIZE);
+        payload_size = htons(buffer->data_size);
 
         /* 0..2 */
-        buffer->data[0] = tr->xiph.ident[0];
-        buffer->data[1] = tr->xiph.ident[1];
-        buffer->data[2] = tr->xiph.ident[2];
+        buffer->prefix[0] = tr->xiph.ident[0];
+        buffer->prefix[1] = tr->xiph.ident[1];
+        buffer->prefix[2] = tr->xiph.ident[2];
         /* 3 */
-        buffer->data[3] = fragment;
+        buffer->prefix[3] = fragment;
         /* 4..5 */
-        memcpy(buffer->data + 4, &payload_size, sizeof(payload_size));
-        /* 6.. */
-        memcpy(buffer->data + HEADER_SIZE, data,
-               buffer->data_size - HEADER_SIZE);
+        memcpy(buffer->prefix + 4, &payload_size, sizeof(payload_size));
+        buffer->prefix_size = HEADER_SIZE;
 
         track_write(tr, buffer);
 
@@ -49,6 +49,8 @@ static Resource *sd2_open(const char *url)
 
 #ifdef HAVE_AVFORMAT
 extern Resource *avf_open(const char *url);
+extern Resource *hint_open(const char *url);
+extern void hint_schedule(const char *url);
 #else
 static Resource *avf_open(const char *url);
 {
@@ -58,8 +60,41 @@ static Resource *avf_open(const char *url);
 
     return false;
 }
+
+static Resource *hint_open(ATTR_UNUSED const char *url)
+{
+    return NULL;
+}
+
+static void hint_schedule(ATTR_UNUSED const char *url)
+{
+}
 #endif
 
+/**
+ * @brief Open a stored resource
+ *
+ * @param url The resolved URL of the resource within the vhost.
+ *
+ * @return Pointer to a new Resource designed by @p url, or NULL in
+ *         case of error.
+ *
+ * The resource is served from its hint file when a valid one is
+ * present; otherwise it's demuxed, and the hint file is queued for
+ * generation (if enabled).
+ */
+static Resource *r_open_stored(const char *url)
+{
+    Resource *r;
+
+    if ( (r = hint_open(url)) != NULL )
+        return r;
+
+    hint_schedule(url);
+
+    return avf_open(url);
+}
+
 /**
  * @brief Mutex regulating access to virtual resources
  *
@@ -130,6 +165,395 @@ static Resource *r_open_virtual(const char *url)
     return r;
 }
 
+/**
+ * @brief Mutex regulating access to shared stored resources
+ *
+ * This mutex should be held when looking up, adding to or removing
+ * from @ref shared_resources, and when changing the @ref
+ * Resource::stored::count of a resource in it.
+ */
+static GStaticMutex shared_resources_lock = G_STATIC_MUTEX_INIT;
+
+/**
+ * @brief Shared stored resources table
+ *
+ * Connect the URL of a stored resource with the Resource instance
+ * that is demuxing it for all the clients, when the shared-demuxing
+ * option is enabled for the vhost.
+ *
+ * @note To access this table, you need to hold @ref
+ *       shared_resources_lock.
+ */
+static GHashTable *shared_resources;
+
+/**
+ * @brief Retrieve or create the shared resource for a stored file
+ *
+ * @param url The resolved URL of the resource within the vhost.
+ *
+ * @return Pointer to the Resource designed by @p url or NULL in case
+ *         of error.
+ *
+ * Only one demuxer is opened for each file, however many clients
+ * request it; the clients then read the same track queues, see @ref
+ * r_play for how their playback positions are reconciled.
+ *
+ * @see r_open
+ */
+static Resource *r_open_shared(const char *url)
+{
+    Resource *r;
+
+    g_static_mutex_lock(&shared_resources_lock);
+
+    if ( ! shared_resources )
+        shared_resources = g_hash_table_new(g_str_hash, g_str_equal);
+
+    if ( (r = g_hash_table_lookup(shared_resources, url)) != NULL )
+        r->stored.count++;
+    else if ( (r = r_open_stored(url)) != NULL ) {
+        r->stored.shared_url = g_strdup(url);
+        r->stored.count = 1;
+        g_hash_table_insert(shared_resources, r->stored.shared_url, r);
+    }
+
+    g_static_mutex_unlock(&shared_resources_lock);
+    return r;
+}
+
+/**
+ * @brief Open a private copy of a shared resource
+ *
+ * @param resource The shared resource to copy
+ *
+ * @return A new Resource for the same URL as @p resource, private to
+ *         the caller, or NULL in case of error.
+ *
+ * This is used by sessions that cannot play the shared resource at
+ * the position the other sessions are at; @p resource is left
+ * untouched, and should be closed by the caller once it switched to
+ * the new one.
+ */
+Resource *r_unshare(Resource *resource)
+{
+    g_assert(resource->source != LIVE_SOURCE);
+    g_assert(resource->stored.shared_url != NULL);
+
+    return r_open_stored(resource->stored.shared_url);
+}
+
+/**
+ * @brief Release a reference to a set of renditions
+ */
+static void r_renditions_unref(ResourceRenditions *renditions)
+{
+    guint i;
+
+    if ( !g_atomic_int_dec_and_test(&renditions->refs) )
+        return;
+
+    for ( i = 0; i < renditions->count; i++ )
+        g_free(renditions->entries[i].url);
+
+    g_free(renditions->entries);
+    g_slice_free(ResourceRenditions, renditions);
+}
+
+/**
+ * @brief Sort renditions by decreasing bitrate
+ *
+ * @internal This function should only be used by @ref
+ *           r_renditions_load.
+ */
+static int r_renditions_cmp(const void *a, const void *b)
+{
+    const struct ResourceRendition *ra = a, *rb = b;
+
+    return (ra->bitrate < rb->bitrate) - (ra->bitrate > rb->bitrate);
+}
+
+/**
+ * @brief Load a renditions manifest
+ *
+ * @param url The resolved URL of the manifest within the vhost.
+ *
+ * @return A new set of renditions, with one reference owned by the
+ *         caller, or NULL in case of error.
+ *
+ * The manifest has the same key-file syntax as the sd2 files: each
+ * group is a rendition, with the file it's stored in (mrl, relative
+ * to the manifest) and its bitrate in kilobits per second (bitrate).
+ */
+static ResourceRenditions *r_renditions_load(const char *url)
+{
+    ResourceRenditions *renditions = NULL;
+    GKeyFile *file = g_key_file_new();
+    gchar *path = g_strjoin("/", feng_default_vhost->document_root, url, NULL);
+    gchar *dir = g_path_get_dirname(url);
+    gchar **groups = NULL;
+    gsize count = 0, i;
+
+    if ( !g_key_file_load_from_file(file, path, G_KEY_FILE_NONE, NULL) ||
+         (groups = g_key_file_get_groups(file, &count)) == NULL ||
+         count == 0 ) {
+        fnc_log(FNC_LOG_ERR, "[abr] unable to read renditions from '%s'",
+                path);
+        goto end;
+    }
+
+    renditions = g_slice_new0(ResourceRenditions);
+    renditions->refs = 1;
+    renditions->entries = g_new0(struct ResourceRendition, count);
+
+    for ( i = 0; i < count; i++ ) {
+        gchar *mrl = g_key_file_get_string(file, groups[i], "mrl", NULL);
+        gint bitrate = g_key_file_get_integer(file, groups[i], "bitrate", NULL);
+
+        /* The rendition has to stay within the vhost, see r_open */
+        if ( mrl == NULL || mrl[0] == '/' || strstr(mrl, "..") != NULL ||
+             bitrate <= 0 ) {
+            fnc_log(FNC_LOG_ERR, "[abr] invalid rendition '%s' in '%s'",
+                    groups[i], path);
+            g_free(mrl);
+            continue;
+        }
+
+        renditions->entries[renditions->count].url =
+            g_strjoin("/", dir, mrl, NULL);
+        renditions->entries[renditions->count].bitrate = bitrate;
+        renditions->count++;
+
+        g_free(mrl);
+    }
+
+    if ( renditions->count == 0 ) {
+        r_renditions_unref(renditions);
+        renditions = NULL;
+        goto end;
+    }
+
+    qsort(renditions->entries, renditions->count,
+          sizeof(struct ResourceRendition), r_renditions_cmp);
+
+ end:
+    g_strfreev(groups);
+    g_free(dir);
+    g_free(path);
+    g_key_file_free(file);
+    return renditions;
+}
+
+/**
+ * @brief Open the resource for a renditions manifest
+ *
+ * @param url The resolved URL of the manifest within the vhost.
+ *
+ * @return Pointer to a new Resource for the highest-bitrate
+ *         rendition, or NULL in case of error.
+ *
+ * The sessions start with the best rendition, and switch to the
+ * others depending on the reception reported by their clients.
+ *
+ * @note Renditions are never shared, as each session switches on its
+ *       own.
+ */
+static Resource *r_open_renditions(const char *url)
+{
+    ResourceRenditions *renditions;
+    Resource *r;
+
+    if ( (renditions = r_renditions_load(url)) == NULL )
+        return NULL;
+
+    if ( (r = r_open_stored(renditions->entries[0].url)) == NULL ) {
+        r_renditions_unref(renditions);
+        return NULL;
+    }
+
+    r->renditions = renditions;
+    r->rendition = 0;
+
+    return r;
+}
+
+/**
+ * @brief Open another rendition of a set
+ *
+ * @param renditions The renditions the resource is one of
+ * @param rendition Index of the rendition to open
+ *
+ * @return A new Resource for the rendition, private to the caller, or
+ *         NULL in case of error.
+ */
+static Resource *r_open_rendition(ResourceRenditions *renditions,
+                                  guint rendition)
+{
+    Resource *r;
+
+    g_assert_cmpuint(rendition, <, renditions->count);
+
+    if ( (r = r_open_stored(renditions->entries[rendition].url)) == NULL )
+        return NULL;
+
+    g_atomic_int_inc(&renditions->refs);
+    r->renditions = renditions;
+    r->rendition = rendition;
+
+    return r;
+}
+
+/**
+ * @brief Rendition being opened for a switch
+ *
+ * Owned by both the requester and the thread preparing it, the last
+ * one to let go frees it, closing the resource if nobody took it.
+ *
+ * @see r_prepare_rendition
+ */
+struct ResourcePending {
+    /** Reference counter, for the requester and the thread */
+    gint refs;
+    /** RESOURCE_BUSY until the thread is done, then its result */
+    gint status;
+    ResourceRenditions *renditions;
+    guint rendition;
+    /** Time the new rendition is seeked to */
+    double time;
+    /** The prepared rendition, until taken by @ref r_rendition_ready */
+    Resource *resource;
+};
+
+/**
+ * @brief Maximum number of renditions prepared at once
+ */
+#define RESOURCE_PREPARE_THREADS 2
+
+/**
+ * @brief Lock for the lazy creation of @ref prepare_pool
+ */
+static GStaticMutex prepare_lock = G_STATIC_MUTEX_INIT;
+
+/**
+ * @brief Pool of threads opening and seeking the renditions
+ *
+ * Probing the demuxer and seeking can take a while, and would stall
+ * all the clients of a worker if done in its thread.
+ */
+static GThreadPool *prepare_pool;
+
+static void r_pending_unref(ResourcePending *pending)
+{
+    if ( !g_atomic_int_dec_and_test(&pending->refs) )
+        return;
+
+    r_close(pending->resource);
+    r_renditions_unref(pending->renditions);
+    g_slice_free(ResourcePending, pending);
+}
+
+static void r_prepare_cb(gpointer pending_p, ATTR_UNUSED gpointer unused)
+{
+    ResourcePending *pending = pending_p;
+    Resource *r = NULL;
+
+    /* Don't bother if the requester gave up already */
+    if ( g_atomic_int_get(&pending->refs) > 1 &&
+         (r = r_open_rendition(pending->renditions,
+                               pending->rendition)) != NULL &&
+         r_play(r, pending->time) != RESOURCE_OK ) {
+        r_close(r);
+        r = NULL;
+    }
+
+    pending->resource = r;
+    g_atomic_int_set(&pending->status, r ? RESOURCE_OK : RESOURCE_ERR);
+
+    r_pending_unref(pending);
+}
+
+/**
+ * @brief Start preparing another rendition of a resource
+ *
+ * @param resource A resource opened from a renditions manifest
+ * @param rendition Index of the rendition to open
+ * @param time The time in seconds to seek the rendition to
+ *
+ * @return The pending rendition, to be checked with @ref
+ *         r_rendition_ready until it's ready, or released with @ref
+ *         r_rendition_cancel.
+ *
+ * The rendition is opened and seeked in a separate thread; @p
+ * resource is left untouched, and can be closed meanwhile.
+ */
+ResourcePending *r_prepare_rendition(Resource *resource, guint rendition,
+                                     double time)
+{
+    ResourcePending *pending = g_slice_new0(ResourcePending);
+
+    g_assert(resource->renditions != NULL);
+
+    pending->refs = 2;
+    pending->status = RESOURCE_BUSY;
+    pending->renditions = resource->renditions;
+    pending->rendition = rendition;
+    pending->time = time;
+
+    g_atomic_int_inc(&pending->renditions->refs);
+
+    g_static_mutex_lock(&prepare_lock);
+    if ( prepare_pool == NULL )
+        prepare_pool = g_thread_pool_new(r_prepare_cb, NULL,
+                                         RESOURCE_PREPARE_THREADS,
+                                         false, NULL);
+    g_thread_pool_push(prepare_pool, pending, NULL);
+    g_static_mutex_unlock(&prepare_lock);
+
+    return pending;
+}
+
+/**
+ * @brief Check whether a pending rendition is ready
+ *
+ * @param pending The pending rendition to check
+ * @param resource Where to store the prepared rendition
+ *
+ * @retval RESOURCE_BUSY The rendition is still being prepared.
+ * @retval RESOURCE_OK The rendition is ready, and @p resource is set
+ *                     to it; the caller owns it now, and has to close
+ *                     it with @ref r_close.
+ * @retval RESOURCE_ERR The rendition couldn't be opened or seeked.
+ *
+ * Unless RESOURCE_BUSY is returned, @p pending is released and is no
+ * longer valid.
+ */
+int r_rendition_ready(ResourcePending *pending, Resource **resource)
+{
+    const int status = g_atomic_int_get(&pending->status);
+
+    if ( status == RESOURCE_BUSY )
+        return status;
+
+    *resource = pending->resource;
+    pending->resource = NULL;
+
+    r_pending_unref(pending);
+
+    return status;
+}
+
+/**
+ * @brief Give up a pending rendition
+ *
+ * @param pending The pending rendition to release, or NULL
+ *
+ * The rendition is closed once prepared, if it's not already.
+ */
+void r_rendition_cancel(ResourcePending *pending)
+{
+    if ( pending != NULL )
+        r_pending_unref(pending);
+}
+
 /**
  * @brief Retrieve or create the resource for a given URL
  *
@@ -147,14 +571,18 @@ static Resource *r_open_virtual(const char *url)
  *       error code when the resource is not found, not accessible or
  *       not readable.
  *
- * @see r_open_virtual
+ * @see r_open_virtual, r_open_renditions, r_open_shared
  */
 Resource *r_open(const char *url)
 {
     if ( g_str_has_prefix(url, "/virtual/") )
         return r_open_virtual(url + strlen("/virtual/"));
+    else if ( g_str_has_suffix(url, ".abr") )
+        return r_open_renditions(url);
+    else if ( feng_default_vhost->shared_demuxing )
+        return r_open_shared(url);
     else
-        return avf_open(url);
+        return r_open_stored(url);
 }
 
 /**
@@ -217,6 +645,24 @@ static void r_track_producer_reset_queue(gpointer element,
     track_reset_queue(t);
 }
 
+/**
+ * @brief Seek a resource, with its lock already held
+ *
+ * @see r_seek
+ */
+static int r_seek_unlocked(Resource *resource, double time)
+{
+    int res = resource->seek(resource, time);
+
+    g_list_foreach(resource->tracks, r_track_producer_reset_queue, NULL);
+
+    /* We might be starting over after reaching the end */
+    if ( res == 0 )
+        g_atomic_int_set(&resource->eor, 0);
+
+    return res;
+}
+
 /**
  * @brief Seek a resource to a given time in stream
  *
@@ -232,19 +678,101 @@ int r_seek(Resource *resource, double time) {
 
     g_mutex_lock(resource->lock);
 
-    res = resource->seek(resource, time);
+    res = r_seek_unlocked(resource, time);
 
-    g_list_foreach(resource->tracks, r_track_producer_reset_queue, NULL);
+    g_mutex_unlock(resource->lock);
+
+    return res;
+}
+
+/**
+ * @brief Start playing a resource from a given time
+ *
+ * @param resource The Resource to play
+ * @param time The time in seconds within the stream to start from
+ *
+ * @retval RESOURCE_OK The resource has been seeked to @p time (if
+ *                     it's seekable at all).
+ * @retval RESOURCE_BUSY The resource is shared and other sessions
+ *                       are playing it already, so it was not
+ *                       seeked; the caller can either join them at
+ *                       their current position or open its own copy
+ *                       with @ref r_unshare.
+ * @retval RESOURCE_ERR The seek failed.
+ *
+ * Unless an error is returned, the caller is counted as playing a
+ * shared resource, and has to call @ref r_stop once it stops.
+ *
+ * @note This function will lock the @ref Resource::lock mutex.
+ */
+int r_play(Resource *resource, double time) {
+    const gboolean shared = resource->source != LIVE_SOURCE &&
+        resource->stored.shared_url != NULL;
+    int res = RESOURCE_OK;
+
+    g_mutex_lock(resource->lock);
+
+    if ( shared && resource->stored.playing > 0 )
+        res = RESOURCE_BUSY;
+    else if ( resource->seek != NULL &&
+              r_seek_unlocked(resource, time) )
+        res = RESOURCE_ERR;
+
+    if ( shared && res != RESOURCE_ERR )
+        resource->stored.playing++;
 
     g_mutex_unlock(resource->lock);
 
     return res;
 }
 
+/**
+ * @brief Stop playing a resource
+ *
+ * @param resource The Resource the session stopped playing
+ *
+ * Balances a successful @ref r_play call; it's no-op for resources
+ * that are not shared.
+ *
+ * @note This function will lock the @ref Resource::lock mutex.
+ */
+void r_stop(Resource *resource) {
+    if ( resource->source == LIVE_SOURCE ||
+         resource->stored.shared_url == NULL )
+        return;
+
+    g_mutex_lock(resource->lock);
+
+    g_assert_cmpint(resource->stored.playing, >, 0);
+    resource->stored.playing--;
+
+    g_mutex_unlock(resource->lock);
+}
+
+/**
+ * @brief Tells how many buffers are queued for a shared resource
+ *
+ * @param resource The shared resource to check
+ *
+ * @return The lowest count of buffers queued for the most advanced
+ *         consumer of each track, see @ref bq_producer_unseen.
+ */
+static gulong r_shared_unseen(Resource *resource)
+{
+    gulong unseen = G_MAXULONG;
+    GList *it;
+
+    for ( it = resource->tracks; it != NULL; it = it->next )
+        unseen = MIN(unseen, bq_producer_unseen(it->data));
+
+    return unseen;
+}
+
 /**
  * @brief Callback for the queue filling for the resource
  *
- * @param consumer_p A generic pointer to the consumer for non-live queues
+ * @param consumer_p A generic pointer to the consumer for non-live,
+ *                   non-shared queues
  * @param resource_p A generic pointer to the resource to fill the queue of
  *
  * This function takes care of reading the data from the demuxer (via
@@ -277,8 +805,12 @@ static void r_read_cb(gpointer consumer_p, gpointer resource_p)
 
         /* Only check for enough buffered frames if we're not doing
            live; otherwise keep on filling; we also assume that
-           consumer will be NULL in that case. */
-        if ( bq_consumer_unseen(consumer) >= buffered_frames )
+           consumer will be NULL in that case. Shared resources are
+           filled for all their consumers at once. */
+        if ( resource->stored.shared_url != NULL ) {
+            if ( r_shared_unseen(resource) >= buffered_frames )
+                return;
+        } else if ( bq_consumer_unseen(consumer) >= buffered_frames )
             return;
 
         //        fprintf(stderr, "r_read_cb(%p)\n", resource);
@@ -316,8 +848,9 @@ static void free_track(gpointer element,
  *
  * @param resource The resource to close
  *
- * For virtual resources, closing the resource will not actually free
- * anything; only the count value will be decremented.
+ * For virtual and shared resources, closing the resource will not
+ * actually free anything until the last user closes it; only the
+ * count value will be decremented.
  *
  * This function stops the fill thread for a resource, before freeing
  * it. It's accomplished by first setting @ref Resource::fill_pool
@@ -336,6 +869,20 @@ void r_close(Resource *resource)
         return;
     }
 
+    if ( resource->stored.shared_url != NULL ) {
+        g_static_mutex_lock(&shared_resources_lock);
+
+        if ( --resource->stored.count > 0 ) {
+            g_static_mutex_unlock(&shared_resources_lock);
+            return;
+        }
+
+        g_hash_table_remove(shared_resources, resource->stored.shared_url);
+        g_static_mutex_unlock(&shared_resources_lock);
+
+        g_free(resource->stored.shared_url);
+    }
+
     if ( (pool = resource->stored.fill_pool) ) {
         g_atomic_pointer_set(&resource->stored.fill_pool, NULL);
         g_thread_pool_free(pool, true, true);
@@ -354,6 +901,9 @@ void r_close(Resource *resource)
         g_list_free(resource->tracks);
     }
 
+    if ( resource->renditions != NULL )
+        r_renditions_unref(resource->renditions);
+
     g_slice_free(Resource, resource);
 }
 
@@ -363,7 +913,8 @@ void r_close(Resource *resource)
  * @param resource The resource to pause
  *
  * This function stops the "fill thread" for the resource, when it is
- * not shared among clients (i.e.: it's not a live resource).
+ * not shared among clients (i.e.: it's not a live resource), or when
+ * no session is playing it anymore (see @ref r_stop).
  *
  * It removes @ref Resource::fill_pool and sets it to NULL to stop the
  * thread running.
@@ -384,6 +935,13 @@ void r_pause(Resource *resource)
 
     g_mutex_lock(resource->lock);
 
+    /* Keep on reading for the other sessions still playing it */
+    if ( resource->stored.shared_url != NULL &&
+         resource->stored.playing > 0 ) {
+        g_mutex_unlock(resource->lock);
+        return;
+    }
+
     pool = resource->stored.fill_pool;
     g_atomic_pointer_set(&resource->stored.fill_pool, NULL);
     g_thread_pool_free(pool, true, true);
@@ -445,8 +1003,12 @@ void r_fill(Resource *resource, struct RTP_session *consumer)
     if ( resource->stored.fill_pool == NULL )
         goto end;
 
+    /* Shared resources are filled for all the consumers, and a
+       pushed consumer might be gone before its turn comes */
     g_thread_pool_push(resource->stored.fill_pool,
-                       consumer, NULL);
+                       resource->stored.shared_url != NULL ?
+                       (gpointer)resource : consumer,
+                       NULL);
 
  end:
     g_mutex_unlock(resource->lock);
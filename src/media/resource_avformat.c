@@ -160,6 +160,16 @@ Resource *avf_open(const char *url)
             track->parse = h264_parse;
             break;
 
+        case AV_CODEC_ID_HEVC:
+            if (!codec->extradata_size)
+                goto err_alloc;
+
+            encoding_name = "H265";
+            parser_init = h265_init;
+
+            track->parse = h265_parse;
+            break;
+
         case AV_CODEC_ID_MP2:
         case AV_CODEC_ID_MP3:
             track->payload_type = 14;
@@ -192,6 +202,14 @@ Resource *avf_open(const char *url)
             track->parse = speex_parse;
             break;
 
+        case AV_CODEC_ID_OPUS:
+            encoding_name = "opus";
+            parser_init = opus_init;
+
+            track->clock_rate = 48000;
+            track->parse = opus_parse;
+            break;
+
         case AV_CODEC_ID_AAC:
             if ( codec->extradata_size == 0 ) {
                 AVPacket pkt;
@@ -359,10 +377,18 @@ Resource *avf_open(const char *url)
     return false;
 }
 
+static void avf_packet_free(gpointer pkt_gen)
+{
+    AVPacket *pkt = pkt_gen;
+
+    av_free_packet(pkt);
+    g_slice_free(AVPacket, pkt);
+}
+
 static int avf_read_packet(Resource * r)
 {
     int ret = RESOURCE_OK;
-    AVPacket pkt;
+    AVPacket pkt, *owned;
     AVStream *stream;
     AVBitStreamFilterContext *bsfc;
     Track *tr;
@@ -372,8 +398,10 @@ retry:
     if(av_read_frame(r->stored.avfc, &pkt) < 0)
         return RESOURCE_EOF; //FIXME
 
-    if ( (tr = r->stored.tracks[pkt.stream_index]) == NULL )
+    if ( (tr = r->stored.tracks[pkt.stream_index]) == NULL ) {
+        av_free_packet(&pkt);
         goto retry;
+    }
 
     // push it to the framer
     stream = r->stored.avfc->streams[pkt.stream_index];
@@ -416,6 +444,20 @@ retry:
     fnc_log(FNC_LOG_VERBOSE, "[avf] packet duration %f",
             tr->frame_duration);
 
+    /* Make sure the packet owns its data, and hand it over to a
+     * block, so that the buffers created by the parser can refer to
+     * it after we're done here. */
+    if ( av_dup_packet(&pkt) < 0 ) {
+        av_free_packet(&pkt);
+        return RESOURCE_ERR;
+    }
+
+    owned = g_slice_dup(AVPacket, &pkt);
+    tr->block = mparser_block_new(owned->data, owned->size,
+                                  avf_packet_free, owned);
+    tr->keyframe = !!(pkt.flags & AV_PKT_FLAG_KEY);
+    tr->frame_size = pkt.size;
+
     bsfc = stream->codec->opaque;
     if (bsfc) {
         uint8_t *data = NULL;
@@ -429,7 +471,10 @@ retry:
         ret = tr->parse(tr, pkt.data, pkt.size);
     }
 
-    av_free_packet(&pkt);
+    mparser_block_unref(tr->block);
+    tr->block = NULL;
+    tr->keyframe = false;
+    tr->frame_size = 0;
 
     return ret;
 }
@@ -0,0 +1,714 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Hint files backend
+ *
+ * A hint file keeps the RTP payloads of a stored resource, as
+ * produced by the demuxer and the payload parsers, so that it can be
+ * served straight from a memory mapping.
+ *
+ * The file is made of a @ref hint_header, followed by one @ref
+ * hint_track descriptor per track, the @ref hint_record entries in
+ * delivery order, and finally the @ref hint_index of the keyframes
+ * used for seeking. All the structures are 8-bytes aligned and use
+ * the host's byte order, as the files are only meant to be used by
+ * the server that generated them.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+
+#include "media/media.h"
+
+extern Resource *avf_open(const char *url);
+
+#define HINT_MAGIC "FENGHNT"
+#define HINT_VERSION 1
+#define HINT_SUFFIX ".fhint"
+
+#define HINT_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+#define HINT_RECORD_MARKER   0x01
+#define HINT_RECORD_KEYFRAME 0x02
+
+struct hint_header {
+    char magic[8];              /*!< @ref HINT_MAGIC */
+    uint32_t version;           /*!< @ref HINT_VERSION */
+    uint32_t tracks_count;
+    int64_t media_mtime;        /*!< modification time of the resource */
+    uint64_t media_size;        /*!< size of the resource */
+    double duration;
+    uint64_t records_offset;    /*!< first record, after the tracks */
+    uint64_t index_offset;      /*!< index, after the last record */
+    uint64_t index_count;
+};
+
+struct hint_track {
+    uint32_t size;              /*!< descriptor size, strings and padding included */
+    int32_t payload_type;
+    uint32_t clock_rate;
+    int32_t media_type;
+    int32_t audio_channels;
+    uint32_t name_size;         /*!< name length, NUL included */
+    uint32_t encoding_size;     /*!< encoding name length, NUL included */
+    uint32_t sdp_size;          /*!< SDP description length, NUL included */
+    double frame_duration;
+    char strings[];             /*!< name, encoding name, SDP description */
+};
+
+struct hint_record {
+    double timestamp;
+    double delivery;
+    double duration;
+    uint32_t size;              /*!< record size, payload and padding included */
+    uint32_t data_size;
+    uint16_t track;
+    uint8_t flags;              /*!< HINT_RECORD_* flags */
+    uint8_t prefix_size;
+    uint32_t frame_size;        /*!< size of the whole frame, 0 if unknown */
+    uint8_t payload[];          /*!< payload header, then payload data */
+};
+
+struct hint_index {
+    double time;                /*!< delivery time of the keyframe */
+    uint64_t offset;            /*!< offset of its record */
+};
+
+/**
+ * @brief State of a mapped hint file
+ *
+ * The structure is owned by @ref block, which is referenced by the
+ * buffers sent from the mapping, so that it's unmapped after the last
+ * one is gone.
+ */
+struct hint_file {
+    struct MParserBlock *block;
+    uint8_t *data;
+    size_t size;
+    const struct hint_header *header;
+
+    uint64_t offset;            /*!< next record to read */
+};
+
+/**
+ * @brief Get the path of the hint file for a resource
+ *
+ * @param url The resolved URL of the resource within the vhost
+ *
+ * @return A newly allocated path, or NULL if hint files are not
+ *         enabled for the vhost.
+ */
+static gchar *hint_path(const char *url)
+{
+    const char *root = feng_default_vhost->hint_root;
+
+    if ( root == NULL )
+        return NULL;
+
+    return g_strconcat(root, "/", url, HINT_SUFFIX, NULL);
+}
+
+static void hint_file_free(gpointer hint_gen)
+{
+    struct hint_file *hint = hint_gen;
+
+    munmap(hint->data, hint->size);
+    g_slice_free(struct hint_file, hint);
+}
+
+static int hint_read_packet(Resource *r)
+{
+    struct hint_file *hint = r->stored.hint;
+    const struct hint_record *rec;
+    struct MParserBuffer *buffer;
+    Track *tr;
+
+    if ( hint->offset >= hint->header->index_offset )
+        return RESOURCE_EOF;
+
+    rec = (const struct hint_record *)(hint->data + hint->offset);
+
+    if ( hint->header->index_offset - hint->offset < sizeof(*rec) ||
+         rec->size % 8 != 0 ||
+         rec->size < sizeof(*rec) + rec->prefix_size + (uint64_t)rec->data_size ||
+         rec->size > hint->header->index_offset - hint->offset ||
+         rec->track >= hint->header->tracks_count ||
+         rec->prefix_size > MPARSER_PREFIX_MAX ) {
+        fnc_log(FNC_LOG_ERR, "[hint] %s: corrupted record at %llu",
+                r->mrl, (unsigned long long)hint->offset);
+        return RESOURCE_ERR;
+    }
+
+    hint->offset += rec->size;
+
+    tr = r->stored.tracks[rec->track];
+    tr->pts = rec->timestamp;
+    tr->dts = rec->delivery;
+    tr->frame_duration = rec->duration;
+    tr->keyframe = !!(rec->flags & HINT_RECORD_KEYFRAME);
+    tr->frame_size = rec->frame_size;
+
+    /* The payload is referenced straight from the mapping */
+    tr->block = hint->block;
+    buffer = mparser_buffer_new_slice(tr, rec->payload + rec->prefix_size,
+                                      rec->data_size);
+    tr->block = NULL;
+
+    memcpy(buffer->prefix, rec->payload, rec->prefix_size);
+    buffer->prefix_size = rec->prefix_size;
+    buffer->marker = !!(rec->flags & HINT_RECORD_MARKER);
+    tr->frame_size = 0;
+
+    track_write(tr, buffer);
+
+    return RESOURCE_OK;
+}
+
+/**
+ * @brief Seek to the last keyframe at or before the given time
+ */
+static int hint_seek(Resource *r, double time_sec)
+{
+    struct hint_file *hint = r->stored.hint;
+    const struct hint_index *index =
+        (const struct hint_index *)(hint->data + hint->header->index_offset);
+    uint64_t low = 0, high = hint->header->index_count;
+
+    fnc_log(FNC_LOG_DEBUG, "[hint] Seeking to %f", time_sec);
+
+    /* find the first entry after time_sec */
+    while ( low < high ) {
+        const uint64_t mid = low + (high - low)/2;
+
+        if ( index[mid].time <= time_sec )
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    hint->offset = hint->header->records_offset;
+
+    if ( low > 0 &&
+         index[low - 1].offset >= hint->header->records_offset &&
+         index[low - 1].offset < hint->header->index_offset &&
+         index[low - 1].offset % 8 == 0 )
+        hint->offset = index[low - 1].offset;
+
+    return 0;
+}
+
+static void hint_uninit(gpointer rgen)
+{
+    Resource *r = rgen;
+
+    if ( r->stored.hint != NULL )
+        mparser_block_unref(r->stored.hint->block);
+
+    g_free(r->stored.tracks);
+}
+
+/**
+ * @brief Check the header and the index of a mapped hint file
+ */
+static gboolean hint_check(const struct hint_file *hint,
+                           const struct stat *media_st)
+{
+    const struct hint_header *header = hint->header;
+
+    if ( hint->size < sizeof(*header) ||
+         memcmp(header->magic, HINT_MAGIC, sizeof(header->magic)) != 0 ||
+         header->version != HINT_VERSION )
+        return false;
+
+    if ( header->media_mtime != (int64_t)media_st->st_mtime ||
+         header->media_size != (uint64_t)media_st->st_size )
+        return false;
+
+    return header->tracks_count > 0 &&
+        header->records_offset >= sizeof(*header) &&
+        header->records_offset % 8 == 0 &&
+        header->records_offset <= header->index_offset &&
+        header->index_offset <= hint->size &&
+        header->index_offset % 8 == 0 &&
+        header->index_count <= (hint->size - header->index_offset) /
+                               sizeof(struct hint_index);
+}
+
+/**
+ * @brief Create the tracks described in a mapped hint file
+ */
+static gboolean hint_load_tracks(Resource *r, const struct hint_file *hint)
+{
+    const struct hint_header *header = hint->header;
+    uint64_t offset = sizeof(*header);
+    uint32_t i;
+
+    r->stored.tracks = g_new0(Track*, header->tracks_count);
+
+    for ( i = 0; i < header->tracks_count; i++ ) {
+        const struct hint_track *desc =
+            (const struct hint_track *)(hint->data + offset);
+        const char *name, *encoding, *sdp;
+        Track *track;
+
+        if ( header->records_offset - offset < sizeof(*desc) ||
+             desc->size < sizeof(*desc) || desc->size % 8 != 0 ||
+             desc->size > header->records_offset - offset ||
+             desc->name_size == 0 || desc->encoding_size == 0 ||
+             desc->sdp_size == 0 ||
+             (uint64_t)desc->name_size + desc->encoding_size + desc->sdp_size >
+             desc->size - sizeof(*desc) )
+            return false;
+
+        name = desc->strings;
+        encoding = name + desc->name_size;
+        sdp = encoding + desc->encoding_size;
+
+        if ( name[desc->name_size - 1] != '\0' ||
+             encoding[desc->encoding_size - 1] != '\0' ||
+             sdp[desc->sdp_size - 1] != '\0' )
+            return false;
+
+        track = track_new(g_strdup(name));
+
+        /* The description already has the control attribute */
+        g_string_assign(track->sdp_description, sdp);
+
+        track->encoding_name = g_strdup(encoding);
+        track->payload_type = desc->payload_type;
+        track->clock_rate = desc->clock_rate;
+        track->media_type = desc->media_type;
+        track->audio_channels = desc->audio_channels;
+        track->frame_duration = desc->frame_duration;
+        track->parent = r;
+
+        r->stored.tracks[i] = track;
+        r->tracks = g_list_append(r->tracks, track);
+
+        offset += desc->size;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Open a stored resource through its hint file
+ *
+ * @param url The resolved URL of the resource within the vhost
+ *
+ * @return A new Resource serving the content of the hint file, or
+ *         NULL if hint files are disabled, or the hint file is
+ *         missing, corrupted, or older than the resource.
+ */
+Resource *hint_open(const char *url)
+{
+    gchar *path = hint_path(url), *mrl = NULL;
+    struct stat media_st, hint_st;
+    struct hint_file *hint = NULL;
+    Resource *r = NULL;
+    void *data;
+    int fd = -1;
+
+    if ( path == NULL )
+        return NULL;
+
+    mrl = g_strjoin("/",
+                    feng_default_vhost->document_root,
+                    url,
+                    NULL);
+
+    if ( stat(mrl, &media_st) < 0 ||
+         (fd = open(path, O_RDONLY|O_CLOEXEC)) < 0 ||
+         fstat(fd, &hint_st) < 0 ||
+         hint_st.st_size < (off_t)sizeof(struct hint_header) )
+        goto error;
+
+    data = mmap(NULL, hint_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if ( data == MAP_FAILED ) {
+        fnc_perror("mmap");
+        goto error;
+    }
+
+    madvise(data, hint_st.st_size, MADV_SEQUENTIAL);
+
+    hint = g_slice_new0(struct hint_file);
+    hint->data = data;
+    hint->size = hint_st.st_size;
+    hint->header = data;
+    hint->block = mparser_block_new(hint->data, hint->size,
+                                    hint_file_free, hint);
+
+    if ( !hint_check(hint, &media_st) ) {
+        fnc_log(FNC_LOG_DEBUG, "[hint] %s is stale or invalid", path);
+        goto error;
+    }
+
+    r = g_slice_new0(Resource);
+    r->stored.hint = hint;
+
+    if ( !hint_load_tracks(r, hint) ) {
+        fnc_log(FNC_LOG_ERR, "[hint] %s: corrupted tracks", path);
+        goto error;
+    }
+
+    hint->offset = hint->header->records_offset;
+
+    r->mrl = mrl;
+    r->lock = g_mutex_new();
+    r->mtime = media_st.st_mtime;
+    r->duration = hint->header->duration;
+
+    r->read_packet = hint_read_packet;
+    r->seek = hint_seek;
+    r->uninit = hint_uninit;
+
+    fnc_log(FNC_LOG_DEBUG, "[hint] serving %s from %s", url, path);
+
+    close(fd);
+    g_free(path);
+    return r;
+
+ error:
+    if ( r != NULL ) {
+        GList *it;
+
+        for ( it = r->tracks; it != NULL; it = it->next )
+            track_free(it->data);
+        g_list_free(r->tracks);
+        g_free(r->stored.tracks);
+        g_slice_free(Resource, r);
+    }
+
+    if ( hint != NULL )
+        mparser_block_unref(hint->block);
+
+    if ( fd >= 0 )
+        close(fd);
+
+    g_free(mrl);
+    g_free(path);
+    return NULL;
+}
+
+/**
+ * @brief State of a hint file being recorded
+ */
+struct hint_writer {
+    FILE *file;
+    GList *tracks;              /*!< the resource's tracks, to number them */
+    Track *index_track;         /*!< track whose keyframes are indexed */
+    GArray *index;              /*!< @ref hint_index entries */
+    uint64_t offset;            /*!< offset of the next record */
+    gboolean error;
+};
+
+static void hint_write(struct hint_writer *writer,
+                       const void *data, size_t size)
+{
+    if ( size > 0 && !writer->error &&
+         fwrite(data, size, 1, writer->file) != 1 )
+        writer->error = true;
+
+    writer->offset += size;
+}
+
+static void hint_write_padding(struct hint_writer *writer)
+{
+    static const uint8_t padding[8];
+
+    hint_write(writer, padding, HINT_ALIGN(writer->offset) - writer->offset);
+}
+
+/**
+ * @brief Track sink recording the parsed buffers
+ *
+ * @see Track::sink
+ */
+static void hint_write_buffer(Track *tr, struct MParserBuffer *buffer,
+                              gpointer writer_gen)
+{
+    struct hint_writer *writer = writer_gen;
+    struct hint_record rec = {
+        .timestamp = buffer->timestamp,
+        .delivery = buffer->delivery,
+        .duration = buffer->duration,
+        .size = HINT_ALIGN(sizeof(rec) + mparser_buffer_size(buffer)),
+        .data_size = buffer->data_size,
+        .track = g_list_index(writer->tracks, tr),
+        .prefix_size = buffer->prefix_size,
+        .frame_size = buffer->frame_size,
+    };
+
+    if ( buffer->marker )
+        rec.flags |= HINT_RECORD_MARKER;
+    if ( buffer->keyframe )
+        rec.flags |= HINT_RECORD_KEYFRAME;
+
+    if ( buffer->keyframe && tr == writer->index_track ) {
+        struct hint_index entry = {
+            .time = buffer->delivery,
+            .offset = writer->offset
+        };
+
+        g_array_append_val(writer->index, entry);
+    }
+
+    hint_write(writer, &rec, sizeof(rec));
+    hint_write(writer, buffer->prefix, buffer->prefix_size);
+    hint_write(writer, buffer->data, buffer->data_size);
+    hint_write_padding(writer);
+
+    mparser_buffer_unref(buffer);
+}
+
+static void hint_write_track(struct hint_writer *writer, Track *track)
+{
+    struct hint_track desc = {
+        .payload_type = track->payload_type,
+        .clock_rate = track->clock_rate,
+        .media_type = track->media_type,
+        .audio_channels = track->audio_channels,
+        .name_size = strlen(track->name) + 1,
+        .encoding_size = strlen(track->encoding_name) + 1,
+        .sdp_size = track->sdp_description->len + 1,
+        .frame_duration = track->frame_duration,
+    };
+
+    desc.size = HINT_ALIGN(sizeof(desc) +
+                           desc.name_size +
+                           desc.encoding_size +
+                           desc.sdp_size);
+
+    hint_write(writer, &desc, sizeof(desc));
+    hint_write(writer, track->name, desc.name_size);
+    hint_write(writer, track->encoding_name, desc.encoding_size);
+    hint_write(writer, track->sdp_description->str, desc.sdp_size);
+    hint_write_padding(writer);
+}
+
+/**
+ * @brief Record the hint file for a stored resource
+ *
+ * @param url The resolved URL of the resource within the vhost
+ *
+ * The resource is demuxed and parsed in full, with the tracks' output
+ * diverted to the file; the file is written under a temporary name
+ * and moved in place once complete, so that it's never mapped while
+ * partially written.
+ */
+static void hint_generate(const char *url)
+{
+    gchar *path = hint_path(url), *tmp = NULL, *dir;
+    struct hint_writer writer = { .file = NULL };
+    struct hint_header header = { .version = HINT_VERSION };
+    struct stat media_st;
+    Resource *r;
+    GList *it;
+    int fd, res;
+
+    if ( path == NULL || (r = avf_open(url)) == NULL ) {
+        g_free(path);
+        return;
+    }
+
+    if ( stat(r->mrl, &media_st) < 0 ) {
+        fnc_perror("stat");
+        goto end;
+    }
+
+    dir = g_path_get_dirname(path);
+    res = g_mkdir_with_parents(dir, 0755);
+    g_free(dir);
+
+    tmp = g_strconcat(path, ".XXXXXX", NULL);
+
+    if ( res < 0 || (fd = g_mkstemp(tmp)) < 0 ) {
+        fnc_log(FNC_LOG_ERR, "[hint] unable to create %s: %s",
+                tmp, strerror(errno));
+        g_free(tmp);
+        tmp = NULL;
+        goto end;
+    }
+
+    if ( (writer.file = fdopen(fd, "wb")) == NULL ) {
+        close(fd);
+        goto end;
+    }
+
+    fnc_log(FNC_LOG_INFO, "[hint] generating %s", path);
+
+    writer.tracks = r->tracks;
+    writer.index = g_array_new(false, false, sizeof(struct hint_index));
+
+    /* The header is rewritten once the offsets are known */
+    hint_write(&writer, &header, sizeof(header));
+
+    for ( it = r->tracks; it != NULL; it = it->next ) {
+        Track *track = it->data;
+
+        /* Index the first video track, if any */
+        if ( writer.index_track == NULL ||
+             (track->media_type == MP_video &&
+              writer.index_track->media_type != MP_video) )
+            writer.index_track = track;
+
+        hint_write_track(&writer, track);
+
+        track->sink = hint_write_buffer;
+        track->sink_data = &writer;
+    }
+
+    memcpy(header.magic, HINT_MAGIC, sizeof(header.magic));
+    header.tracks_count = g_list_length(r->tracks);
+    header.media_mtime = media_st.st_mtime;
+    header.media_size = media_st.st_size;
+    header.duration = r->duration;
+    header.records_offset = writer.offset;
+
+    while ( !writer.error &&
+            (res = r->read_packet(r)) == RESOURCE_OK );
+
+    if ( writer.error || res != RESOURCE_EOF ) {
+        fnc_log(FNC_LOG_ERR, "[hint] unable to generate %s", path);
+        goto end;
+    }
+
+    header.index_offset = writer.offset;
+    header.index_count = writer.index->len;
+
+    hint_write(&writer, writer.index->data,
+               writer.index->len * sizeof(struct hint_index));
+
+    if ( writer.error ||
+         fseeko(writer.file, 0, SEEK_SET) < 0 ||
+         fwrite(&header, sizeof(header), 1, writer.file) != 1 ||
+         fflush(writer.file) != 0 ||
+         fsync(fileno(writer.file)) < 0 ||
+         g_rename(tmp, path) < 0 ) {
+        fnc_log(FNC_LOG_ERR, "[hint] unable to write %s: %s",
+                path, strerror(errno));
+        goto end;
+    }
+
+    fnc_log(FNC_LOG_INFO, "[hint] %s complete, %u keyframes indexed",
+            path, writer.index->len);
+
+    g_free(tmp);
+    tmp = NULL;
+
+ end:
+    for ( it = r->tracks; it != NULL; it = it->next )
+        ((Track*)it->data)->sink = NULL;
+
+    if ( writer.file != NULL )
+        fclose(writer.file);
+
+    if ( writer.index != NULL )
+        g_array_free(writer.index, true);
+
+    if ( tmp != NULL ) {
+        g_unlink(tmp);
+        g_free(tmp);
+    }
+
+    r_close(r);
+    g_free(path);
+}
+
+/**
+ * @brief Mutex protecting @ref hint_pool and @ref hint_pending
+ */
+static GStaticMutex hint_lock = G_STATIC_MUTEX_INIT;
+
+/**
+ * @brief Pool of one thread generating the hint files
+ *
+ * Generating a hint file means demuxing the whole resource, so only
+ * one is generated at a time, at low priority compared to serving.
+ */
+static GThreadPool *hint_pool;
+
+/**
+ * @brief URLs whose hint file is queued for generation
+ */
+static GHashTable *hint_pending;
+
+static void hint_generate_cb(gpointer url_gen, ATTR_UNUSED gpointer unused)
+{
+    gchar *url = url_gen;
+
+    hint_generate(url);
+
+    g_static_mutex_lock(&hint_lock);
+    g_hash_table_remove(hint_pending, url);
+    g_static_mutex_unlock(&hint_lock);
+}
+
+/**
+ * @brief Queue the generation of the hint file for a resource
+ *
+ * @param url The resolved URL of the resource within the vhost
+ *
+ * This is called when a resource is opened without a valid hint
+ * file; it's a no-op if hint files are disabled or if the generation
+ * for the same resource is queued already.
+ */
+void hint_schedule(const char *url)
+{
+    gchar *key;
+
+    if ( feng_default_vhost->hint_root == NULL )
+        return;
+
+    g_static_mutex_lock(&hint_lock);
+
+    if ( hint_pool == NULL ) {
+        hint_pending = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             g_free, NULL);
+        hint_pool = g_thread_pool_new(hint_generate_cb, NULL,
+                                      1, false, NULL);
+    }
+
+    if ( g_hash_table_lookup(hint_pending, url) == NULL ) {
+        key = g_strdup(url);
+        g_hash_table_insert(hint_pending, key, key);
+        g_thread_pool_push(hint_pool, key, NULL);
+    }
+
+    g_static_mutex_unlock(&hint_lock);
+}
@@ -57,6 +57,83 @@ struct flux_msg {
 
 static gpointer flux_read_messages(gpointer ptr);
 
+/**
+ * @brief Tell whether an RTP payload starts an H.264 random access point
+ *
+ * Parameter sets and IDR slices start one, whether they are sent in
+ * single NAL unit packets, as first unit of a STAP-A, or in the first
+ * fragment of an FU-A (RFC 6184).
+ */
+static gboolean live_h264_keyframe(const uint8_t *data, size_t len)
+{
+    uint8_t type;
+
+    if ( len < 2 )
+        return false;
+
+    switch ( (type = data[0] & 0x1f) ) {
+    case 24: /* STAP-A: NAL unit size (2 bytes), then the unit */
+        if ( len < 4 )
+            return false;
+        type = data[3] & 0x1f;
+        break;
+    case 28: /* FU-A: start fragments only */
+        if ( !(data[1] & 0x80) )
+            return false;
+        type = data[1] & 0x1f;
+        break;
+    }
+
+    return type == 5 || type == 7;
+}
+
+/**
+ * @brief Tell whether an RTP payload starts an MPEG-4 Visual random
+ *        access point
+ *
+ * Visual object sequence and group of VOP headers start one, and so
+ * does an intra-coded VOP (RFC 3016).
+ */
+static gboolean live_mp4ves_keyframe(const uint8_t *data, size_t len)
+{
+    if ( len < 4 || data[0] != 0 || data[1] != 0 || data[2] != 1 )
+        return false;
+
+    switch ( data[3] ) {
+    case 0xb0: /* visual_object_sequence_start_code */
+    case 0xb3: /* group_of_vop_start_code */
+        return true;
+    case 0xb6: /* vop_start_code, vop_coding_type 0 is I-VOP */
+        return len > 4 && (data[4] >> 6) == 0;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Set the keyframe flag of a live track for the next buffer
+ *
+ * Only the first packet of a random access point is flagged, the
+ * other packets of the same access unit share its RTP timestamp.
+ */
+static void live_track_keyframe(Track *tr, const uint8_t *data, size_t len,
+                                uint32_t rtp_timestamp)
+{
+    gboolean keyframe = false;
+
+    if ( strcmp(tr->encoding_name, "H264") == 0 )
+        keyframe = live_h264_keyframe(data, len);
+    else if ( strcmp(tr->encoding_name, "MP4V-ES") == 0 )
+        keyframe = live_mp4ves_keyframe(data, len);
+
+    if ( !keyframe ||
+         (tr->gop_valid && rtp_timestamp == tr->live.keyframe_timestamp) )
+        return;
+
+    tr->keyframe = true;
+    tr->live.keyframe_timestamp = rtp_timestamp;
+}
+
 /**
  * @brief Uninitialisation function for the demuxer_sd fake parser
  *
@@ -311,6 +388,13 @@ Resource *sd2_open(const char *url)
                                    track->payload_type,
                                    tmpstr);
 
+        /* Only the video encodings whose keyframes are recognised by
+           live_track_keyframe() can keep a group of pictures */
+        track->gop_cache = feng_srv.live_gop_cache &&
+            track->media_type == MP_video &&
+            ( strcmp(track->encoding_name, "H264") == 0 ||
+              strcmp(track->encoding_name, "MP4V-ES") == 0 );
+
         tracks = g_list_append(tracks, track);
         continue;
 
@@ -401,8 +485,11 @@ static gpointer flux_read_messages(gpointer ptr) {
              * Note that we don't need to use atomic operations
              * because, even if there are no consumers but we did keep
              * the loop running, we'd just be creating extra objects.
+             *
+             * Tracks keeping a group of pictures queue them anyway,
+             * so that the first client can start from a keyframe.
              */
-            if ( tr->consumers == 0 )
+            if ( tr->consumers == 0 && !tr->gop_cache )
                 continue;
 
             delta = ev_time() - message->insertion_time;
@@ -436,7 +523,15 @@ static gpointer flux_read_messages(gpointer ptr) {
                 }
             }
 
-            buffer = g_slice_new0(struct MParserBuffer);
+            if ( tr->gop_cache )
+                live_track_keyframe(tr, message->data,
+                                    msg_len - sizeof(struct flux_msg),
+                                    package_timestamp);
+
+            /* The message buffer is reused for the next read, so
+             * the payload is copied here. */
+            buffer = mparser_buffer_new_slice(tr, message->data,
+                                              msg_len - sizeof(struct flux_msg));
 
             buffer->timestamp = timestamp;
             buffer->delivery = message->start_time + delivery;
@@ -446,9 +541,6 @@ static gpointer flux_read_messages(gpointer ptr) {
             buffer->seq_no = seq_no;
             buffer->rtp_timestamp = package_timestamp;
 
-            buffer->data_size = msg_len - sizeof(struct flux_msg);;
-            buffer->data = g_memdup(message->data, buffer->data_size);
-
 #if 0
             fprintf(stderr, "[%s] packet TS:%5.4f DELIVERY:%5.4f -> %5.4f (%5.4f)\n",
                     tr->live.mq_path,
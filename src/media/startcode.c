@@ -0,0 +1,226 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Start code scanner for Annex B style bitstreams
+ *
+ * The SIMD kernels compare sixteen or thirty-two positions at once,
+ * and leave the last few bytes of the buffer to the portable kernel.
+ * On x86 the kernel is chosen the first time @ref startcode_find is
+ * called, depending on the features of the CPU; NEON is used whenever
+ * the build targets it.
+ */
+
+#include <config.h>
+
+#include <stdbool.h>
+
+#include "media/startcode.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    ((__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) || \
+     defined(__clang__))
+# define STARTCODE_X86 1
+# include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+# define STARTCODE_NEON 1
+# include <arm_neon.h>
+#endif
+
+//Ripped directly from ffmpeg, but for the bounds: a start code in
+//the last three bytes is found too
+
+static const uint8_t *startcode_find_c(const uint8_t *p, const uint8_t *end)
+{
+    const uint8_t *a = p + 4 - ((intptr_t)p & 3);
+
+    for (end -= 2; p < a && p < end; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+            return p;
+    }
+
+    for (end -= 3; p < end; p += 4) {
+        uint32_t x = *(const uint32_t*)p;
+//      if ((x - 0x01000100) & (~x) & 0x80008000) // little endian
+//      if ((x - 0x00010001) & (~x) & 0x00800080) // big endian
+        if ((x - 0x01010101) & (~x) & 0x80808080) { // generic
+            if (p[1] == 0) {
+                if (p[0] == 0 && p[2] == 1)
+                    return p;
+                if (p[2] == 0 && p[3] == 1)
+                    return p+1;
+            }
+            if (p[3] == 0) {
+                if (p[2] == 0 && p[4] == 1)
+                    return p+2;
+                if (p[4] == 0 && p[5] == 1)
+                    return p+3;
+            }
+        }
+    }
+
+    for (end += 3; p < end; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+            return p;
+    }
+
+    return end + 2;
+}
+
+#ifdef STARTCODE_X86
+static gboolean startcode_sse2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static gboolean startcode_avx2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+/* Each lane i is set if the bytes at i, i + 1 and i + 2 are 00 00 01,
+ * so the loads reach two bytes past the lanes compared. */
+
+__attribute__((target("sse2")))
+static const uint8_t *startcode_find_sse2(const uint8_t *p, const uint8_t *end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+
+    for ( ; end - p >= 16 + 2; p += 16 ) {
+        const __m128i b0 = _mm_loadu_si128((const __m128i*)p);
+        const __m128i b1 = _mm_loadu_si128((const __m128i*)(p + 1));
+        const __m128i b2 = _mm_loadu_si128((const __m128i*)(p + 2));
+        const unsigned int mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero),
+                                        _mm_cmpeq_epi8(b1, zero)),
+                          _mm_cmpeq_epi8(b2, one)));
+
+        if ( mask )
+            return p + __builtin_ctz(mask);
+    }
+
+    return startcode_find_c(p, end);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *startcode_find_avx2(const uint8_t *p, const uint8_t *end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+
+    for ( ; end - p >= 32 + 2; p += 32 ) {
+        const __m256i b0 = _mm256_loadu_si256((const __m256i*)p);
+        const __m256i b1 = _mm256_loadu_si256((const __m256i*)(p + 1));
+        const __m256i b2 = _mm256_loadu_si256((const __m256i*)(p + 2));
+        const unsigned int mask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero),
+                                              _mm256_cmpeq_epi8(b1, zero)),
+                             _mm256_cmpeq_epi8(b2, one)));
+
+        if ( mask )
+            return p + __builtin_ctz(mask);
+    }
+
+    return startcode_find_c(p, end);
+}
+#endif
+
+#ifdef STARTCODE_NEON
+static const uint8_t *startcode_find_neon(const uint8_t *p, const uint8_t *end)
+{
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+
+    for ( ; end - p >= 16 + 2; p += 16 ) {
+        const uint8x16_t match =
+            vandq_u8(vandq_u8(vceqq_u8(vld1q_u8(p), zero),
+                              vceqq_u8(vld1q_u8(p + 1), zero)),
+                     vceqq_u8(vld1q_u8(p + 2), one));
+        const uint64x2_t lanes = vreinterpretq_u64_u8(match);
+
+        /* there's no movemask, look for the lane in the half hit */
+        if ( vgetq_lane_u64(lanes, 0) | vgetq_lane_u64(lanes, 1) )
+            return startcode_find_c(p, p + 16 + 2);
+    }
+
+    return startcode_find_c(p, end);
+}
+#endif
+
+const struct startcode_kernel startcode_kernels[] = {
+#ifdef STARTCODE_X86
+    { "avx2", startcode_find_avx2, startcode_avx2_supported },
+    { "sse2", startcode_find_sse2, startcode_sse2_supported },
+#endif
+#ifdef STARTCODE_NEON
+    { "neon", startcode_find_neon, NULL },
+#endif
+    { "c", startcode_find_c, NULL },
+    { NULL, NULL, NULL }
+};
+
+static const uint8_t *startcode_find_dispatch(const uint8_t *p,
+                                              const uint8_t *end);
+
+/**
+ * @brief Kernel used by @ref startcode_find
+ *
+ * Set by the first call; concurrent first calls all store the same
+ * value, so there's no need to lock.
+ */
+static startcode_find_fn startcode_find_impl = startcode_find_dispatch;
+
+static const uint8_t *startcode_find_dispatch(const uint8_t *p,
+                                              const uint8_t *end)
+{
+    const struct startcode_kernel *kernel = startcode_kernels;
+
+    while ( kernel->supported != NULL && !kernel->supported() )
+        kernel++;
+
+    startcode_find_impl = kernel->find;
+
+    return kernel->find(p, end);
+}
+
+/**
+ * @brief Find the next start code in a buffer
+ *
+ * @param p First byte to look at
+ * @param end Byte past the last one to look at
+ *
+ * @return Pointer to the first byte of the first 00 00 01 sequence
+ *         fully contained between @p p and @p end, or @p end if there
+ *         is none.
+ *
+ * @note Four-byte start codes are found at their second byte.
+ */
+const uint8_t *startcode_find(const uint8_t *p, const uint8_t *end)
+{
+    return startcode_find_impl(p, end);
+}
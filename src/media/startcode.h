@@ -0,0 +1,81 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Start code scanner for Annex B style bitstreams
+ */
+
+#ifndef FN_STARTCODE_H
+#define FN_STARTCODE_H
+
+#include <stdint.h>
+#include <glib.h>
+
+/**
+ * @defgroup startcode Start code scanner
+ *
+ * H.264, H.265, MPEG-1/2 and MPEG-4 Visual bitstreams all delimit
+ * their units with the three bytes 00 00 01; this group finds them,
+ * with the fastest kernel the CPU supports.
+ *
+ * @{
+ */
+
+/**
+ * @brief Signature of the start code scanning kernels
+ *
+ * @param p First byte to look at
+ * @param end Byte past the last one to look at
+ *
+ * @return Pointer to the first byte of the first 00 00 01 sequence
+ *         fully contained between @p p and @p end, or @p end if there
+ *         is none.
+ */
+typedef const uint8_t *(*startcode_find_fn)(const uint8_t *p,
+                                            const uint8_t *end);
+
+/**
+ * @brief A start code scanning kernel
+ */
+struct startcode_kernel {
+    const char *name;
+    startcode_find_fn find;
+    /** Whether the CPU can run the kernel, NULL if it always can */
+    gboolean (*supported)(void);
+};
+
+/**
+ * @brief Kernels built in, fastest first
+ *
+ * The list ends with an entry whose name is NULL; the last kernel
+ * before that is the portable one, always supported.
+ */
+extern const struct startcode_kernel startcode_kernels[];
+
+const uint8_t *startcode_find(const uint8_t *p, const uint8_t *end);
+
+/**
+ * @}
+ */
+
+#endif
@@ -26,6 +26,7 @@
 
 #include "media/media.h"
 #include "network/rtp.h"
+#include "feng.h"
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -47,124 +48,173 @@
  * (i.e.: a demuxer) to read data and feed it to multiple consumers
  * (i.e.: the RTSP clients).
  *
- * The structure is implemented in a very simple way: there is one big
- * double-ended queue for each producer, the elements of this queue
- * are wrappers around the actual buffer structures. Each time the
- * producer reads a buffer, it is added to its queue, with a “seen
- * count” of zero.
- *
- * Each consumer gets, at any time, the pointer to the start of the
- * queue and as it moves on to the following element, the “seen count”
- * gets incremented. Once the seen count reaches the amount of
- * consumers, the element is deleted from the queue.
+ * The queue is a fixed-size ring of buffer pointers, addressed by
+ * free-running sequence numbers: @ref Track::head is the oldest
+ * element still queued, @ref Track::tail the next one to be
+ * written. Each time the producer reads a buffer, it is stored in
+ * the slot of the tail sequence, with a “seen count” of zero, and the
+ * tail is then published atomically.
+ *
+ * Each consumer keeps its own cursor on the ring, and as it moves on
+ * to the following element, the “seen count” gets incremented. Once
+ * the seen count of the head element reaches the amount of consumers,
+ * the producer reclaims it on its next write.
+ *
+ * Only the producer side (writing, reclaiming, resetting, adding and
+ * removing consumers) takes @ref Track::lock; consumers read the
+ * published head and tail with atomic operations, so that reading
+ * and moving never wait on the producer. To avoid freeing an element
+ * that a consumer just picked up, each consumer publishes the element
+ * it is using in @ref RTP_session::hazard; the producer defers
+ * freeing such elements until the hazard is cleared.
  *
  * @{
  */
 
-static inline struct MParserBuffer *GLIST_TO_BQELEM(GList *pointer)
+/**
+ * @brief Size of the ring, in elements
+ *
+ * Has to be a power of two, so that sequence numbers can be mapped to
+ * slots with a simple mask. When the ring is full, the oldest element
+ * is dropped, even if not all the consumers have seen it.
+ */
+#define BQ_RING_SIZE 4096
+
+static inline struct MParserBuffer **BQ_SLOT(Track *producer, gint seq)
 {
-    return (struct MParserBuffer*)pointer->data;
+    return &producer->ring[(guint)seq & (BQ_RING_SIZE - 1)];
 }
 
 /**
- * @brief Ensures the validity of the current element pointer for the consume
+ * @brief Compare two ring sequence numbers
  *
- * @param consumer The consumer to verify the pointer of
- * @return The (validated) current element pointer.
- *
- * Call this function whenever current_element_pointer is going to be
- * used; if any condition happened that would make it unreliable, set
- * it to NULL.
+ * @return A negative value if @p a comes before @p b, zero if they
+ *         are the same, positive otherwise; sequence numbers wrap
+ *         around, so they should never be compared directly.
  */
-static GList *bq_consumer_confirm_pointer(RTP_session *consumer)
+static inline gint BQ_SEQ_DIFF(gint a, gint b)
 {
-    Track *producer = consumer->track;
-    if ( consumer->current_element_pointer == NULL )
-        return NULL;
-
-    if ( producer->queue_serial != consumer->queue_serial ) {
-        bq_debug("C:%p pointer %p reset PQS:%lu < CQS:%lu",
-                consumer,
-                consumer->current_element_pointer,
-                producer->queue_serial,
-                consumer->queue_serial);
-        consumer->current_element_pointer = NULL;
-    } else if ( producer->queue->head &&
-                consumer->last_element_serial < GLIST_TO_BQELEM(producer->queue->head)->seq_no ) {
-        bq_debug("C:%p pointer %p reset LES:%lu:%u < PQHS:%lu:%u",
-                consumer,
-                consumer->current_element_pointer,
-                consumer->queue_serial, consumer->last_element_serial,
-                producer->queue_serial,
-                GLIST_TO_BQELEM(producer->queue->head)->seq_no);
-        consumer->current_element_pointer = NULL;
-        return NULL;
-    }
-
-    return consumer->current_element_pointer;
+    return (gint)((guint)a - (guint)b);
 }
 
-static inline struct MParserBuffer *BQ_OBJECT(RTP_session *consumer)
+static inline gint BQ_SEQ_NEXT(gint seq)
 {
-    GList *c_cep = bq_consumer_confirm_pointer(consumer);
-
-    return c_cep ? GLIST_TO_BQELEM(c_cep) : NULL;
-}
-
-
-static void mparser_buffer_free(struct MParserBuffer *buffer)
-{
-    bq_debug("Free object %p %lu",
-             buffer,
-             buffer->seen);
-
-    g_free(buffer->data);
-    g_slice_free(struct MParserBuffer, buffer);
+    return (gint)((guint)seq + 1);
 }
 
 /**
  * @brief Destroy one by one the elements in
- *        Track::queue.
+ *        Track::deferred.
  *
  * @param elem_generic Element to destroy
- * @param free_func_generic Function to use for destroying the
- *                          elements' payload.
  */
 static void bq_element_free_internal(gpointer elem_generic,
                                      ATTR_UNUSED gpointer unused) {
-    mparser_buffer_free((struct MParserBuffer*)elem_generic);
+    mparser_buffer_unref((struct MParserBuffer*)elem_generic);
 }
 
 /**
- * @brief Resets a producer's queue (unlocked version)
+ * @brief Checks whether an element is in use by any consumer
  *
- * @param producer Producer to reset the queue of
+ * @param producer The producer the element belongs to
+ * @param elem The element to look for
  *
- * @internal This function does not lock the producer and should only
- *           be used by @ref add_track !
- * @note This function will require exclusive access to the producer,
- *       and will thus lock its mutex.
+ * @internal This function has to be called with @ref Track::lock
+ *           held, and only after @ref Track::head has been moved
+ *           past the element.
+ */
+static gboolean bq_producer_hazarded(Track *producer,
+                                     struct MParserBuffer *elem)
+{
+    GSList *it;
+
+    for (it = producer->readers; it != NULL; it = g_slist_next(it)) {
+        RTP_session *consumer = it->data;
+
+        if ( g_atomic_pointer_get(&consumer->hazard) == elem )
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Drop the elements before a given sequence number
  *
- * This function will change the currently-used queue for the
- * producer, so that a discontinuity will allow the consumers not to
- * worry about getting old buffers.
+ * @param producer The producer to drop the elements of
+ * @param new_head The sequence number of the new head element
+ *
+ * @internal This function has to be called with @ref Track::lock
+ *           held.
+ *
+ * The new head is published before looking at the consumers'
+ * hazards, so that a consumer either sees the element is gone, or
+ * has its hazard seen by the producer; in the latter case the element
+ * is kept in @ref Track::deferred and freed on a later call.
  */
-static void bq_producer_reset_queue_internal(Track *producer) {
-    bq_debug("Producer %p queue %p queue_serial %lu",
-            producer,
-            producer->queue,
-            producer->queue_serial);
-
-    if ( producer->queue ) {
-        g_queue_foreach(producer->queue,
-                        bq_element_free_internal,
-                        NULL);
-        g_queue_clear(producer->queue);
-        g_queue_free(producer->queue);
+static void bq_producer_release(Track *producer, gint new_head)
+{
+    gint seq = producer->head;
+    GSList *deferred, *it;
+
+    if ( seq != new_head )
+        g_atomic_int_set(&producer->head, new_head);
+
+    for ( ; BQ_SEQ_DIFF(seq, new_head) < 0; seq = BQ_SEQ_NEXT(seq) ) {
+        struct MParserBuffer *elem = *BQ_SLOT(producer, seq);
+
+        bq_debug("P:%p release %d elem %p (%hu)",
+                 producer, seq, elem, elem->seq_no);
+
+        if ( bq_producer_hazarded(producer, elem) )
+            producer->deferred = g_slist_prepend(producer->deferred, elem);
+        else
+            mparser_buffer_unref(elem);
     }
 
-    producer->queue = g_queue_new();
-    producer->queue_serial++;
+    deferred = producer->deferred;
+    producer->deferred = NULL;
+
+    for (it = deferred; it != NULL; it = g_slist_next(it)) {
+        if ( bq_producer_hazarded(producer, it->data) )
+            producer->deferred = g_slist_prepend(producer->deferred, it->data);
+        else
+            mparser_buffer_unref(it->data);
+    }
+
+    g_slist_free(deferred);
+}
+
+/**
+ * @brief Reclaim the elements that have been seen by all consumers
+ *
+ * @param producer The producer to reclaim the elements of
+ *
+ * @internal This function has to be called with @ref Track::lock
+ *           held.
+ *
+ * When no consumer is registered the elements are kept, so that the
+ * first consumer to join can still read them; they are dropped only
+ * once the ring is full.
+ *
+ * With @ref Track::gop_cache, the elements from the last keyframe on
+ * are always kept, and only those are kept when no consumer is
+ * registered.
+ */
+static void bq_producer_reclaim(Track *producer)
+{
+    gint head = producer->head;
+
+    if ( producer->consumers > 0 ) {
+        while ( head != producer->tail &&
+                !(producer->gop_valid && head == producer->gop_start) &&
+                g_atomic_int_get(&(*BQ_SLOT(producer, head))->seen) >=
+                producer->consumers )
+            head = BQ_SEQ_NEXT(head);
+    } else if ( producer->gop_valid )
+        head = producer->gop_start;
+
+    bq_producer_release(producer, head);
 }
 
 /**
@@ -175,9 +225,9 @@ static void bq_producer_reset_queue_internal(Track *producer) {
  * @note This function will require exclusive access to the producer,
  *       and will thus lock its mutex.
  *
- * This function will change the currently-used queue for the
- * producer, so that a discontinuity will allow the consumers not to
- * worry about getting old buffers.
+ * This function will drop all the elements currently queued and
+ * change the serial of the producer's queue, so that a discontinuity
+ * will allow the consumers not to worry about getting old buffers.
  */
 void track_reset_queue(Track *producer) {
     bq_debug("Producer %p",
@@ -188,141 +238,115 @@ void track_reset_queue(Track *producer) {
 
     g_assert(!producer->stopped);
 
-    bq_producer_reset_queue_internal(producer);
+    /* Drop the elements before changing the serial: a consumer that
+     * sees the new serial is then guaranteed to see the new head as
+     * well. */
+    bq_producer_release(producer, producer->tail);
+    producer->gop_valid = false;
+    g_atomic_int_inc(&producer->queue_serial);
 
     /* Leave the exclusive access */
     g_mutex_unlock(producer->lock);
 }
 
 /**
- * @brief Destroy the head of the producer queue
+ * @brief Ensures the validity of the cursor of the consumer
+ *
+ * @param consumer The consumer to verify the cursor of
+ *
+ * Call this function whenever the cursor is going to be used; if the
+ * queue has been reset, or the element at the cursor has been dropped
+ * by the producer, the cursor is moved to the current head of the
+ * queue.
  *
- * @param producer Producer to destroy the head queue of
- * @param element element to destroy; this is a safety check
+ * @note This function does not lock @ref Track::lock.
  */
-static void bq_producer_destroy_head(Track *producer) {
-    struct MParserBuffer *elem = g_queue_pop_head(producer->queue);
+static void bq_consumer_confirm_cursor(RTP_session *consumer)
+{
+    Track *producer = consumer->track;
+    const gint serial = g_atomic_int_get(&producer->queue_serial);
+    const gint head = g_atomic_int_get(&producer->head);
 
-    bq_debug("P:%p PQH:%p elem %p (%hu)",
-             producer,
-             producer->queue->head,
-             elem, elem ? elem->seq_no : 0);
+    if ( consumer->queue_serial == serial &&
+         BQ_SEQ_DIFF(consumer->cursor, head) >= 0 )
+        return;
 
-    /* We can only remove the head of the queue, if we're doing
-     * anything else, something is funky. Ibid if it hasn't been seen
-     * yet.
-     */
-    g_assert(elem->seen == producer->consumers);
+    bq_debug("C:%p cursor %d:%d reset to %d:%d",
+             consumer,
+             consumer->queue_serial, consumer->cursor,
+             serial, head);
 
-    /* If we reached the end of the queue, consider like it was a new
-     * one */
-    if ( g_queue_get_length(producer->queue) == 0 )
-        producer->queue_serial++;
+    consumer->current = NULL;
+    g_atomic_pointer_set(&consumer->hazard, NULL);
 
-    mparser_buffer_free(elem);
+    consumer->queue_serial = serial;
+    consumer->cursor = head;
 }
 
 /**
- * @brief Remove reference from the current element
+ * @brief Register a new consumer with its producer
  *
- * @param consumer The consumer that has seen the element
- * @return If applicable, the next element after the one unref'd
- */
-static GList *bq_consumer_elem_unref(Track *producer, GList *pointer) {
-    struct MParserBuffer *elem = GLIST_TO_BQELEM(pointer);
-    GList *next = pointer ? pointer->next : NULL;
-
-    bq_debug("PQS:%lu %p->%p object %p (%hu)",
-             producer->queue_serial,
-             pointer, next,
-             elem, elem ? elem->seq_no : 0);
-
-    /* If we had no element selected, just get out of here */
-    if ( elem == NULL )
-        return next;
-
-    g_assert_cmpint(elem->seen, !=, producer->consumers);
-    elem->seen++;
-
-    /* If we're the last one to see the element, we need to take care
-     * of removing and freeing it. */
-    bq_debug("\tpointer %p seen %lu/%u PQH:%p",
-             pointer,
-             elem->seen,
-             producer->consumers,
-             producer->queue->head);
-
-    if ( elem->seen >= producer->consumers )
-        bq_producer_destroy_head(producer);
-
-    return next;
-}
-
-/**
- * @brief Actually move to the next element in a consumer
+ * @param consumer The consumer object to register; its @ref
+ *                 RTP_session::track has to be set already.
  *
- * @retval true The move was successful
- * @retval false The move wasn't successful.
+ * @note This function will require exclusive access to the producer,
+ *       and will thus lock its mutex.
  *
- * @param consumer The consumer object to move
+ * The consumer starts reading from the current head of the queue, or
+ * from the last keyframe queued for the tracks keeping a group of
+ * pictures cache (see @ref Track::gop_cache); registering an
+ * already-registered consumer is a no-op.
  */
-static gboolean bq_consumer_move_internal(RTP_session *consumer) {
+void bq_consumer_new(RTP_session *consumer) {
     Track *producer = consumer->track;
-    GList *c_cep = bq_consumer_confirm_pointer(consumer), *next;
 
-    bq_debug("C:%p LES:%lu:%u PQHS:%lu:%u PQH:%p pointer %p",
-            consumer,
-            consumer->queue_serial, consumer->last_element_serial,
-            producer->queue_serial,
-            producer->queue->head ? GLIST_TO_BQELEM(producer->queue->head)->seq_no : 0,
-            producer->queue->head,
-            c_cep);
-
-    if (c_cep)
-        next = bq_consumer_elem_unref(producer, c_cep);
-    else
-        next = producer->queue->head;
-
-    if ( next != NULL )
-        bq_debug("\tpointer %p object %p (%hu)",
-                 next,
-                 next->data,
-                 GLIST_TO_BQELEM(next)->seq_no);
+    if ( consumer->consuming )
+        return;
 
-    while ( next != NULL &&
-            GLIST_TO_BQELEM(next)->seq_no <= consumer->last_element_serial )
-        next = bq_consumer_elem_unref(producer, next);
+    /* Ensure we have the exclusive access */
+    g_mutex_lock(producer->lock);
 
-    if ( (consumer->current_element_pointer = next) == NULL )
-        return false;
+    /* Make sure we don't overflow the consumers count; while this
+     * case is most likely just hypothetical, it doesn't hurt to be
+     * safe.
+     */
+    g_assert_cmpint(producer->consumers, <, G_MAXINT);
 
-    consumer->last_element_serial =
-        GLIST_TO_BQELEM(consumer->current_element_pointer)->seq_no;
     consumer->queue_serial = producer->queue_serial;
+    consumer->cursor = producer->head;
+    consumer->current = NULL;
+    consumer->hazard = NULL;
 
-    return true;
-}
+    /* The elements skipped count as seen, as if the consumer had
+     * gone past them; see bq_consumer_free */
+    if ( producer->gop_valid )
+        for ( ; consumer->cursor != producer->gop_start;
+              consumer->cursor = BQ_SEQ_NEXT(consumer->cursor) )
+            g_atomic_int_inc(&(*BQ_SLOT(producer, consumer->cursor))->seen);
 
-static void bq_decrement_seen_on_free(gpointer elem,
-                                      ATTR_UNUSED gpointer unused)
-{
-    struct MParserBuffer *const element = elem;
-    element->seen--;
+    producer->readers = g_slist_prepend(producer->readers, consumer);
+    g_atomic_int_inc(&producer->consumers);
+    consumer->consuming = true;
+
+    /* Leave the exclusive access */
+    g_mutex_unlock(producer->lock);
 }
 
 /**
  * @brief Destroy a consumer
  *
- * @param consumer The consumer object to destroy
+ * @param consumer The consumer object to destroy; it's no-op if it's
+ *                 not registered.
  *
  * @note This function will require exclusive access to the producer,
  *       and will thus lock its mutex.
  */
 void bq_consumer_free(RTP_session *consumer) {
     Track *producer;
+    gint seq;
 
     /* Compatibility with free(3) */
-    if ( consumer == NULL )
+    if ( consumer == NULL || !consumer->consuming )
         return;
 
     producer = consumer->track;
@@ -330,23 +354,33 @@ void bq_consumer_free(RTP_session *consumer) {
     /* Ensure we have the exclusive access */
     g_mutex_lock(producer->lock);
 
-    bq_debug("C:%p pointer %p",
+    bq_debug("C:%p cursor %d:%d",
             consumer,
-            consumer->current_element_pointer);
+            consumer->queue_serial,
+            consumer->cursor);
 
     /* We should never come to this point, since we are expected to
      * have symmetry between new and free calls, but just to be on the
      * safe side, make sure this never happens.
      */
-    g_assert_cmpuint(producer->consumers, >,  0);
+    g_assert_cmpint(producer->consumers, >,  0);
 
-    while (bq_consumer_move_internal(consumer));
+    /* Take back the seen count from the elements this consumer went
+     * past, so that the count is still in sync with the consumers. */
+    if ( consumer->queue_serial == producer->queue_serial )
+        for ( seq = producer->head;
+              BQ_SEQ_DIFF(seq, consumer->cursor) < 0;
+              seq = BQ_SEQ_NEXT(seq) )
+            g_atomic_int_add(&(*BQ_SLOT(producer, seq))->seen, -1);
 
-    g_queue_foreach(producer->queue,
-                    bq_decrement_seen_on_free,
-                    NULL);
+    consumer->current = NULL;
+    g_atomic_pointer_set(&consumer->hazard, NULL);
 
-    --producer->consumers;
+    producer->readers = g_slist_remove(producer->readers, consumer);
+    g_atomic_int_add(&producer->consumers, -1);
+    consumer->consuming = false;
+
+    bq_producer_reclaim(producer);
 
     /* Leave the exclusive access */
     g_mutex_unlock(producer->lock);
@@ -360,67 +394,51 @@ void bq_consumer_free(RTP_session *consumer) {
  * @return The number of buffers queued in the producer that have not
  *         been seen.
  *
- * @note This function will require exclusive access to the producer,
- *       and will thus lock its mutex.
+ * @note This function does not lock @ref Track::lock.
  */
 gulong bq_consumer_unseen(RTP_session *consumer) {
     Track *producer = consumer->track;
-    gulong unseen = 0;
+    gint serial, head, tail;
 
     if (bq_consumer_stopped(consumer))
-        return unseen;
+        return 0;
 
-    /* Ensure we have the exclusive access */
-    g_mutex_lock(producer->lock);
-
-    if ( consumer->queue_serial != producer->queue_serial )
-        unseen = g_queue_get_length(producer->queue);
-    else if ( producer->queue->head != NULL )
-        unseen = producer->next_serial - consumer->last_element_serial;
+    serial = g_atomic_int_get(&producer->queue_serial);
+    head = g_atomic_int_get(&producer->head);
+    tail = g_atomic_int_get(&producer->tail);
 
-    /* Leave the exclusive access */
-    g_mutex_unlock(producer->lock);
+    if ( consumer->queue_serial == serial &&
+         BQ_SEQ_DIFF(consumer->cursor, head) > 0 )
+        head = consumer->cursor;
 
-    return unseen;
+    return MAX(BQ_SEQ_DIFF(tail, head), 0);
 }
 
 /**
- * @brief Move to the next element in a consumer
+ * @brief Tells how many buffers are queued for the most advanced consumer
  *
- * @param consumer The consumer object to move
+ * @param producer The producer to check
  *
- * @retval true The move was successful
- * @retval false The move wasn't successful, the producer may be stopped.
+ * @return The lowest number of buffers not yet seen among the
+ *         registered consumers, or G_MAXULONG if there is none.
  *
  * @note This function will require exclusive access to the producer,
- *       and will thus lock its mutex.
- *
- * This is actually just a locking-wrapper around @ref
- * bq_consumer_move_internal.
+ *       and will thus lock its mutex; the consumers' cursors are read
+ *       while they might be moving, which only makes the count a bit
+ *       stale.
  */
-gboolean bq_consumer_move(RTP_session *consumer) {
-    Track *producer = consumer->track;
-    gboolean ret;
+gulong bq_producer_unseen(Track *producer) {
+    gulong unseen = G_MAXULONG;
+    GSList *it;
 
-    bq_debug("(before) C:%p pointer %p",
-            consumer,
-            consumer->current_element_pointer);
-
-    if ( bq_consumer_stopped(consumer) )
-        return false;
-
-    /* Ensure we have the exclusive access */
     g_mutex_lock(producer->lock);
-    ret = bq_consumer_move_internal(consumer);
 
-    bq_debug("(after) C:%p pointer %p",
-            consumer,
-            consumer->current_element_pointer);
+    for ( it = producer->readers; it != NULL; it = it->next )
+        unseen = MIN(unseen, bq_consumer_unseen(it->data));
 
-    /* Leave the exclusive access */
     g_mutex_unlock(producer->lock);
 
-    return ret;
+    return unseen;
 }
 
 /**
@@ -435,50 +453,111 @@ gboolean bq_consumer_move(RTP_session *consumer) {
  *              stopped. To know which one of the two conditions
  *              happened, @ref bq_consumer_stopped should be called.
  *
- * @note This function will require exclusive access to the producer,
- *       and will thus lock its mutex.
+ * @note This function does not lock @ref Track::lock, and it never
+ *       loops, so it completes in a bounded number of steps whatever
+ *       the producer is doing.
  *
- * This function marks as seen the previously-selected element, if
- * any; the new selection is not freed until the cursor is moved or
- * the consumer is deleted.
+ * The returned element is not freed until the cursor is moved or the
+ * consumer is deleted.
  */
 struct MParserBuffer *bq_consumer_get(RTP_session *consumer) {
     Track *producer = consumer->track;
-    struct MParserBuffer *element = NULL;
-    GList *c_cep;
+    struct MParserBuffer *element;
 
     if ( bq_consumer_stopped(consumer) )
         return NULL;
 
-    /* Ensure we have the exclusive access */
-    g_mutex_lock(producer->lock);
-    bq_debug("C:%p LES:%lu:%u PQHS:%lu:%u PQH:%p pointer %p",
-             consumer,
-             consumer->queue_serial, consumer->last_element_serial,
-             producer->queue_serial,
-             producer->queue->head ? GLIST_TO_BQELEM(producer->queue->head)->seq_no : 0,
-             producer->queue->head,
-             consumer->current_element_pointer);
+    bq_consumer_confirm_cursor(consumer);
 
-    c_cep = bq_consumer_confirm_pointer(consumer);
+    if ( consumer->current != NULL )
+        return consumer->current;
 
-    /* If we don't have a queue yet, like for the first read, “move
-     * next” (or rather first).
-     */
-    if ( c_cep == NULL )
-        bq_consumer_move_internal(consumer);
+    if ( BQ_SEQ_DIFF(consumer->cursor,
+                     g_atomic_int_get(&producer->tail)) >= 0 )
+        return NULL;
 
-    element = BQ_OBJECT(consumer);
+    element = g_atomic_pointer_get((gpointer*)BQ_SLOT(producer, consumer->cursor));
+    g_atomic_pointer_set(&consumer->hazard, element);
+
+    /* The slot can only be dropped (and later reused) after the head
+     * moved past it; if that's not the case after the hazard is
+     * published, the element is ours until we clear it. Otherwise we
+     * give up for now, and the next call will move to the new head.
+     */
+    if ( BQ_SEQ_DIFF(consumer->cursor,
+                     g_atomic_int_get(&producer->head)) < 0 ) {
+        g_atomic_pointer_set(&consumer->hazard, NULL);
+        return NULL;
+    }
 
-    bq_debug("C:%p pointer %p object %p seen %lu/%d",
+    bq_debug("C:%p cursor %d:%d object %p seen %d/%d",
              consumer,
-             consumer->current_element_pointer,
+             consumer->queue_serial, consumer->cursor,
              element,
-             element ? element->seen : 0,
+             element->seen,
              producer->consumers);
 
-    /* Leave the exclusive access */
-    g_mutex_unlock(producer->lock);
+    return (consumer->current = element);
+}
+
+/**
+ * @brief Move to the next element in a consumer
+ *
+ * @param consumer The consumer object to move
+ *
+ * @retval true The move was successful, and @ref bq_consumer_get
+ *              will return the new element.
+ * @retval false The move wasn't successful, the producer may be stopped.
+ *
+ * @note This function does not lock @ref Track::lock.
+ *
+ * This marks as seen the previously-selected element, if any.
+ */
+gboolean bq_consumer_move(RTP_session *consumer) {
+    struct MParserBuffer *element = consumer->current;
+
+    bq_debug("(before) C:%p cursor %d object %p",
+            consumer,
+            consumer->cursor,
+            element);
+
+    if ( bq_consumer_stopped(consumer) )
+        return false;
+
+    if ( element != NULL ) {
+        g_atomic_int_inc(&element->seen);
+
+        consumer->current = NULL;
+        g_atomic_pointer_set(&consumer->hazard, NULL);
+        consumer->cursor = BQ_SEQ_NEXT(consumer->cursor);
+    }
+
+    return bq_consumer_get(consumer) != NULL;
+}
+
+/**
+ * @brief Move a consumer to the next random access point
+ *
+ * @param consumer The consumer object to move
+ *
+ * @return The keyframe element now selected by the consumer.
+ *
+ * @retval NULL No keyframe is queued after the cursor yet; the
+ *              consumer has been moved past all the queued elements.
+ *
+ * Used when a consumer joins a queue that other consumers are
+ * already reading, so that it doesn't start sending from the middle
+ * of a group of pictures.
+ *
+ * @note This function does not lock @ref Track::lock.
+ */
+struct MParserBuffer *bq_consumer_sync(RTP_session *consumer) {
+    struct MParserBuffer *element;
+
+    while ( (element = bq_consumer_get(consumer)) != NULL &&
+            !element->keyframe )
+        bq_consumer_move(consumer);
+
     return element;
 }
 
@@ -506,6 +585,184 @@ gboolean bq_consumer_stopped(RTP_session *consumer) {
 
 /**@}*/
 
+/**
+ * @brief Create a new data block
+ *
+ * @param data The data of the block
+ * @param size Size of @p data
+ * @param free_func Function to call on @p free_data when the last
+ *                  reference to the block is dropped (can be NULL)
+ * @param free_data Parameter for @p free_func
+ *
+ * @return A new block, with one reference owned by the caller.
+ */
+struct MParserBlock *mparser_block_new(uint8_t *data, size_t size,
+                                       GDestroyNotify free_func,
+                                       gpointer free_data)
+{
+    struct MParserBlock *block = g_slice_new(struct MParserBlock);
+
+    block->refs = 1;
+    block->data = data;
+    block->size = size;
+    block->free_func = free_func;
+    block->free_data = free_data;
+
+    return block;
+}
+
+struct MParserBlock *mparser_block_ref(struct MParserBlock *block)
+{
+    g_atomic_int_inc(&block->refs);
+    return block;
+}
+
+void mparser_block_unref(struct MParserBlock *block)
+{
+    if ( block == NULL ||
+         !g_atomic_int_dec_and_test(&block->refs) )
+        return;
+
+    if ( block->free_func )
+        block->free_func(block->free_data);
+
+    g_slice_free(struct MParserBlock, block);
+}
+
+static struct MParserBuffer *mparser_buffer_alloc(Track *tr,
+                                                  struct MParserBlock *block,
+                                                  uint8_t *data, size_t size)
+{
+    struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+
+    buffer->refs = 1;
+
+    buffer->timestamp = tr->pts;
+    buffer->delivery = tr->dts;
+    buffer->duration = tr->frame_duration;
+
+    /* Only the first buffer of a keyframe starts it */
+    buffer->keyframe = tr->keyframe;
+    tr->keyframe = false;
+
+    buffer->frame_size = tr->frame_size;
+
+    buffer->block = block;
+    buffer->data = data;
+    buffer->data_size = size;
+
+    return buffer;
+}
+
+/**
+ * @brief Create a new buffer with its own data
+ *
+ * @param tr The track the buffer is created for; its current
+ *           timestamps are copied in the buffer
+ * @param size Size of the data to allocate
+ *
+ * @return A new buffer, with one reference owned by the caller; its
+ *         data is left for the caller to fill.
+ */
+struct MParserBuffer *mparser_buffer_new(Track *tr, size_t size)
+{
+    uint8_t *data = g_malloc(size);
+
+    return mparser_buffer_alloc(tr,
+                                mparser_block_new(data, size, g_free, data),
+                                data, size);
+}
+
+/**
+ * @brief Create a new buffer referring to data being parsed
+ *
+ * @param tr The track the buffer is created for; its current
+ *           timestamps are copied in the buffer
+ * @param data Pointer to the payload of the buffer
+ * @param size Size of the payload
+ *
+ * @return A new buffer, with one reference owned by the caller.
+ *
+ * If @p data is part of @ref Track::block, the buffer references the
+ * block and no copy is done; otherwise the data is copied.
+ */
+struct MParserBuffer *mparser_buffer_new_slice(Track *tr, const uint8_t *data,
+                                               size_t size)
+{
+    struct MParserBlock *block = tr->block;
+    struct MParserBuffer *buffer;
+
+    if ( block != NULL &&
+         data >= block->data &&
+         data + size <= block->data + block->size )
+        return mparser_buffer_alloc(tr, mparser_block_ref(block),
+                                    (uint8_t*)data, size);
+
+    buffer = mparser_buffer_new(tr, size);
+    memcpy(buffer->data, data, size);
+
+    return buffer;
+}
+
+/**
+ * @brief Create a copy of a buffer with a longer payload header
+ *
+ * @param buffer The buffer to copy; its data is referenced, not
+ *               copied
+ * @param prefix Bytes to put before the payload header of @p buffer
+ * @param size Size of @p prefix
+ *
+ * @return A new buffer, with one reference owned by the caller, or
+ *         NULL if the payload header would be longer than @ref
+ *         MPARSER_PREFIX_MAX.
+ *
+ * Used to send the same payload in a different RTP stream, such as
+ * a retransmission.
+ */
+struct MParserBuffer *mparser_buffer_new_prefixed(const struct MParserBuffer *buffer,
+                                                  const uint8_t *prefix,
+                                                  size_t size)
+{
+    struct MParserBuffer *copy;
+
+    if ( size + buffer->prefix_size > MPARSER_PREFIX_MAX )
+        return NULL;
+
+    copy = g_slice_dup(struct MParserBuffer, buffer);
+
+    copy->refs = 1;
+    copy->seen = 0;
+
+    memcpy(copy->prefix, prefix, size);
+    memcpy(copy->prefix + size, buffer->prefix, buffer->prefix_size);
+    copy->prefix_size = size + buffer->prefix_size;
+
+    if ( copy->block != NULL )
+        mparser_block_ref(copy->block);
+
+    return copy;
+}
+
+struct MParserBuffer *mparser_buffer_ref(struct MParserBuffer *buffer)
+{
+    g_atomic_int_inc(&buffer->refs);
+    return buffer;
+}
+
+void mparser_buffer_unref(struct MParserBuffer *buffer)
+{
+    if ( buffer == NULL ||
+         !g_atomic_int_dec_and_test(&buffer->refs) )
+        return;
+
+    bq_debug("Free object %p %d",
+             buffer,
+             buffer->seen);
+
+    mparser_block_unref(buffer->block);
+    g_slice_free(struct MParserBuffer, buffer);
+}
+
 /**
  * @brief Create a new Track object
  *
@@ -525,6 +782,11 @@ Track *track_new(char *name)
     t->last_consumer   = g_cond_new();
     t->name            = name;
     t->sdp_description = g_string_new("");
+    t->ring            = g_new0(struct MParserBuffer *, BQ_RING_SIZE);
+    t->queue_serial    = 1;
+
+    if ( feng_srv.rtx_history > 0 )
+        t->history = g_new0(struct MParserBuffer *, feng_srv.rtx_history);
 
     /* set these by default, sinze 0 might actually be a valid
        value */
@@ -536,8 +798,6 @@ Track *track_new(char *name)
                            "a=control:%s\r\n",
                            name);
 
-    bq_producer_reset_queue_internal(t);
-
     return t;
 }
 
@@ -548,6 +808,8 @@ Track *track_new(char *name)
  */
 void track_free(Track *track)
 {
+    gint seq;
+
     if (!track)
         return;
 
@@ -556,18 +818,26 @@ void track_free(Track *track)
     g_free(track->name);
     g_free(track->encoding_name);
 
-    g_assert_cmpuint(track->consumers, ==, 0);
+    g_assert_cmpint(track->consumers, ==, 0);
 
     g_cond_free(track->last_consumer);
 
-    if ( track->queue ) {
-        /* Destroy elements and the queue */
-        g_queue_foreach(track->queue,
-                        bq_element_free_internal,
-                        NULL);
-        g_queue_free(track->queue);
+    /* Destroy elements and the ring */
+    for ( seq = track->head; BQ_SEQ_DIFF(seq, track->tail) < 0; seq = BQ_SEQ_NEXT(seq) )
+        mparser_buffer_unref(*BQ_SLOT(track, seq));
+    g_free(track->ring);
+
+    if ( track->history != NULL ) {
+        guint i;
+
+        for ( i = 0; i < feng_srv.rtx_history; i++ )
+            mparser_buffer_unref(track->history[i]);
+        g_free(track->history);
     }
 
+    g_slist_foreach(track->deferred, bq_element_free_internal, NULL);
+    g_slist_free(track->deferred);
+
     if ( track->sdp_description )
         g_string_free(track->sdp_description, true);
 
@@ -581,13 +851,19 @@ void track_free(Track *track)
  * @brief Queue a new RTP buffer into the track's queue
  *
  * @param tr The track to queue the buffer onto
- * @param buffer The RTP buffer to queue
+ * @param buffer The RTP buffer to queue; the reference owned by the
+ *               caller is passed to the queue.
  */
 void track_write(Track *tr, struct MParserBuffer *buffer)
 {
     /* Make sure the producer is not stopped */
     g_assert(g_atomic_int_get(&tr->stopped) == 0);
 
+    if ( tr->sink != NULL ) {
+        tr->sink(tr, buffer, tr->sink_data);
+        return;
+    }
+
     /* Ensure we have the exclusive access */
     g_mutex_lock(tr->lock);
 
@@ -597,11 +873,74 @@ void track_write(Track *tr, struct MParserBuffer *buffer)
 
     tr->next_serial = buffer->seq_no + 1;
 
-    bq_debug("P:%p PQH:%p elem: %p (%hu)",
-             tr, tr->queue->head, buffer, buffer->seq_no);
+    if ( tr->history != NULL ) {
+        struct MParserBuffer **slot =
+            &tr->history[buffer->seq_no & (feng_srv.rtx_history - 1)];
+
+        mparser_buffer_unref(*slot);
+        *slot = mparser_buffer_ref(buffer);
+    }
+
+    bq_producer_reclaim(tr);
+
+    /* If the slowest consumer is a whole ring behind, drop the oldest
+     * element for it. */
+    if ( BQ_SEQ_DIFF(tr->tail, tr->head) >= BQ_RING_SIZE ) {
+        bq_debug("P:%p ring full, dropping %d", tr, tr->head);
+
+        /* The group of pictures is longer than the whole ring */
+        if ( tr->gop_valid && tr->gop_start == tr->head )
+            tr->gop_valid = false;
 
-    g_queue_push_tail(tr->queue, buffer);
+        bq_producer_release(tr, BQ_SEQ_NEXT(tr->head));
+    }
+
+    if ( tr->gop_cache && buffer->keyframe ) {
+        tr->gop_start = tr->tail;
+        tr->gop_valid = true;
+    }
+
+    bq_debug("P:%p PQT:%d elem: %p (%hu)",
+             tr, tr->tail, buffer, buffer->seq_no);
+
+    g_atomic_pointer_set((gpointer*)BQ_SLOT(tr, tr->tail), buffer);
+    g_atomic_int_set(&tr->tail, BQ_SEQ_NEXT(tr->tail));
 
     /* Leave the exclusive access */
     g_mutex_unlock(tr->lock);
 }
+
+/**
+ * @brief Look up a recently queued buffer
+ *
+ * @param tr The track to look into
+ * @param seq_no Sequence number of the buffer
+ *
+ * @return A new reference to the buffer, or NULL if it's not in the
+ *         history (anymore).
+ *
+ * The buffers stay in the history after being sent, until they are
+ * overwritten by the one rtx-history sequence numbers later.
+ *
+ * @note This function will lock the @ref Track::lock mutex.
+ */
+struct MParserBuffer *track_history_get(Track *tr, uint16_t seq_no)
+{
+    struct MParserBuffer *buffer;
+
+    if ( tr->history == NULL )
+        return NULL;
+
+    g_mutex_lock(tr->lock);
+
+    buffer = tr->history[seq_no & (feng_srv.rtx_history - 1)];
+
+    if ( buffer != NULL && buffer->seq_no == seq_no )
+        mparser_buffer_ref(buffer);
+    else
+        buffer = NULL;
+
+    g_mutex_unlock(tr->lock);
+
+    return buffer;
+}
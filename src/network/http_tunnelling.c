@@ -25,8 +25,22 @@
 #include "feng.h"
 #include "network/rtsp.h"
 
+/**
+ * @brief Tunnels waiting for their POST connection, by session cookie
+ *
+ * Pairs are taken out of the table once the POST connection joins
+ * them, see @ref HTTP_handle_join.
+ */
 static GHashTable *http_tunnel_pairs;
 
+/**
+ * @brief Mutex regulating access to @ref http_tunnel_pairs
+ *
+ * The two connections of a tunnel can be accepted by different
+ * workers.
+ */
+static GStaticMutex http_tunnel_pairs_lock = G_STATIC_MUTEX_INIT;
+
 #ifdef CLEANUP_DESTRUCTOR
 static void CLEANUP_DESTRUCTOR http_tunnel_cleanup()
 {
@@ -48,8 +62,10 @@ static void CLEANUP_DESTRUCTOR http_tunnel_cleanup()
  */
 static void rtsp_write_data_http(RTSP_Client *client, GByteArray *data)
 {
-    g_queue_push_head(client->pair->http_client->out_queue, data);
-    ev_io_start(client->loop, &client->pair->http_client->ev_io_write);
+    RTSP_Client *http_client = client->pair->http_client;
+
+    rtsp_out_queue_push(http_client, data, NULL);
+    ev_io_start(client->loop, &http_client->ev_io_write);
 }
 
 static gboolean http_tunnel_create_pair(RTSP_Client *client, RFC822_Request *req)
@@ -63,7 +79,10 @@ static gboolean http_tunnel_create_pair(RTSP_Client *client, RFC822_Request *req
         return false;
     }
 
+    g_static_mutex_lock(&http_tunnel_pairs_lock);
+
     if ( (pair = g_hash_table_lookup(http_tunnel_pairs, http_session)) != NULL ) {
+        g_static_mutex_unlock(&http_tunnel_pairs_lock);
         rfc822_quick_response(client, req, RFC822_Protocol_HTTP10, HTTP_BadRequest);
         return false;
     }
@@ -74,6 +93,8 @@ static gboolean http_tunnel_create_pair(RTSP_Client *client, RFC822_Request *req
 
     g_hash_table_insert(http_tunnel_pairs, strdup(http_session), pair);
 
+    g_static_mutex_unlock(&http_tunnel_pairs_lock);
+
     response = rfc822_response_new(req, HTTP_Ok);
 
     rfc822_headers_set(response->headers,
@@ -141,55 +162,8 @@ gboolean HTTP_handle_headers(RTSP_Client *rtsp)
     }
 #endif
     if ( rtsp->pending_request->method_id == HTTP_Method_POST ) {
-        const char *http_session = rfc822_headers_lookup(rtsp->pending_request->headers, HTTP_Header_x_sessioncookie);
-        gpointer tmpptr;
-
-        if ( http_session == NULL ) {
-            rfc822_quick_response(rtsp, rtsp->pending_request, RFC822_Protocol_HTTP10, HTTP_BadRequest);
-            return false;
-        }
-
-        if ( (rtsp->pair = g_hash_table_lookup(http_tunnel_pairs, http_session)) == NULL ) {
-            rfc822_quick_response(rtsp, rtsp->pending_request, RFC822_Protocol_HTTP10, HTTP_BadRequest);
-            return false;
-        }
-
-        /* let's be sure that the other connection has reached the
-           idle state, otherwise the client has been too eager to
-           connect. */
-        if ( rtsp->pair->http_client->status != RFC822_State_HTTP_Idle ) {
-            rfc822_quick_response(rtsp, rtsp->pending_request, RFC822_Protocol_HTTP10, HTTP_BadRequest);
-            return false;
-        }
-
-        /* we should also ensure that there is not data waiting to be
-           parsed, as we expect the client to send nothing on that
-           connection from then on */
-        if ( rtsp->pair->http_client->input->len != 0 ) {
-            rfc822_quick_response(rtsp, rtsp->pending_request, RFC822_Protocol_HTTP10, HTTP_BadRequest);
-            return false;
-        }
-
-        /* re-use the current object to be used for the HTTP tunnel;
-           we change the callback and set the tunnel, and switch the
-           input buffers around for convenience */
-        rtsp->pair->rtsp_client = rtsp;
-        rtsp->write_data = rtsp_write_data_http;
-
-        /* this will start from scratch */
-        rtsp->status = RFC822_State_Begin;
-
-        tmpptr = rtsp->input;
-        rtsp->input = rtsp->pair->http_client->input;
-        rtsp->pair->http_client->input = tmpptr;
-
-        /* get the http_client ready to read the data */
-        rtsp->pair->http_client->status = RFC822_State_HTTP_Content;
-
-        /* we run it here so that it starts getting some data at least */
-        RTSP_handler(rtsp->pair->http_client);
-
-        return false;
+        rtsp->status = RFC822_State_HTTP_Join;
+        return true;
     } else {
         if ( http_tunnel_create_pair(rtsp, rtsp->pending_request) )
             rtsp->status = RFC822_State_HTTP_Idle;
@@ -199,6 +173,92 @@ gboolean HTTP_handle_headers(RTSP_Client *rtsp)
     return true;
 }
 
+/**
+ * @brief Refuse the POST connection of a tunnel
+ */
+static gboolean http_tunnel_refuse(RTSP_Client *rtsp)
+{
+    rfc822_quick_response(rtsp, rtsp->pending_request, RFC822_Protocol_HTTP10, HTTP_BadRequest);
+    rtsp->status = RFC822_State_HTTP_Headers;
+    return false;
+}
+
+/**
+ * @brief Join the POST connection of a tunnel to its GET connection
+ *
+ * The POST connection drives the output on the GET one, so they have
+ * to be served by the same worker: if they were accepted by different
+ * ones, the POST connection is handed over to the worker of the GET
+ * one, which calls this again once it attached the client.
+ */
+gboolean HTTP_handle_join(RTSP_Client *rtsp)
+{
+    const char *http_session = rfc822_headers_lookup(rtsp->pending_request->headers, HTTP_Header_x_sessioncookie);
+    HTTP_Tunnel_Pair *pair;
+    RTSP_Client *http_client;
+    gpointer tmpptr, key;
+
+    if ( http_session == NULL )
+        return http_tunnel_refuse(rtsp);
+
+    g_static_mutex_lock(&http_tunnel_pairs_lock);
+
+    if ( !g_hash_table_lookup_extended(http_tunnel_pairs, http_session,
+                                       &key, &tmpptr) ) {
+        g_static_mutex_unlock(&http_tunnel_pairs_lock);
+        return http_tunnel_refuse(rtsp);
+    }
+
+    pair = tmpptr;
+    http_client = pair->http_client;
+
+    if ( http_client->worker != rtsp->worker ) {
+        g_static_mutex_unlock(&http_tunnel_pairs_lock);
+        rtsp_client_handover(rtsp, http_client->worker);
+        return false;
+    }
+
+    /* let's be sure that the other connection has reached the idle
+       state, otherwise the client has been too eager to connect; we
+       should also ensure that there is not data waiting to be
+       parsed, as we expect the client to send nothing on that
+       connection from then on */
+    if ( http_client->status != RFC822_State_HTTP_Idle ||
+         http_client->input->len != 0 ) {
+        g_static_mutex_unlock(&http_tunnel_pairs_lock);
+        return http_tunnel_refuse(rtsp);
+    }
+
+    /* the tunnel is complete, nobody else can join it; the pair is
+       freed along with the clients */
+    g_hash_table_steal(http_tunnel_pairs, http_session);
+    g_free(key);
+
+    g_static_mutex_unlock(&http_tunnel_pairs_lock);
+
+    /* re-use the current object to be used for the HTTP tunnel;
+       we change the callback and set the tunnel, and switch the
+       input buffers around for convenience */
+    rtsp->pair = pair;
+    pair->rtsp_client = rtsp;
+    rtsp->write_data = rtsp_write_data_http;
+
+    /* this will start from scratch */
+    rtsp->status = RFC822_State_Begin;
+
+    tmpptr = rtsp->input;
+    rtsp->input = http_client->input;
+    http_client->input = tmpptr;
+
+    /* get the http_client ready to read the data */
+    http_client->status = RFC822_State_HTTP_Content;
+
+    /* we run it here so that it starts getting some data at least */
+    RTSP_handler(http_client);
+
+    return false;
+}
+
 gboolean HTTP_handle_content(RTSP_Client *rtsp)
 {
     gsize decoded_length = (rtsp->input->len / 4) * 3 + 6, actual_decoded_length;
@@ -225,13 +285,21 @@ gboolean HTTP_handle_content(RTSP_Client *rtsp)
     return false;
 }
 
-gboolean HTTP_handle_idle(ATTR_UNUSED RTSP_Client *rtsp)
+gboolean HTTP_handle_idle(RTSP_Client *rtsp)
 {
-    /* make sure to send the one queued answer we have */
-    while ( g_queue_get_length(rtsp->out_queue) > 0 )
-        ev_run(rtsp->loop, EVRUN_ONCE);
+    /* From now on the socket is only used to send data, driven by the
+       POST connection of the tunnel; but the one queued answer we
+       have has to go out first. It usually fits the socket buffer
+       right away, otherwise the write callback detaches the client
+       once it's sent, as the loop is shared with the other clients of
+       the worker and cannot wait for it. */
+    rtsp_tcp_write_cb(rtsp->loop, &rtsp->ev_io_write, EV_WRITE);
+
+    if ( g_queue_is_empty(rtsp->out_queue) )
+        rtsp_client_detach(rtsp);
+    else
+        rtsp->detach_drained = true;
 
-    ev_unloop(rtsp->loop, EVUNLOOP_ONE);
     return false;
 }
 
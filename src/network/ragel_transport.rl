@@ -58,7 +58,7 @@ GSList *ragel_parse_transport_header(const char *header)
             ( "-" . Port%{transport->rtcp_channel = portval;} );
 
         UnicastUDPParams = Unicast . ( ClientPort | TransportParam )+;
-        MulticastUDPParams = Multicast . TransportParam+;
+        MulticastUDPParams = Multicast . TransportParam*;
 
         UDPParams = ( UnicastUDPParams | MulticastUDPParams );
 
@@ -48,7 +48,9 @@ typedef enum RFC822_Parser_State {
     /** HTTP headers read, reading content */
     RFC822_State_HTTP_Content,
     /** HTTP GET request read, idling (output only) */
-    RFC822_State_HTTP_Idle
+    RFC822_State_HTTP_Idle,
+    /** HTTP POST request read, joining the tunnel's GET connection */
+    RFC822_State_HTTP_Join
 } RFC822_Parser_State;
 
 typedef struct RFC822_Request {
@@ -96,6 +96,30 @@ typedef struct RTCP_report_block {
     uint32_t delay_last_sr;
 } RTCP_report_block;
 
+/**
+ * @brief Common part of the feedback messages (RFC 4585 Section 6.1)
+ *
+ * The feedback message type takes the place of the count in the
+ * RTCP header.
+ */
+typedef struct RTCP_header_FB {
+    uint32_t ssrc;
+    uint32_t media_ssrc;
+} RTCP_header_FB;
+
+/** Feedback message type of the generic NACK */
+#define RTCP_FB_NACK 1
+
+/**
+ * @brief Generic NACK entry (RFC 4585 Section 6.2.1)
+ */
+typedef struct RTCP_nack {
+    /** Sequence number of a lost packet */
+    uint16_t pid;
+    /** Bitmask of the following lost packets */
+    uint16_t blp;
+} RTCP_nack;
+
 typedef struct RTCP_header_SDES {
     uint32_t ssrc;
     uint8_t attr_name;
@@ -296,6 +320,11 @@ gboolean rtcp_send_sr(RTP_session *session, rtcp_pkt_type type)
 {
     GByteArray *outpkt = NULL;
 
+    /* sessions without a transport of their own (multicast viewers)
+       have nowhere to send reports to */
+    if ( session->send_rtcp == NULL )
+        return false;
+
     switch(type) {
     case SDES:
         outpkt = rtcp_pkt_sr_sdes(session);
@@ -319,30 +348,146 @@ gboolean rtcp_send_sr(RTP_session *session, rtcp_pkt_type type)
      (pt == SDES)? "Source Description" : \
      (pt == BYE) ? "Bye" : \
      (pt == APP) ? "Application" : \
+     (pt == RTPFB) ? "Transport Feedback" : \
                    "Unknown")
 /**
- * @brief parse Receiver Reports and update the statistics accordingly
+ * @brief Current time as the middle 32 bits of an NTP timestamp
+ *
+ * This is the format of the LSR and DLSR fields of the report blocks,
+ * in 1/65536 seconds.
  */
+static uint32_t rtcp_ntp_middle()
+{
+    struct timespec now;
 
-static void parse_receiver_report(uint8_t *packet, int count)
+    gettimeinseconds(&now);
+
+    return ((uint32_t)(now.tv_sec + 2208988800u) << 16) |
+        (uint32_t)((((uint64_t) now.tv_nsec) << 16) / 1000000000u);
+}
+
+/**
+ * @brief Update the statistics of a session from a report block
+ *
+ * @param session The session the block reports about
+ * @param reporter SSRC of the receiver sending the report
+ * @param report The report block
+ *
+ * The round-trip time is computed as described by RFC 3550 Section
+ * 6.4.1, from the time the sender report the block refers to was
+ * sent, and the time the receiver held it.
+ */
+static void rtcp_report_block(RTP_session *session, uint32_t reporter,
+                              const RTCP_report_block *report)
 {
-    int ssrc = ntohl(((RTCP_header_RR*)packet)->ssrc);
-    fnc_log(FNC_LOG_VERBOSE, "[RTCP] Receiver report for %u", ssrc);
-    packet+=4;
-    while(count--) {
-        RTCP_report_block *report = (RTCP_report_block *)packet;
-        fnc_log(FNC_LOG_VERBOSE,
-                "[RTCP] ssrc %u, fraction %d, lost %d, "
-                "sequence %u, jitter %u, "
-                "last Sender Report %u, delay %u",
-                report->ssrc, report->fract_lost,
-                report->packet_lost[0]<<3|
-                report->packet_lost[1]<<2|
-                report->packet_lost[2],
-                ntohl(report->h_seq_no),
-                ntohl(report->last_sr),
-                ntohl(report->delay_last_sr));
-        packet+=sizeof(RTCP_report_block);
+    RTP_ReceiverStats *stats = &session->receiver;
+    const uint32_t last_sr = ntohl(report->last_sr);
+    const uint32_t delay = ntohl(report->delay_last_sr);
+    int32_t lost = report->packet_lost[0] << 16 |
+                   report->packet_lost[1] << 8 |
+                   report->packet_lost[2];
+
+    /* 24-bit two's complement */
+    if ( lost & 0x800000 )
+        lost -= 0x1000000;
+
+    stats->reports++;
+    stats->fraction_lost = report->fract_lost;
+    stats->packets_lost = lost;
+    stats->highest_seq = ntohl(report->h_seq_no);
+    stats->jitter = ntohl(report->jitter);
+    stats->last_report = ev_now(session->client->loop);
+
+    /* no sender report was received yet otherwise */
+    if ( last_sr != 0 ) {
+        const uint32_t rtt = rtcp_ntp_middle() - last_sr - delay;
+
+        /* the clocks of the two hosts are not synchronised, but
+         * this one wouldn't be going backwards */
+        if ( rtt < 0x80000000u )
+            stats->rtt = rtt / 65536.0;
+    }
+
+    fnc_log(FNC_LOG_VERBOSE,
+            "[RTCP] ssrc %u from %u: fraction %u, lost %d, "
+            "sequence %u, jitter %u, rtt %f",
+            session->ssrc, reporter, stats->fraction_lost,
+            stats->packets_lost, stats->highest_seq, stats->jitter,
+            stats->rtt);
+
+    stats_publish_rtp(session);
+
+    /* All the members of a multicast group report to its sender */
+    if ( session->multicast != NULL )
+        rtp_multicast_report(session, reporter, stats->fraction_lost,
+                             stats->jitter);
+    else
+        rtp_abr_report(session);
+}
+
+/**
+ * @brief Parse the report blocks of a Sender or Receiver Report
+ *
+ * @param session The session the report was received for
+ * @param rtcp The header of the report
+ * @param size Size of the report, header included
+ *
+ * Only the blocks about @p session are considered; the SSRC of the
+ * reporter starts both kinds of reports, but the blocks of a Sender
+ * Report follow the sender information.
+ */
+static void rtcp_parse_report(RTP_session *session, const RTCP_header *rtcp,
+                              size_t size)
+{
+    const uint8_t *packet = (const uint8_t *)rtcp;
+    const size_t offset = sizeof(RTCP_header) +
+        (rtcp->pt == SR ? sizeof(RTCP_header_SR) : sizeof(RTCP_header_RR));
+    uint32_t reporter;
+    unsigned int i;
+
+    if ( offset + rtcp->count * sizeof(RTCP_report_block) > size ) {
+        fnc_log(FNC_LOG_WARN, "[RTCP] Malformed %s, %u blocks in %zd bytes",
+                rtcp_pt_to_string(rtcp->pt), rtcp->count, size);
+        return;
+    }
+
+    reporter = ntohl(((const RTCP_header_RR *)(packet + sizeof(RTCP_header)))->ssrc);
+
+    for ( i = 0; i < rtcp->count; i++ ) {
+        const RTCP_report_block *report = (const RTCP_report_block *)
+            (packet + offset + i * sizeof(RTCP_report_block));
+
+        if ( ntohl(report->ssrc) == session->ssrc )
+            rtcp_report_block(session, reporter, report);
+    }
+}
+
+/**
+ * @brief Parse a transport layer feedback message
+ *
+ * @param session The session the message was received for
+ * @param rtcp The header of the message
+ * @param size Size of the message, header included
+ *
+ * Only generic NACKs about @p session are handled, by retransmitting
+ * the packets they list.
+ */
+static void rtcp_parse_rtpfb(RTP_session *session, const RTCP_header *rtcp,
+                             size_t size)
+{
+    const uint8_t *packet = (const uint8_t *)rtcp;
+    const RTCP_header_FB *fb =
+        (const RTCP_header_FB *)(packet + sizeof(RTCP_header));
+    size_t offset = sizeof(RTCP_header) + sizeof(RTCP_header_FB);
+
+    if ( rtcp->count != RTCP_FB_NACK || size < offset ||
+         ntohl(fb->media_ssrc) != session->ssrc )
+        return;
+
+    for ( ; offset + sizeof(RTCP_nack) <= size; offset += sizeof(RTCP_nack) ) {
+        const RTCP_nack *nack = (const RTCP_nack *)(packet + offset);
+
+        rtp_rtx_nack(session, ntohs(nack->pid), ntohs(nack->blp));
     }
 }
 
@@ -351,18 +496,18 @@ static void parse_receiver_report(uint8_t *packet, int count)
  */
 void rtcp_handle(RTP_session *session, uint8_t *packet, size_t len)
 {
-    int rtcp_size = 0;
+    size_t rtcp_size = 0;
 
     fnc_log(FNC_LOG_VERBOSE, "[RTCP] Handling a %zd byte packet", len);
-    while (len > sizeof(RTCP_header)) {
+    while (len >= sizeof(RTCP_header)) {
         RTCP_header *rtcp = (RTCP_header *)packet;
         rtcp_size = (ntohs(rtcp->length)+1)<<2;
 
-        fnc_log(FNC_LOG_VERBOSE, "[RTCP] %s (%d) packet found %d byte",
+        fnc_log(FNC_LOG_VERBOSE, "[RTCP] %s (%d) packet found %zd byte",
                 rtcp_pt_to_string(rtcp->pt), rtcp->pt, rtcp_size);
 
-        if (rtcp_size > len) {
-            fnc_log(FNC_LOG_WARN, "[RTCP]  Malformed packet %d > %zd",
+        if (rtcp_size > len || rtcp->version != 2) {
+            fnc_log(FNC_LOG_WARN, "[RTCP]  Malformed packet (%zd of %zd bytes)",
                     rtcp_size, len);
             return;
         }
@@ -370,7 +515,11 @@ void rtcp_handle(RTP_session *session, uint8_t *packet, size_t len)
         switch (rtcp->pt) {
             case SR:
             case RR:
-                parse_receiver_report(packet+4, rtcp->count);
+                rtcp_parse_report(session, rtcp, rtcp_size);
+                break;
+            case RTPFB:
+                rtcp_parse_rtpfb(session, rtcp, rtcp_size);
+                break;
             case SDES:
             default:
                 break;
@@ -23,6 +23,7 @@
 #include <config.h>
 
 #include <stdbool.h>
+#include <string.h>
 
 #include "feng.h"
 #include "rtp.h"
@@ -51,14 +52,16 @@ static void rtp_session_free(gpointer session_gen,
      * to ensure that we're paused before doing this but doesn't
      * matter now.
      */
-    if (client->loop)
-        ev_periodic_stop(client->loop, &session->rtp_writer);
+    if (client->worker)
+        rtp_scheduler_remove(client->worker->scheduler, session);
+
+    rtp_fanout_leave(session);
 
     session->close_transport(session);
 
     r_pause(session->track->parent);
 
-    /* Remove the consumer */
+    /* Remove the consumer, if still registered */
     bq_consumer_free(session);
 
     /* Deallocate memory */
@@ -106,19 +109,36 @@ static void rtp_session_resume(gpointer session_gen, gpointer range_gen) {
 
     fnc_log(FNC_LOG_VERBOSE, "Resuming session %p", session);
 
+    /* The group's sender does the sending */
+    if ( session->multicast ) {
+        rtp_multicast_play(session);
+        return;
+    }
+
     session->range = range;
     session->send_time = 0.0;
     session->start_rtptime += (cur_time - session->last_packet_send_time) *
                               session->track->clock_rate;
     session->last_packet_send_time = cur_time;
 
+    /* A pending rendition switch is overridden by the new range */
+    session->abr.resync = false;
+
+    /* Live tracks might start from a cached keyframe */
+    session->catch_up = session->track->gop_cache;
+
+    /* Live tracks can be sent by the worker's fan-out instead */
+    if ( rtp_fanout_join(session) )
+        return;
+
+    /* Sessions joining a shared resource are registered already */
+    bq_consumer_new(session);
+
     r_resume(resource);
     r_fill(resource, session);
 
-    ev_periodic_set(&session->rtp_writer,
-                    range->playback_time - 0.05,
-                    0, NULL);
-    ev_periodic_start(client->loop, &session->rtp_writer);
+    rtp_scheduler_add(client->worker->scheduler, session,
+                      range->playback_time - 0.05);
 }
 
 /**
@@ -154,9 +174,18 @@ static void rtp_session_pause(gpointer session_gen,
     /* We should assert its presence, we cannot pause a non-running
      * session! */
 
+    if ( session->multicast ) {
+        rtp_multicast_pause(session);
+        return;
+    }
+
     r_pause(resource);
 
-    ev_periodic_stop(client->loop, &session->rtp_writer);
+    rtp_scheduler_remove(client->worker->scheduler, session);
+    rtp_fanout_leave(session);
+
+    /* Don't hold back the queue while we're not reading it */
+    bq_consumer_free(session);
 }
 
 /**
@@ -179,7 +208,6 @@ void rtp_session_gslist_pause(GSList *sessions_list) {
  * @param buffer Buffer of which calculate timestamp
  * @return RTP Timestamp (in local endianess)
  */
-static inline
 uint32_t rtptime(RTP_session *session, int clock_rate, struct MParserBuffer *buffer)
 {
     uint32_t calc_rtptime =
@@ -187,38 +215,62 @@ uint32_t rtptime(RTP_session *session, int clock_rate, struct MParserBuffer *buf
     return session->start_rtptime + calc_rtptime;
 }
 
-typedef struct {
-    /* byte 0 */
-#if (G_BYTE_ORDER == G_LITTLE_ENDIAN)
-    uint8_t csrc_len:4;   /* expect 0 */
-    uint8_t extension:1;  /* expect 1, see RTP_OP below */
-    uint8_t padding:1;    /* expect 0 */
-    uint8_t version:2;    /* expect 2 */
-#elif (G_BYTE_ORDER == G_BIG_ENDIAN)
-    uint8_t version:2;
-    uint8_t padding:1;
-    uint8_t extension:1;
-    uint8_t csrc_len:4;
-#else
-#error Neither big nor little
-#endif
-    /* byte 1 */
-#if (G_BYTE_ORDER == G_LITTLE_ENDIAN)
-    uint8_t payload:7;    /* RTP_PAYLOAD_RTSP */
-    uint8_t marker:1;     /* expect 1 */
-#elif (G_BYTE_ORDER == G_BIG_ENDIAN)
-    uint8_t marker:1;
-    uint8_t payload:7;
-#endif
-    /* bytes 2, 3 */
-    uint16_t seq_no;
-    /* bytes 4-7 */
-    uint32_t timestamp;
-    /* bytes 8-11 */
-    uint32_t ssrc;    /* stream number is used here. */
+/**
+ * @brief Describe an RTP packet for scatter-gather I/O
+ *
+ * @param header The RTP header of the packet
+ * @param buffer The buffer carrying the payload of the packet
+ * @param iov Array to fill in
+ *
+ * @return The number of entries of @p iov used.
+ */
+size_t rtp_packet_iovec(const uint8_t *header, struct MParserBuffer *buffer,
+                        struct iovec iov[RTP_PACKET_IOVECS])
+{
+    size_t count = 0;
+
+    iov[count].iov_base = (uint8_t*)header;
+    iov[count++].iov_len = RTP_HEADER_SIZE;
+
+    if ( buffer->prefix_size > 0 ) {
+        iov[count].iov_base = buffer->prefix;
+        iov[count++].iov_len = buffer->prefix_size;
+    }
+
+    iov[count].iov_base = buffer->data;
+    iov[count++].iov_len = buffer->data_size;
+
+    return count;
+}
+
+/**
+ * @brief Send an RTP packet to the client
+ *
+ * @param session The RTP session to send the packet for
+ * @param header The RTP header of the packet
+ * @param buffer The data for the packet to be sent
+ *
+ * @return The return value of the transport's send function.
+ */
+gboolean rtp_packet_send_header(RTP_session *session, const uint8_t *header,
+                                struct MParserBuffer *buffer)
+{
+    /* Kept also for the packets that fail, they are lost as well */
+    session->next_seq = (header[2] << 8 | header[3]) + 1;
 
-    uint8_t data[]; /**< Variable-sized data payload */
-} RTP_packet;
+    if ( !session->send_rtp(session, header, buffer) ) {
+        fnc_log(FNC_LOG_DEBUG, "RTP Packet Lost");
+        return false;
+    }
+
+    session->last_timestamp = buffer->timestamp;
+    session->pkt_count++;
+    session->octet_count += mparser_buffer_size(buffer);
+
+    session->last_packet_send_time = time(NULL);
+
+    return true;
+}
 
 /**
  * @brief Send the actual buffer as an RTP packet to the client
@@ -226,58 +278,106 @@ typedef struct {
  * @param session The RTP session to send the packet for
  * @param buffer The data for the packet to be sent
  *
- * @return The number of frames sent to the client.
- * @retval -1 Error during writing.
+ * Only the RTP header is built for each session, out of @ref
+ * RTP_session::header; the payload is passed as-is to the transport,
+ * that sends it with scatter-gather I/O.
  */
 static void rtp_packet_send(RTP_session *session, struct MParserBuffer *buffer)
 {
-    const size_t packet_size = sizeof(RTP_packet) + buffer->data_size;
-    GByteArray *outbuf = g_byte_array_sized_new(packet_size);
-    RTP_packet *packet = (RTP_packet*)(outbuf->data);
+    uint8_t header[RTP_HEADER_SIZE];
     Track *tr = session->track;
-    uint32_t timestamp = rtptime(session, tr->clock_rate, buffer);
+    const uint16_t seq_no = htons(buffer->seq_no + session->abr.seq_offset);
+    const uint32_t timestamp = htonl(rtptime(session, tr->clock_rate, buffer));
 
-    outbuf->len = packet_size;
-
-    packet->version = 2;
-    packet->padding = 0;
-    packet->extension = 0;
-    packet->csrc_len = 0;
-    packet->marker = buffer->marker & 0x1;
-    packet->payload = tr->payload_type & 0x7f;
-    packet->seq_no = htons(buffer->seq_no);
-    packet->timestamp = htonl(timestamp);
-    packet->ssrc = htonl(session->ssrc);
+    memcpy(header, session->header, RTP_HEADER_SIZE);
+    if ( buffer->marker )
+        header[1] |= 0x80;
+    memcpy(header + 2, &seq_no, sizeof(seq_no));
+    memcpy(header + 4, &timestamp, sizeof(timestamp));
 
     fnc_log(FNC_LOG_VERBOSE, "[RTP] Timestamp: %u", ntohl(timestamp));
 
-    memcpy(packet->data, buffer->data, buffer->data_size);
+    rtp_packet_send_header(session, header, buffer);
+}
 
-    if (session->send_rtp(session, outbuf)) {
-        session->last_timestamp = buffer->timestamp;
-        session->pkt_count++;
-        session->octet_count += buffer->data_size;
+/**
+ * @brief Tell the receivers of a session that the stream is over
+ */
+static void rtp_session_bye(RTP_session *session)
+{
+    fnc_log(FNC_LOG_INFO, "[rtp] Stream Finished");
 
-        session->last_packet_send_time = time(NULL);
-    } else {
-        fnc_log(FNC_LOG_DEBUG, "RTP Packet Lost");
+    if ( session->fanout.fanout )
+        rtp_fanout_bye(session->fanout.fanout);
+    else
+        rtcp_send_sr(session, BYE);
+}
+
+/**
+ * @brief Delay to put between a packet and the following one
+ *
+ * @param session The session sending the packet
+ * @param size Payload size of the packet
+ * @param frame_size Size of the frame the packet is part of, if known
+ * @param duration Duration of the frame
+ */
+static double rtp_pacing_gap(const RTP_session *session, size_t size,
+                             size_t frame_size, double duration)
+{
+    const struct cfg_vhost_t *vhost = session->client->vhost;
+
+    switch ( session->pacing ) {
+    case RTP_PACING_FRAME:
+        if ( frame_size == 0 || duration <= 0 )
+            return 0;
+
+        return duration * vhost->pacing_spread / 100 * size / frame_size;
+    case RTP_PACING_BITRATE:
+        return size * 8.0 / (vhost->pacing_bitrate * 1000.0);
+    default:
+        return 0;
     }
 }
 
+/**
+ * @brief Maximum number of packets sent by a single @ref rtp_session_write
+ *        run
+ *
+ * All the packets that are due when the writer is called are sent in
+ * one go (and flushed together by the transport), up to this amount,
+ * so that a late session does not starve the rest of the loop.
+ */
+#define RTP_WRITE_BURST 32
+
+/**
+ * @brief Speed at which the packets of a live track are sent while a
+ *        session catches up with it
+ *
+ * Sessions start from the keyframe cached by the track, up to a group
+ * of pictures behind; they are sent at this many times the real-time
+ * rate until they reach the live edge.
+ */
+#define RTP_LIVE_CATCHUP_SPEED 2
+
 /**
  * Send pending RTP packets to a session.
  *
- * @param loop eventloop
- * @param w contains the session the RTP session for which to send the packets
+ * @param session The RTP session for which to send the packets
+ *
+ * Called by the worker's @ref rtp_scheduler once the session is due;
+ * unless the stream is over, the session is scheduled again for its
+ * next packet.
+ *
  * @todo implement a saner ratecontrol
  */
-static void rtp_write_cb(struct ev_loop *loop, ev_periodic *w,
-                         ATTR_UNUSED int revents)
+void rtp_session_write(RTP_session *session)
 {
-    RTP_session *session = w->data;
+    struct ev_loop *loop = session->client->loop;
     Resource *resource = session->track->parent;
     struct MParserBuffer *buffer = NULL;
-    ev_tstamp next_time = w->offset;
+    ev_tstamp next_time = session->writer.next_time;
+    unsigned int burst = 0, packets = 0;
+    size_t bytes = 0;
 
     /* If there is no buffer, it means that either the producer
      * has been stopped (as we reached the end of stream) or that
@@ -288,8 +388,7 @@ static void rtp_write_cb(struct ev_loop *loop, ev_periodic *w,
         /* If the producer has been stopped, we send the
          * finishing packets and go away.
          */
-        fnc_log(FNC_LOG_INFO, "[rtp] Stream Finished");
-        rtcp_send_sr(session, BYE);
+        rtp_session_bye(session);
         return;
     }
 
@@ -303,16 +402,19 @@ static void rtp_write_cb(struct ev_loop *loop, ev_periodic *w,
             session->track->encoding_name,
             bq_consumer_unseen(session));
 
-    /* Get the current buffer, if there is enough data */
-    if ( !(buffer = bq_consumer_get(session)) ) {
+    /* Get the current buffer, if there is enough data; right after
+     * a rendition switch, start where the previous one was left */
+    buffer = session->abr.resync ?
+        rtp_abr_resync(session) : bq_consumer_get(session);
+
+    if ( !buffer ) {
         /* We wait a bit of time to get the data but before it is
          * expired.
          */
         double sleep_for = 0.1;
 
         if (resource->eor) {
-            fnc_log(FNC_LOG_INFO, "[rtp] Stream Finished");
-            rtcp_send_sr(session, BYE);
+            rtp_session_bye(session);
             return;
         }
 
@@ -322,35 +424,63 @@ static void rtp_write_cb(struct ev_loop *loop, ev_periodic *w,
         next_time += sleep_for;
         fnc_log(FNC_LOG_INFO, "[%s] nothing to read, waiting %f...",
                 session->track->encoding_name, sleep_for);
-    } else {
+    } else do {
         struct MParserBuffer *next;
         double delivery  = buffer->delivery;
         double timestamp = buffer->timestamp;
         double duration  = buffer->duration;
         gboolean marker  = buffer->marker;
+        size_t size      = mparser_buffer_size(buffer);
+        double gap       = rtp_pacing_gap(session, size, buffer->frame_size,
+                                          duration ? duration :
+                                          session->track->frame_duration);
+
+        /* The new rendition is sent starting from this same time */
+        if ( rtp_abr_switch(session, buffer) )
+            break;
 
         rtp_packet_send(session, buffer);
+        packets++;
+        bytes += size;
 
         if (session->pkt_count % 29 == 1)
             rtcp_send_sr(session, SDES);
 
         if (bq_consumer_move(session)) {
+            const ev_tstamp sent_time = next_time;
+
             next = bq_consumer_get(session);
             if(delivery != next->delivery) {
                 if (session->track->parent->source == LIVE_SOURCE)
-                    next_time += next->delivery - delivery;
+                    next_time += (next->delivery - delivery) /
+                                 (session->catch_up ? RTP_LIVE_CATCHUP_SPEED : 1) -
+                                 session->pacing_delay;
                 else
                     next_time = session->range->playback_time -
                                 session->range->begin_time +
                                 next->delivery;
+                session->pacing_delay = 0;
+
+                /* the cap holds across frames as well */
+                if ( session->pacing == RTP_PACING_BITRATE )
+                    next_time = MAX(next_time, sent_time + gap);
+            } else {
+                /* spread the packets of the same frame */
+                next_time += gap;
+                session->pacing_delay += gap;
             }
+            buffer = next;
         } else {
             /* Wait a bit of time to recover from buffer underrun */
             double sleep_for = duration ? duration : 0.1;
 
+            /* Nothing left to catch up with */
+            session->catch_up = false;
+
             next_time += sleep_for;
             fnc_log(FNC_LOG_INFO, "[%s] next packet not available, waiting %f...",
                     session->track->encoding_name, sleep_for);
+            buffer = NULL;
         }
 
         fnc_log(FNC_LOG_VERBOSE,
@@ -362,16 +492,68 @@ static void rtp_write_cb(struct ev_loop *loop, ev_periodic *w,
             duration,
             next_time - session->range->playback_time,
             marker? "M" : " ");
+    } while ( buffer != NULL &&
+              ++burst < RTP_WRITE_BURST &&
+              next_time <= ev_now(loop) );
+
+    if ( session->flush_rtp )
+        session->flush_rtp(session);
+
+    if ( packets > 0 ) {
+        stats_account_burst(packets, bytes);
+        stats_publish_rtp(session);
     }
-    ev_periodic_set(w, next_time, 0, NULL);
-    ev_periodic_again(loop, w);
 
-    r_fill(resource, session);
+    rtp_scheduler_add(session->client->worker->scheduler, session, next_time);
+
+    /* The resource changes with the rendition */
+    r_fill(session->track->parent, session);
 }
 
 typedef gboolean (*rtp_transport_init_cb)(RTSP_Client *rtsp,
                                           RTP_session *rtp_s,
                                           struct ParsedTransport *parsed);
+
+/**
+ * @brief Allocate and initialise an RTP session, without transport
+ *
+ * @param rtsp The client the session belongs to
+ * @param tr The track that will be sent over the session
+ *
+ * The caller has to set the transport callbacks up.
+ */
+RTP_session *rtp_session_alloc(RTSP_Client *rtsp, Track *tr)
+{
+    RTP_session *rtp_s = g_slice_new0(RTP_session);
+    uint32_t ssrc;
+
+    rtp_s->ssrc = g_random_int();
+    rtp_s->start_rtptime = g_random_int();
+    rtp_s->track = tr;
+    rtp_s->client = rtsp;
+    rtp_s->receiver.rtt = -1;
+
+    if ( (rtp_s->rtx.payload_type = rtp_rtx_payload_type(tr)) >= 0 ) {
+        do
+            rtp_s->rtx.ssrc = g_random_int();
+        while ( rtp_s->rtx.ssrc == rtp_s->ssrc );
+        rtp_s->rtx.seq = g_random_int();
+    }
+
+    /* version 2, no padding, extension or CSRC */
+    ssrc = htonl(rtp_s->ssrc);
+    rtp_s->header[0] = 2 << 6;
+    rtp_s->header[1] = tr->payload_type & 0x7f;
+    memcpy(rtp_s->header + 8, &ssrc, sizeof(ssrc));
+
+    if ( strcmp(rtsp->vhost->pacing, "frame") == 0 )
+        rtp_s->pacing = RTP_PACING_FRAME;
+    else if ( strcmp(rtsp->vhost->pacing, "bitrate") == 0 )
+        rtp_s->pacing = RTP_PACING_BITRATE;
+
+    return rtp_s;
+}
+
 /**
  * @brief Create a new RTP session object.
  *
@@ -390,15 +572,13 @@ RTP_session *rtp_session_new(RTSP_Client *rtsp,
                              const char *uri, Track *tr,
                              GSList *transports) {
     RTP_session *rtp_s;
-    ev_periodic *periodic;
 
     if ( g_atomic_int_get(&tr->stopped) == 1 )
         return NULL;
 
-    rtp_s = g_slice_new0(RTP_session);
-    periodic = &rtp_s->rtp_writer;
-
-    rtp_s->ssrc = g_random_int();
+    /* The transports may depend on the track (multicast is only
+     * available for live resources) */
+    rtp_s = rtp_session_alloc(rtsp, tr);
 
     do {
         struct ParsedTransport *transport = transports->data;
@@ -423,19 +603,6 @@ RTP_session *rtp_session_new(RTSP_Client *rtsp,
      */
 
     rtp_s->uri = g_strdup(uri);
-    rtp_s->start_rtptime = g_random_int();
-    rtp_s->track = tr;
-    rtp_s->client = rtsp;
-
-    /* Make sure we don't overflow the consumers count; while this
-     * case is most likely just hypothetical, it doesn't hurt to be
-     * safe.
-     */
-    g_assert_cmpuint(tr->consumers, <, G_MAXULONG);
-    g_atomic_int_add(&tr->consumers, 1);
-
-    periodic->data = rtp_s;
-    ev_periodic_init(periodic, rtp_write_cb, 0, 0, NULL);
 
     return rtp_s;
 
@@ -443,3 +610,31 @@ RTP_session *rtp_session_new(RTSP_Client *rtsp,
     g_slice_free(RTP_session, rtp_s);
     return NULL;
 }
+
+/**
+ * @brief Create the RTP session sending a track to a multicast group
+ *
+ * @param client The client the session runs for; it is not connected
+ *               to anyone, but gives the session its worker and vhost
+ * @param tr The track that will be sent over the session
+ * @param group The address of the group (see @ref
+ *              rtp_udp_multicast_transport)
+ * @param ttl Time-to-live of the packets sent to the group
+ *
+ * @return A pointer to a newly-allocated RTP_session, to be freed with
+ *         @ref rtp_session_gslist_free, or NULL if the sockets couldn't
+ *         be set up.
+ */
+RTP_session *rtp_session_new_multicast(RTSP_Client *client, Track *tr,
+                                       const struct sockaddr *group,
+                                       unsigned int ttl)
+{
+    RTP_session *rtp_s = rtp_session_alloc(client, tr);
+
+    if ( !rtp_udp_multicast_transport(rtp_s, group, ttl) ) {
+        g_slice_free(RTP_session, rtp_s);
+        return NULL;
+    }
+
+    return rtp_s;
+}
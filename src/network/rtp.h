@@ -29,6 +29,7 @@
 #include <sys/timeb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <ev.h>
 
 #if ENABLE_SCTP
@@ -43,14 +44,76 @@ struct RTSP_Client;
 struct RTSP_Range;
 struct RTSP_session;
 struct RTP_session;
+struct MParserBuffer;
+struct rtp_uring;
+struct rtp_uring_flight;
+struct rtp_scheduler;
+struct rtp_multicast_group;
+struct rtp_fanout;
 
 #define RTP_DEFAULT_PORT 5004
 #define BUFFERED_FRAMES_DEFAULT 16
 #define RTP_DEFAULT_MTU 1500
 
-typedef gboolean (*rtp_send_cb)(struct RTP_session *client, GByteArray *data);
+/** Size of the fixed RTP header, without CSRCs or extensions */
+#define RTP_HEADER_SIZE 12
+
+/** Maximum number of iovec entries used by @ref rtp_packet_iovec */
+#define RTP_PACKET_IOVECS 3
+
+/**
+ * @brief Callback to send an RTP packet
+ *
+ * @param rtp The session to send the packet for
+ * @param header The RTP header of the packet (@ref RTP_HEADER_SIZE bytes)
+ * @param buffer The payload of the packet; the transport has to take a
+ *               reference to it if it doesn't send it right away
+ */
+typedef gboolean (*rtp_send_cb)(struct RTP_session *rtp,
+                                const uint8_t *header,
+                                struct MParserBuffer *buffer);
+typedef gboolean (*rtcp_send_cb)(struct RTP_session *rtp, GByteArray *data);
+typedef void (*rtp_flush_cb)(struct RTP_session *rtp);
 typedef void (*rtp_close_cb)(struct RTP_session *rtp);
 
+/**
+ * @brief How the packets of a frame are spread in time
+ *
+ * @see cfg_vhost_t::pacing
+ */
+typedef enum {
+    /** All the packets of a frame are sent at its delivery time */
+    RTP_PACING_BURST,
+    /** Packets are spread over a fraction of the frame duration */
+    RTP_PACING_FRAME,
+    /** Packets are sent at most at the configured bitrate */
+    RTP_PACING_BITRATE
+} RTP_Pacing;
+
+/**
+ * @brief Reception statistics of an RTP session, as reported by its
+ *        receiver
+ *
+ * Updated from the report blocks of the RTCP Sender and Receiver
+ * Reports received for the session (RFC 3550 Section 6.4).
+ */
+typedef struct RTP_ReceiverStats {
+    /** Number of report blocks received about the session */
+    unsigned int reports;
+    /** Fraction of packets lost since the previous report, in 1/256 units */
+    uint8_t fraction_lost;
+    /** Cumulative number of packets lost; negative with duplicates */
+    int32_t packets_lost;
+    /** Extended highest sequence number received */
+    uint32_t highest_seq;
+    /** Interarrival jitter, in RTP timestamp units */
+    uint32_t jitter;
+    /** Round-trip time in seconds, negative until measured */
+    double rtt;
+    /** Loop time the last report was received at */
+    ev_tstamp last_report;
+} RTP_ReceiverStats;
+
 typedef struct RTP_session {
     uint32_t start_rtptime;
 
@@ -72,42 +135,183 @@ typedef struct RTP_session {
      * @brief Serial number of the queue
      *
      * This value is the “serial number” of the producer's queue,
-     * which increases each time the producer generates a new queue.
+     * which increases each time the producer resets its queue.
      *
-     * This is taken, at each move, from @ref
-     * Track::queue_serial, and is used by the
+     * This is taken from @ref Track::queue_serial whenever the cursor
+     * is moved to the head of the queue, and is used by the
      * consumer's function to ensure no old data is used.
      */
-    gulong queue_serial;
+    gint queue_serial;
+
+    /**
+     * @brief Ring sequence number of the current element
+     *
+     * This is the position of the "next to serve" buffer in the
+     * @ref Track ring; it is private to the consumer.
+     */
+    gint cursor;
+
+    /** The element at @ref cursor, once it has been picked up */
+    struct MParserBuffer *current;
 
     /**
-     * @brief Pointer to the current element in the list
+     * @brief Hazard pointer for @ref current
      *
-     * This pointer is used to access the "next to serve" buffer; and
-     * is originally set to the head of @ref Track
-     * queue.
+     * Published with atomic operations so that the producer does not
+     * free the element while it's being sent.
      */
-    GList *current_element_pointer;
+    gpointer hazard;
 
     /**
-     * @brief Last element serial returned.
+     * @brief Whether the session is registered with its track
+     *
+     * Sessions are only registered as consumers while playing, so
+     * that idle ones don't hold back the queue of a track shared
+     * with other sessions.
      *
-     * @brief This is updated at _get and makes sure that we can
-     * distinguish between the situations of "all seen" and "none
-     * seen".
+     * @see bq_consumer_new, bq_consumer_free
      */
-    uint16_t last_element_serial;
+    gboolean consuming;
 
     struct RTSP_Client *client;
 
     uint32_t octet_count;
     uint32_t pkt_count;
+    /** Sequence number following the one of the last packet sent */
+    uint16_t next_seq;
+
+    RTP_ReceiverStats receiver;
+
+    /**
+     * @brief Copy of the counters for the statistics
+     *
+     * Updated by the session's worker with @ref stats_publish_rtp,
+     * under the client's @ref RTSP_Client::stats_lock, since the
+     * statistics are collected from other workers.
+     */
+    struct {
+        uint32_t pkt_count;
+        uint32_t octet_count;
+        uint32_t rtx_packets;
+        /** Clock rate of the track being sent, changing with the rendition */
+        unsigned int clock_rate;
+        RTP_ReceiverStats receiver;
+    } published;
 
     rtp_send_cb send_rtp;
-    rtp_send_cb send_rtcp;
+    rtcp_send_cb send_rtcp;
+    /**
+     * @brief Send out the RTP packets queued by @ref send_rtp
+     *
+     * Called at the end of each @ref rtp_session_write run; NULL for the
+     * transports that send the packets right away.
+     */
+    rtp_flush_cb flush_rtp;
     rtp_close_cb close_transport;
 
-    ev_periodic rtp_writer;
+    /**
+     * @brief State of the session in the worker's @ref rtp_scheduler
+     */
+    struct {
+        /** Link in the wheel slot, its data points to the session */
+        GList link;
+        /** Wheel slot holding the session, NULL if not scheduled */
+        GQueue *slot;
+        /** Tick the session is due at */
+        guint64 due;
+        /** Loop time the session was scheduled for */
+        ev_tstamp next_time;
+    } writer;
+
+    RTP_Pacing pacing;
+
+    /**
+     * @brief Delay added by the pacing to the current frame
+     *
+     * Taken away when moving to the next frame, so that pacing does
+     * not accumulate on live streams, timed relative to the previous
+     * frame.
+     */
+    double pacing_delay;
+
+    /**
+     * @brief Whether the session is behind the live edge of its track
+     *
+     * Set when starting from the group of pictures cached by a live
+     * track (see @ref Track::gop_cache); the packets are then sent
+     * faster than real time, until none is left to send.
+     */
+    gboolean catch_up;
+
+    /**
+     * @brief Template of the RTP header of the session's packets
+     *
+     * Version, payload type and SSRC are set when the session is
+     * created; marker, sequence number and timestamp are patched in
+     * for each packet.
+     */
+    uint8_t header[RTP_HEADER_SIZE];
+
+    /**
+     * @brief State of the session in its worker's fan-out of a live
+     *        track
+     *
+     * @see rtp_fanout_join
+     */
+    struct {
+        /** Fan-out sending the packets of the session, NULL if the
+            session reads its track itself */
+        struct rtp_fanout *fanout;
+        /** Link in the fan-out's sessions, its data points to the
+            session */
+        GList link;
+        /** Difference between the session's RTP timestamps and the
+            fan-out's */
+        uint32_t delta;
+    } fanout;
+
+    /**
+     * @brief Multicast group of the session
+     *
+     * Set both on the sessions of the clients receiving from a group,
+     * which don't send anything themselves, and on the one session
+     * sending to it.
+     *
+     * @see rtp_multicast_transport
+     */
+    struct rtp_multicast_group *multicast;
+
+    /**
+     * @brief Retransmission stream of the session (RFC 4588)
+     *
+     * Lost packets reported by the client are sent again in this
+     * stream, SSRC-multiplexed with the original one.
+     *
+     * @see rtp_rtx_nack
+     */
+    struct {
+        /** Payload type of the stream, negative when disabled */
+        int payload_type;
+        uint32_t ssrc;
+        /** Sequence number of the next retransmission */
+        uint16_t seq;
+        /** Number of packets retransmitted */
+        uint32_t packets;
+    } rtx;
+
+    /**
+     * @brief State of the session across rendition switches
+     *
+     * @see rtp_abr_switch
+     */
+    struct {
+        /** Added to the sequence numbers of the track's buffers */
+        uint16_t seq_offset;
+        /** Whether the first buffer of a new rendition is awaited */
+        gboolean resync;
+        /** Delivery time of the keyframe the switch happened at */
+        double switch_time;
+    } abr;
 
     /**
      * @brief String representing the Transport header to report
@@ -130,6 +334,13 @@ typedef struct RTP_session {
         struct {
             int rtp;
             int rtcp;
+            /** Whether the track marks its keyframes, so that video
+                packets can be shed on congestion */
+            gboolean keyframes;
+            /** Whether the packets being sent belong to a keyframe */
+            gboolean in_keyframe;
+            /** Whether packets are being shed until the next keyframe */
+            gboolean shedding;
         } tcp;
 
         struct {
@@ -142,8 +353,18 @@ typedef struct RTP_session {
             /** RTCP remote socket address */
             struct sockaddr *rtcp_sa;
             ev_io rtcp_reader;
+            /** RTP packets waiting for @ref flush_rtp */
+            struct rtp_udp_batch *batch;
+            /** Batches submitted to the worker's io_uring, NULL if none
+                was submitted yet */
+            struct rtp_uring_flight *flight;
         } udp;
 
+        struct {
+            /** Whether the session is counted among the group's playing ones */
+            gboolean playing;
+        } multicast_client;
+
 #if ENABLE_SCTP
         struct {
             struct sctp_sndrcvinfo rtp;
@@ -194,14 +415,25 @@ gboolean rtp_interleaved_transport(struct RTSP_Client *rtsp,
 gboolean rtp_sctp_transport(struct RTSP_Client *rtsp,
                             struct RTP_session *rtp_s,
                             struct ParsedTransport *parsed);
+gboolean rtp_multicast_transport(struct RTSP_Client *rtsp,
+                                 struct RTP_session *rtp_s,
+                                 struct ParsedTransport *parsed);
+gboolean rtp_udp_multicast_transport(struct RTP_session *rtp_s,
+                                     const struct sockaddr *group,
+                                     unsigned int ttl);
 
 void rtsp_interleaved_register(struct RTSP_Client *rtsp,
                                struct RTP_session *rtp_s,
                                int rtp_channel, int rtcp_channel);
 
+RTP_session *rtp_session_alloc(struct RTSP_Client *rtsp, struct Track *tr);
 RTP_session *rtp_session_new(struct RTSP_Client *,
                              const char *, struct Track *,
                              GSList *transports);
+RTP_session *rtp_session_new_multicast(struct RTSP_Client *client,
+                                       struct Track *tr,
+                                       const struct sockaddr *group,
+                                       unsigned int ttl);
 
 void rtp_session_gslist_resume(GSList *, struct RTSP_Range *range);
 void rtp_session_gslist_pause(GSList *);
@@ -209,6 +441,14 @@ void rtp_session_gslist_free(GSList *);
 
 void rtp_session_handle_sending(RTP_session *session);
 
+uint32_t rtptime(RTP_session *session, int clock_rate,
+                 struct MParserBuffer *buffer);
+size_t rtp_packet_iovec(const uint8_t *header, struct MParserBuffer *buffer,
+                        struct iovec iov[RTP_PACKET_IOVECS]);
+gboolean rtp_packet_send_header(RTP_session *session, const uint8_t *header,
+                                struct MParserBuffer *buffer);
+
+
 /**
  * @}
  */
@@ -223,12 +463,43 @@ typedef enum {
     RR = 201,
     SDES = 202,
     BYE = 203,
-    APP = 204
+    APP = 204,
+    RTPFB = 205
 } rtcp_pkt_type;
 
 gboolean rtcp_send_sr(RTP_session *session, rtcp_pkt_type type);
 void rtcp_handle(RTP_session *session, uint8_t *packet, size_t len);
 
+#ifdef HAVE_LIBURING
+struct rtp_uring *rtp_uring_new(struct ev_loop *loop);
+void rtp_uring_free(struct rtp_uring *uring, struct ev_loop *loop);
+#endif
+
+void rtp_session_write(RTP_session *session);
+
+struct rtp_scheduler *rtp_scheduler_new(struct ev_loop *loop);
+void rtp_scheduler_free(struct rtp_scheduler *sched);
+void rtp_scheduler_add(struct rtp_scheduler *sched, RTP_session *session,
+                       ev_tstamp when);
+void rtp_scheduler_remove(struct rtp_scheduler *sched, RTP_session *session);
+
+gboolean rtp_fanout_join(RTP_session *session);
+void rtp_fanout_leave(RTP_session *session);
+void rtp_fanout_bye(struct rtp_fanout *fanout);
+
+void rtp_multicast_play(RTP_session *session);
+void rtp_multicast_pause(RTP_session *session);
+void rtp_multicast_report(RTP_session *sender, uint32_t reporter,
+                          uint8_t fraction_lost, uint32_t jitter);
+
+int rtp_rtx_payload_type(struct Track *track);
+void rtp_rtx_sdp_descr(struct Track *track, GString *descr);
+void rtp_rtx_nack(RTP_session *session, uint16_t pid, uint16_t blp);
+
+void rtp_abr_report(RTP_session *session);
+gboolean rtp_abr_switch(RTP_session *session, struct MParserBuffer *buffer);
+struct MParserBuffer *rtp_abr_resync(RTP_session *session);
+
 /**
  * @}
  */
@@ -0,0 +1,291 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Adaptive bitrate for resources opened from a renditions
+ *        manifest
+ *
+ * The RTCP receiver reports about the reference session of a client
+ * (its video one, if any) decide which rendition it should be served
+ * with; the switch itself happens once that session is about to send
+ * a keyframe, for all the sessions of the client at once, so that the
+ * new rendition is decodable right away.
+ *
+ * The sessions keep their SSRC, sequence numbers and timestamps
+ * across the switch, so that the client sees a single stream.
+ *
+ * Everything here runs in the worker's thread serving the client;
+ * the new rendition is opened and seeked in the background (see @ref
+ * r_prepare_rendition), and the current one is sent until it's ready.
+ */
+
+#include <config.h>
+
+#include <stdbool.h>
+
+#include "feng.h"
+#include "rtp.h"
+#include "rtsp.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+/**
+ * @brief Factor applied to the abr-reports option for the clear
+ *        reports needed to switch up
+ *
+ * Switching up is only tried after the path has been clear for much
+ * longer than it takes to switch down, to avoid oscillating.
+ */
+#define RTP_ABR_CLEAR_FACTOR 4
+
+/**
+ * @brief Seconds of tolerance on the delivery time of the first
+ *        buffer of the new rendition
+ */
+#define RTP_ABR_SLACK 0.001
+
+/**
+ * @brief Get the session whose reports and keyframes drive the
+ *        switches of a client
+ *
+ * @return The first video session, or the first session if there
+ *         is no video.
+ */
+static RTP_session *rtp_abr_reference(RTSP_session *rtsp_s)
+{
+    GSList *it;
+
+    for ( it = rtsp_s->rtp_sessions; it != NULL; it = it->next ) {
+        RTP_session *session = it->data;
+
+        if ( session->track->media_type == MP_video )
+            return session;
+    }
+
+    return rtsp_s->rtp_sessions ? rtsp_s->rtp_sessions->data : NULL;
+}
+
+/**
+ * @brief Update the rendition to serve after a receiver report
+ *
+ * @param session The session the report was about, its @ref
+ *                RTP_session::receiver statistics updated already
+ *
+ * A report is congested when the loss is above the abr-loss option,
+ * or when the jitter is above abr-jitter and still growing; it's
+ * clear with no loss and less than half that jitter. After
+ * abr-reports consecutive congested reports the next lower rendition
+ * is selected, and after @ref RTP_ABR_CLEAR_FACTOR times as many clear
+ * ones, the next higher one.
+ */
+void rtp_abr_report(RTP_session *session)
+{
+    RTSP_session *rtsp_s = session->client->session;
+    const struct cfg_vhost_t *vhost = session->client->vhost;
+    const RTP_ReceiverStats *stats = &session->receiver;
+    Resource *resource;
+    double loss, jitter;
+
+    if ( rtsp_s == NULL || session->multicast != NULL ||
+         (resource = rtsp_s->resource) == NULL ||
+         resource->renditions == NULL ||
+         session != rtp_abr_reference(rtsp_s) )
+        return;
+
+    loss = stats->fraction_lost * 100.0 / 256;
+    jitter = stats->jitter * 1000.0 / session->track->clock_rate;
+
+    if ( loss >= vhost->abr_loss ||
+         (jitter >= vhost->abr_jitter && jitter > rtsp_s->abr.jitter) ) {
+        rtsp_s->abr.congested++;
+        rtsp_s->abr.clear = 0;
+    } else if ( stats->fraction_lost == 0 &&
+                jitter < vhost->abr_jitter / 2.0 ) {
+        rtsp_s->abr.clear++;
+        rtsp_s->abr.congested = 0;
+    } else
+        rtsp_s->abr.congested = rtsp_s->abr.clear = 0;
+
+    rtsp_s->abr.jitter = jitter;
+
+    /* A switch is pending already */
+    if ( rtsp_s->abr.target != resource->rendition )
+        return;
+
+    if ( rtsp_s->abr.congested >= vhost->abr_reports &&
+         resource->rendition + 1 < resource->renditions->count )
+        rtsp_s->abr.target = resource->rendition + 1;
+    else if ( rtsp_s->abr.clear >= vhost->abr_reports * RTP_ABR_CLEAR_FACTOR &&
+              resource->rendition > 0 )
+        rtsp_s->abr.target = resource->rendition - 1;
+    else
+        return;
+
+    fnc_log(FNC_LOG_DEBUG,
+            "[abr] %s: loss %.1f%%, jitter %.1fms, switching to %u kbit/s "
+            "at the next keyframe",
+            rtsp_s->resource_uri, loss, jitter,
+            resource->renditions->entries[rtsp_s->abr.target].bitrate);
+}
+
+/**
+ * @brief Switch the client of a session to its target rendition
+ *
+ * @param session The session about to send @p buffer
+ * @param buffer The next buffer of the session
+ *
+ * @retval true All the sessions of the client have been moved to the
+ *              new rendition, starting at the delivery time of @p
+ *              buffer; @p buffer is no longer valid.
+ * @retval false No switch is pending, the new rendition is not ready
+ *               yet, @p buffer is not a switching point, or the
+ *               rendition couldn't be opened (in which case the
+ *               switch is given up).
+ *
+ * The first time it's called for a pending switch, it starts
+ * preparing the new rendition from the delivery time of @p buffer;
+ * the switch happens at the first switching point after that's done.
+ *
+ * Called by @ref rtp_session_write before sending each buffer.
+ */
+gboolean rtp_abr_switch(RTP_session *session, struct MParserBuffer *buffer)
+{
+    RTSP_session *rtsp_s = session->client->session;
+    const double switch_time = buffer->delivery;
+    Resource *current, *resource = NULL;
+    GSList *it;
+
+    if ( rtsp_s == NULL || (current = rtsp_s->resource) == NULL ||
+         current->renditions == NULL ||
+         rtsp_s->abr.target == current->rendition )
+        return false;
+
+    if ( session != rtp_abr_reference(rtsp_s) )
+        return false;
+
+    if ( rtsp_s->abr.pending == NULL ) {
+        rtsp_s->abr.pending = r_prepare_rendition(current, rtsp_s->abr.target,
+                                                  switch_time);
+        rtsp_s->abr.pending_time = switch_time;
+        return false;
+    }
+
+    if ( session->track->media_type == MP_video && !buffer->keyframe )
+        return false;
+
+    switch ( r_rendition_ready(rtsp_s->abr.pending, &resource) ) {
+    case RESOURCE_BUSY:
+        return false;
+    case RESOURCE_OK:
+        rtsp_s->abr.pending = NULL;
+        break;
+    default:
+        rtsp_s->abr.pending = NULL;
+        goto error;
+    }
+
+    /* The client went back in time while the rendition was prepared,
+       prepare it again from there */
+    if ( switch_time + RTP_ABR_SLACK < rtsp_s->abr.pending_time ) {
+        r_close(resource);
+        rtsp_s->abr.pending = r_prepare_rendition(current, rtsp_s->abr.target,
+                                                  switch_time);
+        rtsp_s->abr.pending_time = switch_time;
+        return false;
+    }
+
+    /* Make sure all the tracks are there before switching any */
+    for ( it = rtsp_s->rtp_sessions; it != NULL; it = it->next ) {
+        RTP_session *rtp_s = it->data;
+
+        if ( r_find_track(resource, rtp_s->track->name) == NULL )
+            goto error_close;
+    }
+
+    fnc_log(FNC_LOG_INFO, "[abr] %s: switched to %u kbit/s at %f",
+            rtsp_s->resource_uri,
+            current->renditions->entries[rtsp_s->abr.target].bitrate,
+            switch_time);
+
+    /* Stop the fill thread first, as it reads the consumers' state */
+    r_pause(current);
+
+    for ( it = rtsp_s->rtp_sessions; it != NULL; it = it->next ) {
+        RTP_session *rtp_s = it->data;
+
+        bq_consumer_free(rtp_s);
+        rtp_s->track = r_find_track(resource, rtp_s->track->name);
+        bq_consumer_new(rtp_s);
+
+        rtp_s->abr.resync = true;
+        rtp_s->abr.switch_time = switch_time;
+    }
+
+    rtsp_s->resource = resource;
+    r_close(current);
+
+    rtsp_s->abr.congested = rtsp_s->abr.clear = 0;
+
+    r_resume(resource);
+    for ( it = rtsp_s->rtp_sessions; it != NULL; it = it->next )
+        r_fill(resource, it->data);
+
+    return true;
+
+ error_close:
+    r_close(resource);
+ error:
+    fnc_log(FNC_LOG_WARN, "[abr] %s: unable to switch to rendition %u",
+            rtsp_s->resource_uri, rtsp_s->abr.target);
+    rtsp_s->abr.target = current->rendition;
+    return false;
+}
+
+/**
+ * @brief Get the first buffer of a session after a rendition switch
+ *
+ * @param session The session to get the buffer for
+ *
+ * @return The first buffer of the new rendition not delivered before
+ *         the switch, or NULL if it's not queued yet.
+ *
+ * The other sessions of the client were not at a keyframe when the
+ * switch happened, so their buffers up to that time are skipped.
+ * Once the buffer is found, the sequence numbers of the session are
+ * shifted to continue from the last packet it sent.
+ */
+struct MParserBuffer *rtp_abr_resync(RTP_session *session)
+{
+    struct MParserBuffer *buffer;
+
+    while ( (buffer = bq_consumer_get(session)) != NULL &&
+            buffer->delivery + RTP_ABR_SLACK < session->abr.switch_time )
+        bq_consumer_move(session);
+
+    if ( buffer != NULL ) {
+        session->abr.seq_offset = session->next_seq - buffer->seq_no;
+        session->abr.resync = false;
+    }
+
+    return buffer;
+}
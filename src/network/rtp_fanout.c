@@ -0,0 +1,285 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Fan-out of live tracks to the sessions of a worker
+ *
+ * All the sessions playing a live track receive the same packets, at
+ * the same time; only their SSRC and timestamp base differ. When the
+ * live-fanout option is enabled, each worker reads every live track
+ * played by its clients once, through a leader session that is paced
+ * as usual: its transport builds each packet once, and hands it to
+ * each of the worker's sessions with their own header patched in.
+ *
+ * Everything here runs in the worker's thread, so there is no
+ * locking.
+ */
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "feng.h"
+#include "rtp.h"
+#include "rtsp.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+struct rtp_fanout {
+    Track *track;
+
+    /**
+     * @brief Client the leader runs for
+     *
+     * Not connected to anything, it only carries the worker, loop
+     * and vhost for the leader.
+     */
+    RTSP_Client client;
+    /** Session reading the track for all the others */
+    RTP_session *leader;
+    RTSP_Range range;
+
+    /** Sessions receiving the packets of the leader */
+    GQueue sessions;
+};
+
+/**
+ * @brief Offset of the RTP timestamps of a session from its stream
+ *        time
+ */
+static uint32_t rtp_fanout_offset(const RTP_session *session)
+{
+    return session->start_rtptime -
+        (uint32_t)(session->range->begin_time * session->track->clock_rate);
+}
+
+/**
+ * @brief Send a packet built by the leader to all the sessions
+ *
+ * Used as the send_rtp callback of the leader.
+ */
+static gboolean rtp_fanout_send_rtp(RTP_session *leader,
+                                    const uint8_t *header,
+                                    struct MParserBuffer *buffer)
+{
+    struct rtp_fanout *fanout = leader->fanout.fanout;
+    uint32_t timestamp;
+    GList *it;
+
+    memcpy(&timestamp, header + 4, sizeof(timestamp));
+    timestamp = ntohl(timestamp);
+
+    for ( it = fanout->sessions.head; it != NULL; it = it->next ) {
+        RTP_session *session = it->data;
+        uint8_t patched[RTP_HEADER_SIZE];
+        const uint32_t session_timestamp =
+            htonl(timestamp + session->fanout.delta);
+
+        /* marker and sequence number are the same for everybody */
+        memcpy(patched, session->header, RTP_HEADER_SIZE);
+        patched[1] |= header[1] & 0x80;
+        memcpy(patched + 2, header + 2, sizeof(uint16_t));
+        memcpy(patched + 4, &session_timestamp, sizeof(session_timestamp));
+
+        if ( rtp_packet_send_header(session, patched, buffer) &&
+             session->pkt_count % 29 == 1 )
+            rtcp_send_sr(session, SDES);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Flush the packets queued by all the sessions
+ *
+ * Used as the flush_rtp callback of the leader.
+ */
+static void rtp_fanout_flush_rtp(RTP_session *leader)
+{
+    GList *it;
+
+    for ( it = leader->fanout.fanout->sessions.head; it != NULL; it = it->next ) {
+        RTP_session *session = it->data;
+
+        if ( session->flush_rtp )
+            session->flush_rtp(session);
+
+        stats_publish_rtp(session);
+    }
+}
+
+/**
+ * @brief Discard the reports of the leader
+ *
+ * The sessions send their own reports, see @ref rtp_fanout_send_rtp.
+ */
+static gboolean rtp_fanout_send_rtcp(ATTR_UNUSED RTP_session *leader,
+                                     GByteArray *buffer)
+{
+    g_byte_array_free(buffer, true);
+    return true;
+}
+
+static void rtp_fanout_close_transport(ATTR_UNUSED RTP_session *leader)
+{
+}
+
+/**
+ * @brief Create the fan-out of a live track for a worker
+ *
+ * @param session The first session joining it
+ *
+ * The leader starts reading the track right away, with the pacing
+ * settings of the session's vhost.
+ */
+static struct rtp_fanout *rtp_fanout_new(RTP_session *session)
+{
+    struct rtp_fanout *fanout = g_slice_new0(struct rtp_fanout);
+    RTSP_Client *rtsp = session->client;
+    RTP_session *leader;
+
+    fanout->track = session->track;
+
+    fanout->client.sd = -1;
+    fanout->client.worker = rtsp->worker;
+    fanout->client.loop = rtsp->loop;
+    fanout->client.vhost = rtsp->vhost;
+    fanout->client.local_host = g_strdup(rtsp->local_host);
+
+    g_queue_init(&fanout->sessions);
+
+    fanout->range.begin_time = 0;
+    fanout->range.end_time = -0.1;
+    fanout->range.playback_time = ev_now(rtsp->loop);
+
+    leader = fanout->leader = rtp_session_alloc(&fanout->client,
+                                                session->track);
+    leader->range = &fanout->range;
+    leader->fanout.fanout = fanout;
+
+    leader->send_rtp = rtp_fanout_send_rtp;
+    leader->send_rtcp = rtp_fanout_send_rtcp;
+    leader->flush_rtp = rtp_fanout_flush_rtp;
+    leader->close_transport = rtp_fanout_close_transport;
+
+    /* The leader might start from a cached keyframe */
+    leader->catch_up = session->track->gop_cache;
+
+    g_hash_table_insert(rtsp->worker->fanouts, fanout->track, fanout);
+
+    bq_consumer_new(leader);
+    rtp_scheduler_add(rtsp->worker->scheduler, leader, ev_now(rtsp->loop));
+
+    fnc_log(FNC_LOG_DEBUG, "[fanout] reading %s for worker %p",
+            fanout->track->name, rtsp->worker);
+
+    return fanout;
+}
+
+/**
+ * @brief Free the fan-out of a track once no session is left
+ */
+static void rtp_fanout_free(struct rtp_fanout *fanout)
+{
+    GSList *leader = g_slist_prepend(NULL, fanout->leader);
+
+    g_hash_table_remove(fanout->client.worker->fanouts, fanout->track);
+
+    rtp_session_gslist_free(leader);
+    g_slist_free(leader);
+
+    g_free(fanout->client.local_host);
+    g_slice_free(struct rtp_fanout, fanout);
+}
+
+/**
+ * @brief Have a session sent by its worker's fan-out of its track
+ *
+ * @param session The session to start, its range has to be set
+ *
+ * @retval true The session joined the fan-out (creating it if
+ *              needed); it must not be scheduled or registered with
+ *              its track.
+ * @retval false The live-fanout option is disabled, or the track is
+ *               not live; the session should read it itself.
+ *
+ * The session joins at the position the fan-out is at, as it would
+ * on its own anyway for a live track; its header is prepared so that
+ * its timestamps follow its own timestamp base.
+ */
+gboolean rtp_fanout_join(RTP_session *session)
+{
+    RTSP_Worker *worker = session->client->worker;
+    struct rtp_fanout *fanout;
+
+    if ( !feng_srv.live_fanout ||
+         session->track->parent->source != LIVE_SOURCE )
+        return false;
+
+    if ( session->fanout.fanout != NULL )
+        return true;
+
+    if ( (fanout = g_hash_table_lookup(worker->fanouts, session->track)) == NULL )
+        fanout = rtp_fanout_new(session);
+
+    session->fanout.fanout = fanout;
+    session->fanout.delta = rtp_fanout_offset(session) -
+        rtp_fanout_offset(fanout->leader);
+
+    session->fanout.link.data = session;
+    g_queue_push_tail_link(&fanout->sessions, &session->fanout.link);
+
+    return true;
+}
+
+/**
+ * @brief Remove a session from its fan-out
+ *
+ * The fan-out is freed once its last session leaves. It's safe to
+ * call this function for sessions that did not join any fan-out.
+ */
+void rtp_fanout_leave(RTP_session *session)
+{
+    struct rtp_fanout *fanout = session->fanout.fanout;
+
+    if ( fanout == NULL || session == fanout->leader )
+        return;
+
+    g_queue_unlink(&fanout->sessions, &session->fanout.link);
+    session->fanout.fanout = NULL;
+
+    if ( g_queue_is_empty(&fanout->sessions) )
+        rtp_fanout_free(fanout);
+}
+
+/**
+ * @brief Tell all the sessions of a fan-out that the stream is over
+ */
+void rtp_fanout_bye(struct rtp_fanout *fanout)
+{
+    GList *it;
+
+    for ( it = fanout->sessions.head; it != NULL; it = it->next )
+        rtcp_send_sr(it->data, BYE);
+}
@@ -0,0 +1,531 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Multicast delivery of live tracks
+ *
+ * Clients requesting multicast delivery of a track of a live resource
+ * are all handed out the same group, taken from the vhost's pool the
+ * first time the track is requested; a single RTP session, not tied
+ * to any connection, reads the track and sends it to the group as
+ * long as any of those clients is playing.
+ *
+ * The sender runs on the worker of the client that caused the group
+ * to be created; the clients served by other workers only change its
+ * counters, and wake it up to act on them.
+ */
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "feng.h"
+#include "rtp.h"
+#include "rtsp.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+/**
+ * @brief Seconds after which a receiver that didn't report is
+ *        forgotten
+ */
+#define RTP_MULTICAST_RECEIVER_TIMEOUT 30
+
+/**
+ * @brief Minimum seconds between two summaries of the receiver
+ *        reports of a group
+ */
+#define RTP_MULTICAST_SUMMARY_INTERVAL 5
+
+/**
+ * @brief Last report received from a member of a group
+ */
+typedef struct {
+    uint8_t fraction_lost;
+    /** Interarrival jitter, in RTP timestamp units */
+    uint32_t jitter;
+    ev_tstamp last_report;
+} rtp_multicast_receiver;
+
+struct rtp_multicast_group {
+    Track *track;
+    /** Vhost whose pool the address was taken from */
+    struct cfg_vhost_t *vhost;
+    /** Position of the address in the pool */
+    unsigned int index;
+    /** Address and RTP port of the group */
+    struct sockaddr_in addr;
+
+    /**
+     * @brief Number of client sessions set up on the group
+     *
+     * Once it drops to zero the group is released: it's not handed
+     * out anymore, and gets freed by its worker.
+     */
+    unsigned int refs;
+    /** Number of client sessions playing */
+    unsigned int playing;
+
+    /**
+     * @brief Client the sender runs for
+     *
+     * Not connected to anything, it only carries the worker, loop
+     * and vhost for the sender.
+     */
+    RTSP_Client client;
+    RTP_session *sender;
+    RTSP_Range range;
+    /** Whether the sender is scheduled; only accessed by its worker */
+    gboolean sending;
+
+    /** Signal for the worker to act on @ref refs and @ref playing */
+    ev_async ev_update;
+
+    /**
+     * @brief Receivers that reported on the group, by SSRC
+     *
+     * Only accessed by the worker of the sender, reading the RTCP
+     * socket.
+     */
+    GHashTable *receivers;
+    ev_tstamp last_summary;
+};
+
+/**
+ * @brief Mutex regulating access to the multicast groups
+ *
+ * This mutex should be held when looking up, adding to or removing
+ * from @ref multicast_groups, and when changing the counters of a
+ * group.
+ */
+static GStaticMutex multicast_lock = G_STATIC_MUTEX_INIT;
+
+/**
+ * @brief Multicast groups in use, including the released ones not
+ *        freed yet
+ *
+ * @note To access this list, you need to hold @ref multicast_lock.
+ */
+static GSList *multicast_groups;
+
+/**
+ * @brief Find the group a track is delivered to
+ *
+ * @note Needs @ref multicast_lock to be held.
+ */
+static struct rtp_multicast_group *rtp_multicast_find(const Track *track)
+{
+    GSList *it;
+
+    for ( it = multicast_groups; it != NULL; it = it->next ) {
+        struct rtp_multicast_group *group = it->data;
+
+        if ( group->track == track && group->refs > 0 )
+            return group;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Find the first free address of a vhost's pool
+ *
+ * @param vhost The vhost to search the pool of
+ * @param index Where to save the position of the address in the pool
+ *
+ * @retval false All the addresses of the pool are in use.
+ *
+ * Addresses of released groups are still in use until their sender is
+ * stopped.
+ *
+ * @note Needs @ref multicast_lock to be held.
+ */
+static gboolean rtp_multicast_index(const struct cfg_vhost_t *vhost,
+                                    unsigned int *index)
+{
+    unsigned int i;
+
+    for ( i = 0; i < vhost->multicast_groups; i++ ) {
+        GSList *it;
+
+        for ( it = multicast_groups; it != NULL; it = it->next ) {
+            const struct rtp_multicast_group *group = it->data;
+
+            if ( group->vhost == vhost && group->index == i )
+                break;
+        }
+
+        if ( it == NULL ) {
+            *index = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Start sending a group's track
+ */
+static void rtp_multicast_start(struct rtp_multicast_group *group)
+{
+    RTP_session *sender = group->sender;
+    struct ev_loop *loop = group->client.loop;
+
+    group->range.begin_time = 0;
+    group->range.end_time = -0.1;
+    group->range.playback_time = ev_now(loop);
+
+    sender->range = &group->range;
+    sender->send_time = 0.0;
+
+    if ( !rtp_fanout_join(sender) ) {
+        bq_consumer_new(sender);
+        rtp_scheduler_add(group->client.worker->scheduler, sender,
+                          ev_now(loop));
+    }
+
+    group->sending = true;
+}
+
+/**
+ * @brief Stop sending a group's track
+ */
+static void rtp_multicast_stop(struct rtp_multicast_group *group)
+{
+    rtp_fanout_leave(group->sender);
+    rtp_scheduler_remove(group->client.worker->scheduler, group->sender);
+    bq_consumer_free(group->sender);
+
+    group->sending = false;
+}
+
+static void rtp_multicast_receiver_free(gpointer receiver)
+{
+    g_slice_free(rtp_multicast_receiver, receiver);
+}
+
+/**
+ * @brief Free a released group
+ *
+ * @note Has to be called by the worker of the group's sender.
+ */
+static void rtp_multicast_group_free(struct rtp_multicast_group *group)
+{
+    GSList *sender = g_slist_prepend(NULL, group->sender);
+
+    ev_async_stop(group->client.loop, &group->ev_update);
+
+    if ( group->sending )
+        rtp_multicast_stop(group);
+
+    rtp_session_gslist_free(sender);
+    g_slist_free(sender);
+
+    g_hash_table_destroy(group->receivers);
+    g_free(group->client.local_host);
+    g_slice_free(struct rtp_multicast_group, group);
+}
+
+/**
+ * @brief Act on the counters of a group in its sender's worker
+ */
+static void rtp_multicast_update_cb(ATTR_UNUSED struct ev_loop *loop,
+                                    ev_async *w,
+                                    ATTR_UNUSED int revents)
+{
+    struct rtp_multicast_group *group = w->data;
+    gboolean released, playing;
+
+    g_static_mutex_lock(&multicast_lock);
+
+    if ( (released = (group->refs == 0)) )
+        multicast_groups = g_slist_remove(multicast_groups, group);
+    playing = group->playing > 0;
+
+    g_static_mutex_unlock(&multicast_lock);
+
+    if ( released )
+        rtp_multicast_group_free(group);
+    else if ( playing && !group->sending )
+        rtp_multicast_start(group);
+    else if ( !playing && group->sending )
+        rtp_multicast_stop(group);
+}
+
+/**
+ * @brief Create the group delivering a track
+ *
+ * @param rtsp The client requesting the track; the sender will run on
+ *             its worker
+ * @param track The track to deliver
+ *
+ * @return The new group, or NULL if the pool is exhausted or the
+ *         sender couldn't be created.
+ *
+ * @note Needs @ref multicast_lock to be held.
+ */
+static struct rtp_multicast_group *rtp_multicast_group_new(RTSP_Client *rtsp,
+                                                           Track *track)
+{
+    struct cfg_vhost_t *vhost = rtsp->vhost;
+    struct rtp_multicast_group *group;
+    unsigned int index;
+    struct in_addr base;
+
+    if ( !rtp_multicast_index(vhost, &index) ) {
+        fnc_log(FNC_LOG_WARN, "[multicast] no group left for %s",
+                track->name);
+        return NULL;
+    }
+
+    group = g_slice_new0(struct rtp_multicast_group);
+    group->track = track;
+    group->vhost = vhost;
+    group->index = index;
+
+    /* validated when parsing the configuration */
+    inet_pton(AF_INET, vhost->multicast_group, &base);
+    group->addr.sin_family = AF_INET;
+    group->addr.sin_addr.s_addr = htonl(ntohl(base.s_addr) + index);
+    group->addr.sin_port = htons(vhost->multicast_port);
+
+    group->client.sd = -1;
+    group->client.worker = rtsp->worker;
+    group->client.loop = rtsp->loop;
+    group->client.vhost = vhost;
+    group->client.local_host = g_strdup(rtsp->local_host);
+    group->client.sa_len = sizeof(struct sockaddr_in);
+
+    if ( (group->sender = rtp_session_new_multicast(&group->client, track,
+                                                    (struct sockaddr *)&group->addr,
+                                                    vhost->multicast_ttl)) == NULL ) {
+        g_free(group->client.local_host);
+        g_slice_free(struct rtp_multicast_group, group);
+        return NULL;
+    }
+
+    group->sender->multicast = group;
+
+    group->receivers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                             NULL, rtp_multicast_receiver_free);
+
+    group->ev_update.data = group;
+    ev_async_init(&group->ev_update, rtp_multicast_update_cb);
+    ev_async_start(group->client.loop, &group->ev_update);
+
+    multicast_groups = g_slist_prepend(multicast_groups, group);
+
+    return group;
+}
+
+/**
+ * @brief Release the client session of a group
+ *
+ * Used as the close_transport callback of the client sessions.
+ */
+static void rtp_multicast_close_transport(RTP_session *rtp)
+{
+    struct rtp_multicast_group *group = rtp->multicast;
+    gboolean update;
+
+    g_static_mutex_lock(&multicast_lock);
+
+    update = --group->refs == 0;
+    if ( rtp->multicast_client.playing && --group->playing == 0 )
+        update = true;
+
+    /* the worker cannot free the group before the lock is released */
+    if ( update )
+        ev_async_send(group->client.loop, &group->ev_update);
+
+    g_static_mutex_unlock(&multicast_lock);
+}
+
+/**
+ * @brief Setup the delivery of an RTP session through multicast
+ *
+ * @param rtsp The client requesting the delivery
+ * @param rtp_s The session to set up; its track has to be set already
+ * @param parsed The transport requested by the client
+ *
+ * @retval false Multicast is not configured for the vhost, the track
+ *               is not live, or no group is available for it.
+ *
+ * The group, port and time-to-live are chosen by the server, the ones
+ * requested by the client (if any) are ignored.
+ */
+gboolean rtp_multicast_transport(RTSP_Client *rtsp,
+                                 RTP_session *rtp_s,
+                                 ATTR_UNUSED struct ParsedTransport *parsed)
+{
+    Track *track = rtp_s->track;
+    struct rtp_multicast_group *group;
+    char address[INET_ADDRSTRLEN];
+
+    /* Stored resources are played, and seeked, by each client on its
+     * own */
+    if ( rtsp->vhost->multicast_group == NULL ||
+         track->parent->source != LIVE_SOURCE )
+        return false;
+
+    g_static_mutex_lock(&multicast_lock);
+
+    if ( (group = rtp_multicast_find(track)) == NULL &&
+         (group = rtp_multicast_group_new(rtsp, track)) == NULL ) {
+        g_static_mutex_unlock(&multicast_lock);
+        return false;
+    }
+
+    group->refs++;
+
+    g_static_mutex_unlock(&multicast_lock);
+
+    rtp_s->multicast = group;
+    rtp_s->multicast_client.playing = false;
+    rtp_s->ssrc = group->sender->ssrc;
+    rtp_s->close_transport = rtp_multicast_close_transport;
+
+    inet_ntop(AF_INET, &group->addr.sin_addr, address, sizeof(address));
+
+    rtp_s->transport_string = g_strdup_printf("RTP/AVP;multicast;destination=%s;port=%u-%u;ttl=%u;ssrc=%08X",
+                                              address,
+                                              group->vhost->multicast_port,
+                                              group->vhost->multicast_port + 1,
+                                              group->vhost->multicast_ttl,
+                                              rtp_s->ssrc);
+
+    return true;
+}
+
+/**
+ * @brief Count a client session among the playing ones of its group
+ *
+ * The sender is started when the first one plays.
+ */
+void rtp_multicast_play(RTP_session *session)
+{
+    struct rtp_multicast_group *group = session->multicast;
+
+    if ( session->multicast_client.playing )
+        return;
+
+    session->multicast_client.playing = true;
+
+    g_static_mutex_lock(&multicast_lock);
+
+    if ( group->playing++ == 0 )
+        ev_async_send(group->client.loop, &group->ev_update);
+
+    g_static_mutex_unlock(&multicast_lock);
+}
+
+/**
+ * @brief Stop counting a client session among the playing ones of its
+ *        group
+ *
+ * The sender is stopped when no session is playing anymore.
+ */
+void rtp_multicast_pause(RTP_session *session)
+{
+    struct rtp_multicast_group *group = session->multicast;
+
+    if ( !session->multicast_client.playing )
+        return;
+
+    session->multicast_client.playing = false;
+
+    g_static_mutex_lock(&multicast_lock);
+
+    if ( --group->playing == 0 )
+        ev_async_send(group->client.loop, &group->ev_update);
+
+    g_static_mutex_unlock(&multicast_lock);
+}
+
+/**
+ * @brief Account for a receiver report about a group's sender
+ *
+ * @param sender The session sending to the group
+ * @param reporter SSRC of the receiver sending the report
+ * @param fraction_lost Fraction of packets lost, in 1/256 units
+ * @param jitter Interarrival jitter, in RTP timestamp units
+ *
+ * The reports of all the receivers are kept, so that the state of the
+ * whole group is summarised periodically: how many receivers are
+ * there, and how bad the worst of them is doing.
+ */
+void rtp_multicast_report(RTP_session *sender, uint32_t reporter,
+                          uint8_t fraction_lost, uint32_t jitter)
+{
+    struct rtp_multicast_group *group = sender->multicast;
+    const ev_tstamp now = ev_now(group->client.loop);
+    rtp_multicast_receiver *receiver;
+    GHashTableIter it;
+    gpointer value;
+    unsigned int count = 0;
+    uint8_t worst_lost = 0;
+    uint32_t worst_jitter = 0;
+    char address[INET_ADDRSTRLEN];
+
+    if ( (receiver = g_hash_table_lookup(group->receivers,
+                                         GUINT_TO_POINTER(reporter))) == NULL ) {
+        receiver = g_slice_new0(rtp_multicast_receiver);
+        g_hash_table_insert(group->receivers,
+                            GUINT_TO_POINTER(reporter), receiver);
+    }
+
+    receiver->fraction_lost = fraction_lost;
+    receiver->jitter = jitter;
+    receiver->last_report = now;
+
+    if ( now - group->last_summary < RTP_MULTICAST_SUMMARY_INTERVAL )
+        return;
+
+    group->last_summary = now;
+
+    g_hash_table_iter_init(&it, group->receivers);
+    while ( g_hash_table_iter_next(&it, NULL, &value) ) {
+        receiver = value;
+
+        if ( now - receiver->last_report > RTP_MULTICAST_RECEIVER_TIMEOUT ) {
+            g_hash_table_iter_remove(&it);
+            continue;
+        }
+
+        count++;
+        worst_lost = MAX(worst_lost, receiver->fraction_lost);
+        worst_jitter = MAX(worst_jitter, receiver->jitter);
+    }
+
+    inet_ntop(AF_INET, &group->addr.sin_addr, address, sizeof(address));
+
+    fnc_log(FNC_LOG_INFO,
+            "[multicast] %s: %u receivers, worst loss %.1f%%, worst jitter %.1fms",
+            address, count,
+            worst_lost * 100.0 / 256,
+            worst_jitter * 1000.0 / sender->track->clock_rate);
+}
@@ -0,0 +1,186 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Retransmission of lost RTP packets
+ *
+ * When the rtx-history option is set, each track keeps references to
+ * its last queued buffers (see @ref track_history_get), and each
+ * session gets a retransmission stream as described by RFC 4588,
+ * SSRC-multiplexed with the original one. The packets reported lost
+ * by the client with a generic NACK (RFC 4585 Section 6.2.1) are sent
+ * again in that stream, straight out of the history: the original
+ * sequence number is put before the payload, which is not copied.
+ */
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "feng.h"
+#include "rtp.h"
+#include "rtsp.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+/**
+ * @brief Payload type of the retransmission stream of a track
+ *
+ * @param track The track to get the payload type for
+ *
+ * @return The dynamic payload type, or -1 if retransmissions are
+ *         disabled, or there's no dynamic payload type left.
+ *
+ * The retransmission streams of a resource take the dynamic payload
+ * types following the highest one used by its tracks, in the order of
+ * the tracks, so that both the description and the sessions get the
+ * same ones without storing them.
+ */
+int rtp_rtx_payload_type(Track *track)
+{
+    Resource *resource = track->parent;
+    int payload_type = 95;
+    GList *it;
+
+    if ( feng_srv.rtx_history == 0 || resource == NULL )
+        return -1;
+
+    for ( it = resource->tracks; it != NULL; it = it->next )
+        payload_type = MAX(payload_type, ((Track *)it->data)->payload_type);
+
+    payload_type += 1 + g_list_index(resource->tracks, track);
+
+    return payload_type <= 127 ? payload_type : -1;
+}
+
+/**
+ * @brief Append the retransmission attributes of a track to its SDP
+ *        description
+ *
+ * @param track The track to describe
+ * @param descr The description to append to, after the media line
+ *
+ * The payload type itself has to be listed in the media line as well.
+ */
+void rtp_rtx_sdp_descr(Track *track, GString *descr)
+{
+    const int payload_type = rtp_rtx_payload_type(track);
+
+    if ( payload_type < 0 )
+        return;
+
+    g_string_append_printf(descr,
+                           "a=rtpmap:%d rtx/%u"SDP_EL
+                           "a=fmtp:%d apt=%d"SDP_EL
+                           "a=rtcp-fb:%d nack"SDP_EL,
+                           payload_type, track->clock_rate,
+                           payload_type, track->payload_type,
+                           track->payload_type);
+}
+
+/**
+ * @brief Retransmit a single packet
+ *
+ * @param session The session that sent the packet
+ * @param seq Sequence number of the packet, as sent
+ *
+ * The timestamp is computed again for the session, so for the
+ * sessions of a fan-out it might differ by one from the original.
+ */
+static void rtp_rtx_send(RTP_session *session, uint16_t seq)
+{
+    const uint16_t osn = htons(seq);
+    struct MParserBuffer *buffer, *rtx;
+    uint8_t header[RTP_HEADER_SIZE];
+    uint16_t rtx_seq;
+    uint32_t timestamp, ssrc;
+
+    /* Sequence numbers wrap around, only the ones sent can be lost */
+    if ( (int16_t)(session->next_seq - seq) <= 0 )
+        return;
+
+    /* The track doesn't know about the shift of rendition switches */
+    if ( (buffer = track_history_get(session->track,
+                                     seq - session->abr.seq_offset)) == NULL ) {
+        fnc_log(FNC_LOG_DEBUG, "[rtx] ssrc %u: packet %u not in history",
+                session->ssrc, seq);
+        return;
+    }
+
+    if ( (rtx = mparser_buffer_new_prefixed(buffer, (const uint8_t *)&osn,
+                                            sizeof(osn))) == NULL ) {
+        fnc_log(FNC_LOG_DEBUG, "[rtx] ssrc %u: payload header too long",
+                session->ssrc);
+        goto end;
+    }
+
+    rtx_seq = htons(session->rtx.seq++);
+    timestamp = htonl(rtptime(session, session->track->clock_rate, buffer));
+    ssrc = htonl(session->rtx.ssrc);
+
+    header[0] = 2 << 6;
+    header[1] = (buffer->marker ? 0x80 : 0) | session->rtx.payload_type;
+    memcpy(header + 2, &rtx_seq, sizeof(rtx_seq));
+    memcpy(header + 4, &timestamp, sizeof(timestamp));
+    memcpy(header + 8, &ssrc, sizeof(ssrc));
+
+    if ( session->send_rtp(session, header, rtx) )
+        session->rtx.packets++;
+
+    mparser_buffer_unref(rtx);
+
+ end:
+    mparser_buffer_unref(buffer);
+}
+
+/**
+ * @brief Retransmit the packets reported lost by a generic NACK
+ *
+ * @param session The session the NACK is about
+ * @param pid Sequence number of the first lost packet
+ * @param blp Bitmask of the lost packets among the 16 following @p
+ *            pid
+ */
+void rtp_rtx_nack(RTP_session *session, uint16_t pid, uint16_t blp)
+{
+    unsigned int i;
+
+    /* The members of a multicast group can't be served one by one */
+    if ( session->rtx.payload_type < 0 || session->multicast != NULL ||
+         session->pkt_count == 0 )
+        return;
+
+    fnc_log(FNC_LOG_VERBOSE, "[rtx] ssrc %u: lost %u, mask %04x",
+            session->ssrc, pid, blp);
+
+    rtp_rtx_send(session, pid);
+
+    for ( i = 0; i < 16; i++ )
+        if ( blp & (1 << i) )
+            rtp_rtx_send(session, pid + i + 1);
+
+    if ( session->flush_rtp )
+        session->flush_rtp(session);
+}
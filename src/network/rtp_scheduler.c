@@ -0,0 +1,264 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Pacing scheduler of the RTP sessions of a worker
+ *
+ * Instead of having one libev timer per session, re-armed after each
+ * burst of packets, each worker keeps its playing sessions in a
+ * two-level timer wheel with millisecond slots, and a single timer
+ * ticking once per slot while there's any session to serve.
+ *
+ * The first level holds the sessions due within the next @ref
+ * RTP_WHEEL_SLOTS ticks, one slot per tick; the second level holds
+ * the later ones, one slot per revolution of the first level, and
+ * each of its slots is cascaded into the first level when the
+ * revolution it covers starts. Sessions due even later are parked in
+ * the farthest second-level slot, and moved again when it cascades.
+ */
+
+#include <config.h>
+
+#include <stdbool.h>
+
+#include "feng.h"
+#include "rtp.h"
+#include "rtsp.h"
+#include "fnc_log.h"
+
+/**
+ * @brief Number of ticks per second
+ */
+#define RTP_SCHEDULER_HZ 1000
+
+#define RTP_WHEEL_BITS 8
+/**
+ * @brief Number of slots of the first level of the wheel
+ */
+#define RTP_WHEEL_SLOTS (1 << RTP_WHEEL_BITS)
+#define RTP_WHEEL_MASK (RTP_WHEEL_SLOTS - 1)
+
+/**
+ * @brief Number of slots of the second level of the wheel
+ */
+#define RTP_WHEEL_OUTER_SLOTS 64
+#define RTP_WHEEL_OUTER_MASK (RTP_WHEEL_OUTER_SLOTS - 1)
+
+struct rtp_scheduler {
+    struct ev_loop *loop;
+    /** Timer firing once per tick while sessions are scheduled */
+    ev_timer tick;
+    /** Loop time of tick zero */
+    ev_tstamp base;
+    /** Last tick processed */
+    guint64 now;
+    /** Number of sessions scheduled */
+    unsigned int count;
+
+    GQueue slots[RTP_WHEEL_SLOTS];
+    GQueue outer[RTP_WHEEL_OUTER_SLOTS];
+};
+
+/**
+ * @brief Convert a loop time to the last tick not after it
+ */
+static guint64 rtp_scheduler_elapsed(const struct rtp_scheduler *sched,
+                                     ev_tstamp when)
+{
+    const ev_tstamp offset = (when - sched->base) * RTP_SCHEDULER_HZ;
+
+    return offset > 0 ? (guint64)offset : 0;
+}
+
+/**
+ * @brief Convert a loop time to the first tick not before it
+ *
+ * Sessions are due at this tick, so that they are never woken up
+ * early.
+ */
+static guint64 rtp_scheduler_due(const struct rtp_scheduler *sched,
+                                 ev_tstamp when)
+{
+    const ev_tstamp offset = (when - sched->base) * RTP_SCHEDULER_HZ;
+    const guint64 ticks = rtp_scheduler_elapsed(sched, when);
+
+    return ticks + ((ev_tstamp)ticks < offset);
+}
+
+/**
+ * @brief Put a session in the slot for its due tick
+ *
+ * Sessions already due are put in the slot of the next tick.
+ */
+static void rtp_scheduler_place(struct rtp_scheduler *sched,
+                                RTP_session *session)
+{
+    guint64 due = session->writer.due;
+    GQueue *slot;
+
+    if ( due <= sched->now )
+        due = sched->now + 1;
+
+    if ( due - sched->now < RTP_WHEEL_SLOTS )
+        slot = &sched->slots[due & RTP_WHEEL_MASK];
+    else if ( (due >> RTP_WHEEL_BITS) - (sched->now >> RTP_WHEEL_BITS) < RTP_WHEEL_OUTER_SLOTS )
+        slot = &sched->outer[(due >> RTP_WHEEL_BITS) & RTP_WHEEL_OUTER_MASK];
+    else
+        slot = &sched->outer[((sched->now >> RTP_WHEEL_BITS) + RTP_WHEEL_OUTER_SLOTS - 1) & RTP_WHEEL_OUTER_MASK];
+
+    session->writer.slot = slot;
+    g_queue_push_tail_link(slot, &session->writer.link);
+}
+
+/**
+ * @brief Run the sessions due in a single tick
+ */
+static void rtp_scheduler_run_tick(struct rtp_scheduler *sched, guint64 tick)
+{
+    GQueue *slot;
+    GList *link;
+
+    sched->now = tick;
+
+    /* a new revolution of the first level starts */
+    if ( (tick & RTP_WHEEL_MASK) == 0 ) {
+        slot = &sched->outer[(tick >> RTP_WHEEL_BITS) & RTP_WHEEL_OUTER_MASK];
+
+        while ( (link = g_queue_pop_head_link(slot)) != NULL )
+            rtp_scheduler_place(sched, link->data);
+    }
+
+    slot = &sched->slots[tick & RTP_WHEEL_MASK];
+
+    /* sessions rescheduled by the writer land in later slots */
+    while ( (link = g_queue_pop_head_link(slot)) != NULL ) {
+        RTP_session *session = link->data;
+
+        session->writer.slot = NULL;
+        sched->count--;
+
+        rtp_session_write(session);
+    }
+}
+
+static void rtp_scheduler_tick_cb(struct ev_loop *loop, ev_timer *w,
+                                  ATTR_UNUSED int revents)
+{
+    struct rtp_scheduler *sched = w->data;
+    const guint64 target = rtp_scheduler_elapsed(sched, ev_now(loop));
+
+    while ( sched->now < target && sched->count > 0 )
+        rtp_scheduler_run_tick(sched, sched->now + 1);
+
+    /* nothing is due until a session is scheduled again; the wheel
+       only has to be correct relative to the current tick */
+    if ( sched->count == 0 ) {
+        sched->now = target;
+        ev_timer_stop(loop, w);
+    }
+}
+
+/**
+ * @brief Create the pacing scheduler for a worker
+ *
+ * @param loop The worker's event loop
+ */
+struct rtp_scheduler *rtp_scheduler_new(struct ev_loop *loop)
+{
+    struct rtp_scheduler *sched = g_slice_new0(struct rtp_scheduler);
+    unsigned int i;
+
+    sched->loop = loop;
+    sched->base = ev_now(loop);
+
+    for (i = 0; i < RTP_WHEEL_SLOTS; i++)
+        g_queue_init(&sched->slots[i]);
+    for (i = 0; i < RTP_WHEEL_OUTER_SLOTS; i++)
+        g_queue_init(&sched->outer[i]);
+
+    sched->tick.data = sched;
+    ev_timer_init(&sched->tick, rtp_scheduler_tick_cb,
+                  0, 1.0/RTP_SCHEDULER_HZ);
+
+    return sched;
+}
+
+/**
+ * @brief Free the pacing scheduler of a worker
+ *
+ * @note All the sessions should have been removed already.
+ */
+void rtp_scheduler_free(struct rtp_scheduler *sched)
+{
+    ev_timer_stop(sched->loop, &sched->tick);
+    g_slice_free(struct rtp_scheduler, sched);
+}
+
+/**
+ * @brief Schedule a session to write its packets
+ *
+ * @param sched The scheduler of the worker serving the session
+ * @param session The session to schedule; if it's scheduled already,
+ *                it's moved.
+ * @param when Loop time the session is due at
+ *
+ * @ref rtp_session_write is called for the session once, in the
+ * first tick not before @p when.
+ */
+void rtp_scheduler_add(struct rtp_scheduler *sched, RTP_session *session,
+                       ev_tstamp when)
+{
+    rtp_scheduler_remove(sched, session);
+
+    /* catch up with the time spent idle */
+    if ( sched->count == 0 )
+        sched->now = MAX(sched->now,
+                         rtp_scheduler_elapsed(sched, ev_now(sched->loop)));
+
+    session->writer.link.data = session;
+    session->writer.next_time = when;
+    session->writer.due = rtp_scheduler_due(sched, when);
+
+    rtp_scheduler_place(sched, session);
+
+    if ( sched->count++ == 0 )
+        ev_timer_again(sched->loop, &sched->tick);
+}
+
+/**
+ * @brief Remove a session from the scheduler
+ *
+ * It's safe to call this function for sessions that are not
+ * scheduled.
+ */
+void rtp_scheduler_remove(struct rtp_scheduler *sched, RTP_session *session)
+{
+    if ( session->writer.slot == NULL )
+        return;
+
+    g_queue_unlink(session->writer.slot, &session->writer.link);
+    session->writer.slot = NULL;
+
+    if ( --sched->count == 0 )
+        ev_timer_stop(sched->loop, &sched->tick);
+}
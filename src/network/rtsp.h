@@ -24,7 +24,9 @@
 #define FN_RTSP_H
 
 #include <time.h>
+#include <stdint.h>
 #include <config.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 
 #include <glib.h>
@@ -33,8 +35,21 @@
 #include "rfc822proto.h"
 
 struct Resource;
+struct ResourcePending;
+struct feng_socket_listener;
 struct cfg_socket_t;
 struct cfg_vhost_t;
+struct rtp_uring;
+struct rtp_scheduler;
+struct MParserBuffer;
+struct RTP_session;
+
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+/**
+ * @brief Whether TCP connections can be written with MSG_ZEROCOPY
+ */
+# define RTSP_TCP_ZEROCOPY 1
+#endif
 
 /**
  * @addtogroup RTSP
@@ -61,6 +76,7 @@ typedef enum {
 } RTSP_Server_State;
 
 #define RTSP_EL "\r\n"
+#define SDP_EL "\r\n"
 
 typedef struct RTSP_session {
     char *session_id;
@@ -80,6 +96,27 @@ typedef struct RTSP_session {
      * feature.
      */
     GQueue *play_requests;
+
+    /**
+     * @brief Adaptive bitrate state, for resources opened from a
+     *        renditions manifest
+     *
+     * @see rtp_abr_report, rtp_abr_switch
+     */
+    struct {
+        /** Rendition to switch to at the next keyframe */
+        guint target;
+        /** Consecutive congested receiver reports */
+        unsigned int congested;
+        /** Consecutive clear receiver reports */
+        unsigned int clear;
+        /** Jitter of the last receiver report, in milliseconds */
+        double jitter;
+        /** The @ref target rendition, while it's being prepared */
+        struct ResourcePending *pending;
+        /** Time @ref pending is seeked to */
+        double pending_time;
+    } abr;
 } RTSP_session;
 
 /**
@@ -107,8 +144,86 @@ typedef struct RTSP_Range {
 struct RTSP_Client;
 struct HTTP_Tunnel_Pair;
 
+/**
+ * @brief Event loop worker
+ *
+ * Each worker is a thread running its own event loop, multiplexing
+ * all the clients that have been dispatched to it; the number of
+ * workers is fixed at startup (see @ref cfg_options_t::workers).
+ */
+typedef struct RTSP_Worker {
+    GThread *thread;
+    struct ev_loop *loop;
+
+    /**
+     * @brief Clients accepted but not yet attached to the loop
+     *
+     * Connections are accepted by a different thread, which pushes
+     * them here and then wakes the worker up through @ref
+     * RTSP_Worker::ev_incoming.
+     */
+    GAsyncQueue *incoming;
+    ev_async ev_incoming;
+
+    /**
+     * @brief Listeners to start on the worker's loop
+     *
+     * Used for the per-worker SO_REUSEPORT listeners; like @ref
+     * RTSP_Worker::incoming they are picked up when the loop is woken
+     * up through @ref RTSP_Worker::ev_incoming.
+     */
+    GAsyncQueue *listeners;
+
+    /**
+     * @brief Signal to disconnect all clients and leave the loop
+     */
+    ev_async ev_stop;
+
+    /**
+     * @brief Number of clients served by the worker
+     *
+     * Accessed atomically, used by the least-load dispatch policy.
+     */
+    gint clients;
+
+    /**
+     * @brief io_uring instance used to send the RTP packets over UDP
+     *
+     * Only set when built with liburing and the io-uring option is
+     * enabled; NULL otherwise.
+     */
+    struct rtp_uring *uring;
+
+    /**
+     * @brief Pacing scheduler of the RTP sessions served by the worker
+     */
+    struct rtp_scheduler *scheduler;
+
+    /**
+     * @brief Fan-outs of the live tracks played by the worker's
+     *        clients, by Track
+     *
+     * @see rtp_fanout_join
+     */
+    GHashTable *fanouts;
+} RTSP_Worker;
+
 typedef void (*rtsp_write_data)(struct RTSP_Client *client, GByteArray *data);
 
+/**
+ * @brief Data queued for output on a TCP connection
+ */
+typedef struct RTSP_OutBuffer {
+    /** Data owned by the queue, sent first */
+    GByteArray *data;
+    /** Media buffer whose payload is sent after @ref data, if any */
+    struct MParserBuffer *payload;
+    /** Whether a zero-copy send referenced the buffer */
+    gboolean zc;
+    /** Identifier of the last zero-copy send that referenced it */
+    uint32_t zc_id;
+} RTSP_OutBuffer;
+
 typedef struct RTSP_Client {
     /**
      * @brief Socket descriptor for the main connection of the client
@@ -139,6 +254,15 @@ typedef struct RTSP_Client {
      */
     GByteArray *input;
 
+#if ENABLE_SCTP
+    /**
+     * @brief SCTP message received only in part
+     *
+     * Kept until the rest of the message (up to MSG_EOR) can be read.
+     */
+    GByteArray *sctp_partial;
+#endif
+
     /**
      * @brief Current request being parsed
      *
@@ -147,8 +271,53 @@ typedef struct RTSP_Client {
      */
     RFC822_Request *pending_request;
 
+    /**
+     * @brief Output queue
+     *
+     * RTSP_OutBuffer objects waiting to be written on the socket; new
+     * data is pushed at the head, @ref rtsp_tcp_write_cb writes from
+     * the tail.
+     */
     GQueue *out_queue;
 
+    /**
+     * @brief Bytes of the tail of @ref out_queue already written
+     */
+    size_t out_offset;
+
+    /**
+     * @brief Bytes held by @ref out_queue, compared against the
+     *        output-high-water option
+     */
+    size_t out_bytes;
+
+    /**
+     * @brief Whether large writes are done with MSG_ZEROCOPY
+     *
+     * Set when the tcp-zerocopy option is enabled and the kernel
+     * accepts SO_ZEROCOPY on the socket; reset if the kernel reports
+     * it copied the data anyway.
+     */
+    gboolean zerocopy;
+
+    /**
+     * @brief Identifier of the next MSG_ZEROCOPY send
+     */
+    uint32_t zc_next;
+
+    /**
+     * @brief Identifier following the last completed zero-copy send
+     */
+    uint32_t zc_done;
+
+    /**
+     * @brief Written RTSP_OutBuffer objects the kernel may still read
+     *
+     * Released, in order, as the completions of the zero-copy sends
+     * are read from the socket's error queue.
+     */
+    GQueue *zc_pending;
+
     /**
      * @brief Hash table for interleaved and SCTP channels
      */
@@ -158,17 +327,50 @@ typedef struct RTSP_Client {
     RTSP_session *session;
     guint64 last_cseq;
 
+    /**
+     * @brief Lock for the data read by @ref feng_send_statistics
+     *
+     * The statistics can be requested to any worker, so this keeps
+     * the client's own worker from replacing or freeing @ref session
+     * and its RTP sessions while they are being read, and protects
+     * the counters published with @ref stats_publish_rtp.
+     */
+    GMutex *stats_lock;
+
     rtsp_write_data write_data;
 
     struct HTTP_Tunnel_Pair *pair;
 
+    /**
+     * @brief Whether to detach the client once its output is sent
+     *
+     * Set on the GET half of an HTTP tunnel whose reply couldn't be
+     * sent right away, see @ref HTTP_handle_idle.
+     */
+    gboolean detach_drained;
+
     //Events
+    /**
+     * @brief Worker serving the client
+     */
+    RTSP_Worker *worker;
+
+    /**
+     * @brief Event loop of the serving worker
+     *
+     * The loop is shared with all the other clients of the same
+     * worker, so it should never be stopped to disconnect a single
+     * client; use @ref rtsp_client_disconnect instead.
+     */
     struct ev_loop *loop;
 
     ev_timer ev_timeout;
 
+    ev_io ev_io_read;
     ev_io ev_io_write;
 
+    ev_async ev_sig_disconnect;
+
     struct cfg_vhost_t *vhost;
 
     /**
@@ -202,6 +404,9 @@ typedef struct HTTP_Tunnel_Pair {
 void rtsp_write_string(RTSP_Client *client, GString *str);
 
 void rtsp_client_incoming_cb(struct ev_loop *loop, ev_io *w, int revents);
+void rtsp_client_disconnect(RTSP_Client *client);
+void rtsp_client_detach(RTSP_Client *client);
+void rtsp_client_handover(RTSP_Client *client, RTSP_Worker *worker);
 
 void RTSP_handler(RTSP_Client * rtsp);
 gboolean rtsp_process_complete(RTSP_Client *rtsp);
@@ -255,7 +460,14 @@ void rtsp_sctp_read_cb(struct ev_loop *, ev_io *, int);
 #endif
 
 void rtsp_tcp_read_cb(struct ev_loop *, ev_io *, int);
+void rtsp_out_queue_push(RTSP_Client *client, GByteArray *data,
+                         struct MParserBuffer *payload);
+void rtsp_out_queue_free(RTSP_Client *client);
 void rtsp_write_data_queue(RTSP_Client *client, GByteArray *data);
+gboolean rtsp_write_data_droppable(RTSP_Client *client, GByteArray *data);
+gboolean rtsp_write_buffer_queue(RTSP_Client *client, GByteArray *head,
+                                 struct MParserBuffer *payload,
+                                 gboolean droppable);
 void rtsp_tcp_write_cb(struct ev_loop *, ev_io *, int);
 
 void rtsp_interleaved_receive(RTSP_Client *rtsp, int channel, uint8_t *data, size_t len);
@@ -319,15 +531,24 @@ int ragel_read_http_headers(GHashTable *headers, const char *msg,
 gboolean HTTP_handle_headers(RTSP_Client *rtsp);
 gboolean HTTP_handle_content(RTSP_Client *rtsp);
 gboolean HTTP_handle_idle(RTSP_Client *rtsp);
+gboolean HTTP_handle_join(RTSP_Client *rtsp);
 void http_tunnel_initialise();
 
 #ifdef HAVE_JSON
 void stats_account_read(RTSP_Client *rtsp, size_t bytes);
 void stats_account_sent(RTSP_Client *rtsp, size_t bytes);
+void stats_account_batch(size_t packets, size_t dropped);
+void stats_account_shed(size_t packets);
+void stats_account_burst(size_t packets, size_t bytes);
+void stats_publish_rtp(struct RTP_session *rtp);
 void feng_send_statistics(RTSP_Client *rtsp);
 #else
 #define stats_account_read(a, b)
 #define stats_account_sent(a, b)
+#define stats_account_batch(a, b)
+#define stats_account_shed(a)
+#define stats_account_burst(a, b)
+#define stats_publish_rtp(a)
 #endif
 /**
  * @}
@@ -341,6 +562,8 @@ void feng_send_statistics(RTSP_Client *rtsp);
 void clients_init();
 void clients_cleanup();
 void clients_each(GFunc func, gpointer user_data);
+guint clients_workers_count();
+void clients_worker_listen(guint index, struct feng_socket_listener *listener);
 /**
  * @}
  */
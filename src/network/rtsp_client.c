@@ -25,7 +25,9 @@
 #include <sys/time.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <string.h>
 
 #include <ev.h>
 
@@ -62,85 +64,240 @@ static GPtrArray *clients_list;
 static GMutex *clients_list_lock;
 
 /**
- * @brief Threadpool to manage per-client threads
+ * @brief Event loop workers serving the clients
  */
-static GThreadPool *client_threads;
+static RTSP_Worker *workers;
 
-#ifdef TLS
 /**
- * @brief Per-client-thread error status for libev
+ * @brief Number of entries in @ref workers
+ */
+static guint workers_count;
+
+/**
+ * @brief Dispatch policy for new connections
  *
- * Since libev does not support checking for error conditions, we've
- * got to work it around by providing our own "error flag" to turn on
- * if something goes wrong in the libev initialisation.
+ * When true, new connections are handed to the worker with the
+ * lowest number of clients, otherwise they are assigned round-robin.
+ */
+static gboolean workers_least_load;
+
+static void libev_syserr(const char *msg)
+{
+    fnc_perror(msg);
+}
+
+static void rtsp_client_free(RTSP_Client *client);
+static void client_attach(RTSP_Worker *worker, RTSP_Client *client);
+
+/**
+ * @brief Attach the clients queued for a worker to its loop
  *
- * Something will go wrong if you try to accept more connections than
- * your file descriptors count will allow you to.
+ * @param loop The worker's event loop
+ * @param w The ev_async watcher that was signalled
+ * @param revents Unused
  */
-static TLS int client_ev_init_errors;
-#else
+static void worker_incoming_cb(ATTR_UNUSED struct ev_loop *loop,
+                               ev_async *w,
+                               ATTR_UNUSED int revents)
+{
+    RTSP_Worker *worker = w->data;
+    RTSP_Client *client;
+    feng_socket_listener *listener;
 
-#include <pthread.h>
+    while ( (listener = g_async_queue_try_pop(worker->listeners)) != NULL )
+        ev_io_start(worker->loop, &listener->io);
 
-pthread_key_t client_ev_init_errors_key;
+    while ( (client = g_async_queue_try_pop(worker->incoming)) != NULL ) {
+        client_attach(worker, client);
 
-static int client_ev_init_errors_func()
+        /* the POST half of an HTTP tunnel, handed over by another
+           worker to join its GET half */
+        if ( client->status == RFC822_State_HTTP_Join )
+            RTSP_handler(client);
+    }
+}
+
+/**
+ * @brief Disconnect all the clients of a worker and leave its loop
+ *
+ * @param loop The worker's event loop
+ * @param w The ev_async watcher that was signalled
+ * @param revents Unused
+ *
+ * @note This function will lock the @ref clients_list_lock mutex.
+ */
+static void worker_stop_cb(struct ev_loop *loop,
+                           ev_async *w,
+                           int revents)
 {
-    return GPOINTER_TO_INT(pthread_getspecific(client_ev_init_errors_key));
+    RTSP_Worker *worker = w->data;
+
+    /* make sure that nobody is left waiting in the queue */
+    worker_incoming_cb(loop, &worker->ev_incoming, revents);
+
+    /* Take the clients one by one, since the detach might also take
+       care of a second client (HTTP tunnels) */
+    while ( true ) {
+        RTSP_Client *client = NULL;
+        guint i;
+
+        g_mutex_lock(clients_list_lock);
+        for ( i = 0; i < clients_list->len; i++ ) {
+            RTSP_Client *it = g_ptr_array_index(clients_list, i);
+            if ( it->worker == worker ) {
+                client = it;
+                break;
+            }
+        }
+        g_mutex_unlock(clients_list_lock);
+
+        if ( client == NULL )
+            break;
+
+        rtsp_client_detach(client);
+    }
+
+    ev_unloop(loop, EVUNLOOP_ALL);
 }
 
-# define client_ev_init_errors client_ev_init_errors_func()
+/**
+ * @brief Thread function for the workers
+ *
+ * @param worker_p The RTSP_Worker object to run the loop of
+ */
+static gpointer worker_loop(gpointer worker_p)
+{
+    RTSP_Worker *worker = worker_p;
 
-#endif
+    ev_loop(worker->loop, 0);
 
-static void libev_syserr(const char *msg)
+    return NULL;
+}
+
+/**
+ * @brief Create and start a single worker
+ *
+ * @param worker The worker to initialise
+ */
+static void worker_start(RTSP_Worker *worker)
 {
-    fnc_perror(msg);
-#ifdef TLS
-    client_ev_init_errors = 1;
-#else
-    pthread_setspecific(client_ev_init_errors_key, GINT_TO_POINTER(1));
+    GError *error = NULL;
+
+    if ( (worker->loop = ev_loop_new(EVFLAG_AUTO)) == NULL ) {
+        fnc_log(FNC_LOG_FATAL, "Unable to create the event loop for a worker");
+        exit(1);
+    }
+
+    worker->incoming = g_async_queue_new();
+    worker->listeners = g_async_queue_new();
+
+    worker->ev_incoming.data = worker;
+    ev_async_init(&worker->ev_incoming, worker_incoming_cb);
+    ev_async_start(worker->loop, &worker->ev_incoming);
+
+    worker->ev_stop.data = worker;
+    ev_async_init(&worker->ev_stop, worker_stop_cb);
+    ev_async_start(worker->loop, &worker->ev_stop);
+
+    worker->scheduler = rtp_scheduler_new(worker->loop);
+    worker->fanouts = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+#ifdef HAVE_LIBURING
+    if ( feng_srv.io_uring )
+        worker->uring = rtp_uring_new(worker->loop);
 #endif
+
+    worker->thread = g_thread_create(worker_loop, worker, true, &error);
+    if ( worker->thread == NULL ) {
+        fnc_log(FNC_LOG_FATAL, "Unable to start worker thread: %s",
+                error->message);
+        exit(1);
+    }
 }
 
-static void client_loop(gpointer client_p,
-                        gpointer user_data);
-static void rtsp_client_free(RTSP_Client *client);
+/**
+ * @brief Choose the worker to serve a new client
+ *
+ * @note Only the main loop accepts connections through this
+ *       function (per-worker listeners attach the clients directly),
+ *       so the round-robin cursor needs no locking.
+ */
+static RTSP_Worker *worker_select()
+{
+    static guint next_worker;
+    RTSP_Worker *selected = &workers[next_worker];
+    guint i;
+
+    if ( workers_least_load ) {
+        for ( i = 0; i < workers_count; i++ )
+            if ( g_atomic_int_get(&workers[i].clients) <
+                 g_atomic_int_get(&selected->clients) )
+                selected = &workers[i];
+    }
+
+    next_worker = (next_worker + 1) % workers_count;
+
+    return selected;
+}
 
 /**
  * @brief Initialise the clients-handling code
+ *
+ * Starts the configured number of workers, defaulting to one per
+ * online processor.
  */
 void clients_init()
 {
-    clients_list = g_ptr_array_new();
+    guint i;
 
+    clients_list = g_ptr_array_new();
     clients_list_lock = g_mutex_new();
-    client_threads = g_thread_pool_new(client_loop, NULL,
-                                       -1, /** @TODO link it to the max number of clients */
-                                       false, NULL);
 
     ev_set_syserr_cb(libev_syserr);
 
-#ifndef TLS
-    if ( pthread_key_create(&client_ev_init_errors_key, NULL) ) {
-        perror("pthread_key_create");
-        exit(1);
+    workers_count = feng_srv.workers;
+    if ( workers_count == 0 ) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers_count = cpus > 0 ? cpus : 1;
     }
-#endif
+
+    workers_least_load = feng_srv.worker_dispatch != NULL &&
+        strcmp(feng_srv.worker_dispatch, "least-load") == 0;
+
+    workers = g_new0(RTSP_Worker, workers_count);
+    for ( i = 0; i < workers_count; i++ )
+        worker_start(&workers[i]);
+
+    fnc_log(FNC_LOG_INFO, "Started %u event loop workers (%s dispatch)",
+            workers_count, workers_least_load ? "least-load" : "round-robin");
+}
+
+/**
+ * @brief Get the number of running workers
+ */
+guint clients_workers_count()
+{
+    return workers_count;
 }
 
 /**
- * @brief Send the disconnection signal to a single client
+ * @brief Have a worker accept connections on a listener
  *
- * @param element The RTSP_Client object from @ref feng::clients
- * @brief user_data unused
+ * @param index Index of the worker to start the listener on
+ * @param listener The listener to start; its watcher should be
+ *                 initialised, but not started.
+ *
+ * The listener is started by the worker's own thread, the next time
+ * its loop is woken up.
  */
-static void client_disconnect(gpointer element,
-                              ATTR_UNUSED gpointer user_data)
+void clients_worker_listen(guint index, feng_socket_listener *listener)
 {
-    RTSP_Client *client = (RTSP_Client*)element;
+    RTSP_Worker *worker = &workers[index % workers_count];
+
+    listener->worker = worker;
 
-    ev_unloop(client->loop, EVUNLOOP_ONE);
+    g_async_queue_push(worker->listeners, listener);
+    ev_async_send(worker->loop, &worker->ev_incoming);
 }
 
 /**
@@ -153,11 +310,28 @@ static void client_disconnect(gpointer element,
  */
 void clients_cleanup()
 {
-    clients_each(client_disconnect, NULL);
+    guint i;
+
+    for ( i = 0; i < workers_count; i++ )
+        ev_async_send(workers[i].loop, &workers[i].ev_stop);
+
+    for ( i = 0; i < workers_count; i++ )
+        g_thread_join(workers[i].thread);
 
 #ifdef CLEANUP_DESTRUCTOR
+    for ( i = 0; i < workers_count; i++ ) {
+        rtp_scheduler_free(workers[i].scheduler);
+        g_hash_table_destroy(workers[i].fanouts);
+#ifdef HAVE_LIBURING
+        rtp_uring_free(workers[i].uring, workers[i].loop);
+#endif
+        ev_loop_destroy(workers[i].loop);
+        g_async_queue_unref(workers[i].incoming);
+        g_async_queue_unref(workers[i].listeners);
+    }
+    g_free(workers);
+
     g_ptr_array_free(clients_list, true);
-    g_thread_pool_free(client_threads, true, false);
     g_mutex_free(clients_list_lock);
 #endif
 }
@@ -186,6 +360,11 @@ static void check_if_any_rtp_session_timedout(gpointer element,
     RTP_session *session = (RTP_session *)element;
     time_t now = time(NULL);
 
+    /* Multicast viewers don't send anything themselves: the group's
+     * sender does, and says goodbye to the whole group. */
+    if ( session->multicast != NULL )
+        return;
+
     /* Check if we didn't send any data for more then STREAM_BYE_TIMEOUT seconds
      * this will happen if we are not receiving any more from live producer or
      * if the stored stream ended.
@@ -201,7 +380,7 @@ static void check_if_any_rtp_session_timedout(gpointer element,
      */
     if ((now - session->last_packet_send_time) >= STREAM_TIMEOUT) {
         fnc_log(FNC_LOG_INFO, "[client] Stream Timeout, client kicked off!");
-        ev_unloop(session->client->loop, EVUNLOOP_ONE);
+        rtsp_client_disconnect(session->client);
     }
 }
 
@@ -215,105 +394,197 @@ static void client_ev_timeout(struct ev_loop *loop, ev_timer *w,
     ev_timer_again (loop, w);
 }
 
+static void client_ev_disconnect_handler(ATTR_UNUSED struct ev_loop *loop,
+                                         ev_async *w,
+                                         ATTR_UNUSED int revents)
+{
+    rtsp_client_detach(w->data);
+}
+
 /**
- * @brief Threadpool callback for each client
+ * @brief Request the disconnection of a client
  *
- * @brief client_p The client to execute the loop for
- * @brief user_data unused
+ * @param client The client to disconnect
  *
- * @note This function will lock the @ref clients_list_lock mutex.
+ * The actual disconnection happens on the next iteration of the
+ * worker's loop, so that it's safe to call this function from within
+ * any of the client's callbacks, or from a different thread.
  */
-static void client_loop(gpointer client_p,
-                        ATTR_UNUSED gpointer user_data)
+void rtsp_client_disconnect(RTSP_Client *client)
 {
-    RTSP_Client *client = (RTSP_Client *)client_p;
+    if ( client->loop == NULL )
+        return;
 
-    struct ev_loop *loop = client->loop;
-    ev_io *io_write_p = &client->ev_io_write, io_read = { .data = client };
+    ev_async_send(client->loop, &client->ev_sig_disconnect);
+}
+
+/**
+ * @brief Attach a client to the loop of its worker
+ *
+ * @param worker The worker that is going to serve the client
+ * @param client The client to attach
+ *
+ * @note This function will lock the @ref clients_list_lock mutex.
+ */
+static void client_attach(RTSP_Worker *worker, RTSP_Client *client)
+{
+    struct ev_loop *loop = worker->loop;
+    ev_io *io_write_p = &client->ev_io_write, *io_read_p = &client->ev_io_read;
     ev_timer *timer;
 
+    io_read_p->data = client;
+
     switch(client->socktype) {
     case RTSP_TCP:
         /* to be started/stopped when necessary */
         io_write_p->data = client;
         ev_io_init(io_write_p, rtsp_tcp_write_cb, client->sd, EV_WRITE);
 
-        ev_io_init(&io_read, rtsp_tcp_read_cb, client->sd, EV_READ);
+        ev_io_init(io_read_p, rtsp_tcp_read_cb, client->sd, EV_READ);
         break;
 #if ENABLE_SCTP
     case RTSP_SCTP:
-        ev_io_init(&io_read, rtsp_sctp_read_cb, client->sd, EV_READ);
+        ev_io_init(io_read_p, rtsp_sctp_read_cb, client->sd, EV_READ);
         break;
 #endif
     }
 
-    ev_io_start(loop, &io_read);
+    ev_io_start(loop, io_read_p);
 
     timer = &client->ev_timeout;
     timer->data = client;
     ev_init(timer, client_ev_timeout);
     timer->repeat = STREAM_TIMEOUT;
 
-    /* if there were no errors during libev initialisation, proceed to
-     * run the loop, otherwise, start cleaning up already. We could
-     * try to send something to the clients to let them know that we
-     * failed, but ... it's going to be difficult at this point. */
-    if ( client_ev_init_errors == 0 ) {
-        g_mutex_lock(clients_list_lock);
-        g_ptr_array_add(clients_list, client);
-        g_mutex_unlock(clients_list_lock);
+    client->ev_sig_disconnect.data = client;
+    ev_async_init(&client->ev_sig_disconnect, client_ev_disconnect_handler);
+    ev_async_start(loop, &client->ev_sig_disconnect);
+
+    g_mutex_lock(clients_list_lock);
+    g_ptr_array_add(clients_list, client);
+    g_mutex_unlock(clients_list_lock);
+}
 
-        ev_loop(loop, 0);
+/**
+ * @brief Take a client off its worker
+ *
+ * @param client The client to take off
+ *
+ * This stops all the watchers of the client and removes it from the
+ * list, undoing @ref client_attach.
+ *
+ * @note This function will lock the @ref clients_list_lock mutex.
+ */
+static void client_leave(RTSP_Client *client)
+{
+    struct ev_loop *loop = client->loop;
 
-        ev_io_stop(loop, &io_read);
-        ev_io_stop(loop, io_write_p);
+    ev_io_stop(loop, &client->ev_io_read);
+    ev_io_stop(loop, &client->ev_io_write);
+    ev_timer_stop(loop, &client->ev_timeout);
+    ev_async_stop(loop, &client->ev_sig_disconnect);
 
-        ev_timer_stop(loop, &client->ev_timeout);
+    /* As soon as we're out of here, remove the client from the list! */
+    g_mutex_lock(clients_list_lock);
+    g_ptr_array_remove_fast(clients_list, client);
+    g_mutex_unlock(clients_list_lock);
 
-        /* As soon as we're out of here, remove the client from the list! */
-        g_mutex_lock(clients_list_lock);
-        g_ptr_array_remove_fast(clients_list, client);
-        g_mutex_unlock(clients_list_lock);
-    }
+    g_atomic_int_add(&client->worker->clients, -1);
+}
+
+/**
+ * @brief Move a client to a different worker
+ *
+ * @param client The client to move
+ * @param worker The worker that is going to serve the client
+ *
+ * Used to serve both halves of an HTTP tunnel from the same loop. The
+ * client is attached by the new worker's own thread, which resumes
+ * the client's state machine (see @ref HTTP_handle_join).
+ *
+ * @note To be called by the worker currently serving the client, out
+ *       of its callbacks' way: no watcher of the client must be
+ *       running.
+ */
+void rtsp_client_handover(RTSP_Client *client, RTSP_Worker *worker)
+{
+    client_leave(client);
+
+    client->worker = worker;
+    client->loop = worker->loop;
+    g_atomic_int_inc(&worker->clients);
+
+    g_async_queue_push(worker->incoming, client);
+    ev_async_send(worker->loop, &worker->ev_incoming);
+}
+
+/**
+ * @brief Detach a client from its worker's loop
+ *
+ * @param client The client to detach
+ *
+ * This stops all the watchers of the client and removes it from the
+ * list; for HTTP tunnels, the GET half is only detached (its socket is
+ * still used to send data out, driven by the POST half) while on
+ * detach of the POST half both objects are freed.
+ *
+ * @note This function will lock the @ref clients_list_lock mutex.
+ */
+void rtsp_client_detach(RTSP_Client *client)
+{
+    struct ev_loop *loop = client->loop;
+
+    client->detach_drained = false;
 
-    client->vhost->connection_count--;
+    client_leave(client);
 
-    client->loop = NULL;
-    ev_loop_destroy(loop);
+    g_atomic_int_add(&client->vhost->connection_count, -1);
 
     /* We have special handling of HTTP connection clients; we kill
-       the two objects on disconnection of the POST request. */
+       the two objects on disconnection of the POST request. The loop
+       stays valid until the objects are freed, since the RTP sessions
+       need to stop their watchers. */
     if ( client->pair == NULL ) {
         rtsp_client_free(client);
     } else if ( client->pair->rtsp_client == client ) {
-        rtsp_client_free(client->pair->http_client);
+        RTSP_Client *http_client = client->pair->http_client;
+
+        /* the GET half might still be sending its reply */
+        if ( http_client->loop != NULL )
+            rtsp_client_detach(http_client);
+
+        ev_io_stop(loop, &http_client->ev_io_write);
+        g_slice_free(HTTP_Tunnel_Pair, client->pair);
+        rtsp_client_free(http_client);
         rtsp_client_free(client);
+    } else {
+        client->loop = NULL;
     }
 }
 
 static void rtsp_client_free(RTSP_Client *client)
 {
-    GString *outbuf = NULL;
     close(client->sd);
     g_free(client->local_host);
     g_free(client->remote_host);
 
     rtsp_session_free(client->session);
+    g_mutex_free(client->stats_lock);
 
     if ( client->channels )
         g_hash_table_destroy(client->channels);
 
     /* Remove the output queue */
-    if ( client->out_queue ) {
-        while( (outbuf = g_queue_pop_tail(client->out_queue)) )
-            g_string_free(outbuf, TRUE);
-
-        g_queue_free(client->out_queue);
-    }
+    rtsp_out_queue_free(client);
 
     if ( client->input ) /* not present on SCTP or HTTP transports */
         g_byte_array_free(client->input, true);
 
+#if ENABLE_SCTP
+    if ( client->sctp_partial )
+        g_byte_array_free(client->sctp_partial, true);
+#endif
+
     g_slice_free(RFC822_Request, client->pending_request);
 
     g_slice_free1(client->sa_len, client->peer_sa);
@@ -341,8 +612,9 @@ static void rtsp_client_free(RTSP_Client *client)
  *
  * @li creates and sets up the @ref RTSP_Client object.
  *
- * The newly created instance is deleted by @ref
- * client_loop at the end of the processing
+ * The newly created instance is handed over to one of the workers
+ * (see @ref worker_select), and is deleted by @ref rtsp_client_detach
+ * at the end of the processing.
  *
  * @internal This function should be used as callback for an ev_io
  *           listener.
@@ -358,11 +630,30 @@ void rtsp_client_incoming_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
 
     RTSP_Client *rtsp;
 
-    if ( (client_sd = accept(listen->fd, (struct sockaddr*)&peer, &peer_len)) < 0 ) {
-        fnc_perror("accept failed");
+#if HAVE_ACCEPT4
+    client_sd = accept4(listen->fd, (struct sockaddr*)&peer, &peer_len,
+                        SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+    client_sd = accept(listen->fd, (struct sockaddr*)&peer, &peer_len);
+#endif
+
+    if ( client_sd < 0 ) {
+        /* someone else might have accepted the connection already, or
+           it was reset before we got to it. */
+        if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED )
+            fnc_perror("accept failed");
         return;
     }
 
+#if !HAVE_ACCEPT4
+    /* the workers' loops are shared, the clients' reads must not block */
+    if ( fcntl(client_sd, F_SETFL, fcntl(client_sd, F_GETFL) | O_NONBLOCK) < 0 ||
+         fcntl(client_sd, F_SETFD, FD_CLOEXEC) < 0 ) {
+        fnc_perror("fcntl");
+        goto error;
+    }
+#endif
+
     if ( getsockname(client_sd, (struct sockaddr*)&bound, &bound_len) < 0 ) {
         fnc_perror("getsockname");
         goto error;
@@ -385,15 +676,22 @@ void rtsp_client_incoming_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
 
     rtsp = g_slice_new0(RTSP_Client);
     rtsp->input = g_byte_array_new();
+    rtsp->stats_lock = g_mutex_new();
     rtsp->sd = client_sd;
 
-    rtsp->loop = ev_loop_new(EVFLAG_AUTO);
-
     switch (sock_proto) {
     case IPPROTO_TCP:
         rtsp->socktype = RTSP_TCP;
         rtsp->out_queue = g_queue_new();
         rtsp->write_data = rtsp_write_data_queue;
+#ifdef RTSP_TCP_ZEROCOPY
+        if ( feng_srv.tcp_zerocopy ) {
+            static const int one = 1;
+
+            rtsp->zerocopy = setsockopt(client_sd, SOL_SOCKET, SO_ZEROCOPY,
+                                        &one, sizeof(one)) == 0;
+        }
+#endif
         break;
 #if ENABLE_SCTP
     case IPPROTO_SCTP:
@@ -414,9 +712,25 @@ void rtsp_client_incoming_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
     rtsp->peer_sa = g_slice_copy(peer_len, &peer);
     rtsp->local_sa = g_slice_copy(peer_len, &bound);
 
-    rtsp->vhost->connection_count++;
+    g_atomic_int_inc(&rtsp->vhost->connection_count);
+
+    /* Listeners owned by a worker hand the client straight to its
+       loop (which is the one we're running in); the others queue it
+       for the chosen worker to pick up. */
+    if ( listen->worker != NULL ) {
+        rtsp->worker = listen->worker;
+        rtsp->loop = rtsp->worker->loop;
+        g_atomic_int_inc(&rtsp->worker->clients);
 
-    g_thread_pool_push(client_threads, rtsp, NULL);
+        client_attach(rtsp->worker, rtsp);
+    } else {
+        rtsp->worker = worker_select();
+        rtsp->loop = rtsp->worker->loop;
+        g_atomic_int_inc(&rtsp->worker->clients);
+
+        g_async_queue_push(rtsp->worker->incoming, rtsp);
+        ev_async_send(rtsp->loop, &rtsp->worker->ev_incoming);
+    }
 
     return;
 
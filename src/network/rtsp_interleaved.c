@@ -25,6 +25,7 @@
 #include "rtsp.h"
 #include "rtp.h"
 #include "fnc_log.h"
+#include "media/media.h"
 
 void rtsp_interleaved_register(RTSP_Client *rtsp, RTP_session *rtp_s,
                                ATTR_UNUSED int rtp_channel, int rtcp_channel)
@@ -56,33 +57,135 @@ void rtsp_interleaved_receive(RTSP_Client *rtsp, int channel, uint8_t *data, siz
         rtcp_handle(rtp, data, len);
 }
 
-static gboolean rtp_interleaved_send_pkt(RTSP_Client *rtsp, GByteArray *buffer, int channel)
+/**
+ * @brief Start the buffer of an interleaved packet
+ *
+ * @param channel The interleaved channel to send the packet on
+ * @param len Length of the packet
+ * @param size Amount of data that is going to be appended to the
+ *             buffer after the preamble
+ *
+ * @return A new GByteArray holding the interleaved preamble.
+ */
+static GByteArray *rtp_interleaved_preamble(int channel, size_t len,
+                                            size_t size)
 {
-    const uint16_t ne_n = htons((uint16_t)buffer->len);
-    const uint8_t interleaved_preamble[4] = { '$', channel, 0, 0 };
+    GByteArray *outbuf;
+    uint16_t ne_n = htons((uint16_t)len);
+    uint8_t interleaved_preamble[4] = { '$', channel, 0, 0 };
 
-    /* This might not be the best choice here, to be honest… a
-     * scatter-gather approach might work best, but for now, let's
-     * stick with this…
-     */
-    g_byte_array_prepend(buffer, interleaved_preamble, 4);
-    memcpy(&buffer->data[2], &ne_n, sizeof(uint16_t));
+    memcpy(&interleaved_preamble[2], &ne_n, sizeof(uint16_t));
+
+    outbuf = g_byte_array_sized_new(sizeof(interleaved_preamble) + size);
+    g_byte_array_append(outbuf, interleaved_preamble,
+                        sizeof(interleaved_preamble));
+
+    return outbuf;
+}
+
+/**
+ * @brief Send a packet on an interleaved channel
+ *
+ * @param rtsp The client to send the packet to
+ * @param iov The parts of the packet to send
+ * @param iovcnt Number of entries in @p iov
+ * @param channel The interleaved channel to send the packet on
+ * @param droppable Whether the packet can be discarded if the client
+ *                  is congested
+ *
+ * @retval false The packet was discarded.
+ *
+ * The interleaved preamble and the parts of the packet are gathered
+ * in a single buffer, that is queued on the client.
+ */
+static gboolean rtp_interleaved_send_pkt(RTSP_Client *rtsp,
+                                         const struct iovec *iov, size_t iovcnt,
+                                         int channel, gboolean droppable)
+{
+    GByteArray *outbuf;
+    size_t i, len = 0;
+
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    outbuf = rtp_interleaved_preamble(channel, len, len);
+    for (i = 0; i < iovcnt; i++)
+        g_byte_array_append(outbuf, iov[i].iov_base, iov[i].iov_len);
 
     /* pass the bucket down; it might be direct RTSP or HTTP-tunnelled */
-    rtsp->write_data(rtsp, buffer);
+    if ( droppable )
+        return rtsp_write_data_droppable(rtsp, outbuf);
+
+    rtsp->write_data(rtsp, outbuf);
 
     /* no stats accounting because the write_data function will take care of it */
     return TRUE;
 }
 
-static gboolean rtp_interleaved_send_rtp(RTP_session *rtp, GByteArray *buffer)
+static gboolean rtp_interleaved_send_rtp(RTP_session *rtp,
+                                         const uint8_t *header,
+                                         struct MParserBuffer *buffer)
 {
-    return rtp_interleaved_send_pkt(rtp->client, buffer, rtp->tcp.rtp);
+    struct iovec iov[RTP_PACKET_IOVECS];
+    size_t iovcnt;
+    gboolean droppable = false, queued;
+
+    /* Only video packets outside of keyframes are shed when the
+       client cannot keep up; since the following frames depend on the
+       discarded ones, shedding goes on up to the next keyframe. */
+    if ( rtp->track->media_type == MP_video ) {
+        if ( buffer->keyframe ) {
+            rtp->tcp.keyframes = true;
+            rtp->tcp.in_keyframe = true;
+            rtp->tcp.shedding = false;
+        }
+
+        droppable = rtp->tcp.keyframes && !rtp->tcp.in_keyframe;
+
+        if ( buffer->marker )
+            rtp->tcp.in_keyframe = false;
+    }
+
+    if ( droppable && rtp->tcp.shedding ) {
+        stats_account_shed(1);
+        return TRUE;
+    }
+
+    /* with zero-copy writes, the payload is queued by reference and
+       only the preamble and the header are copied */
+    if ( rtp->client->zerocopy && rtp->client->pair == NULL ) {
+        GByteArray *outbuf =
+            rtp_interleaved_preamble(rtp->tcp.rtp,
+                                     RTP_HEADER_SIZE + mparser_buffer_size(buffer),
+                                     RTP_HEADER_SIZE);
+
+        g_byte_array_append(outbuf, header, RTP_HEADER_SIZE);
+        queued = rtsp_write_buffer_queue(rtp->client, outbuf, buffer,
+                                         droppable);
+    } else {
+        iovcnt = rtp_packet_iovec(header, buffer, iov);
+        queued = rtp_interleaved_send_pkt(rtp->client, iov, iovcnt,
+                                          rtp->tcp.rtp, droppable);
+    }
+
+    if ( !queued ) {
+        fnc_log(FNC_LOG_DEBUG, "[rtp] client congested, shedding video up to the next keyframe");
+        stats_account_shed(1);
+        rtp->tcp.shedding = true;
+    }
+
+    return TRUE;
 }
 
 static gboolean rtp_interleaved_send_rtcp(RTP_session *rtp, GByteArray *buffer)
 {
-    return rtp_interleaved_send_pkt(rtp->client, buffer, rtp->tcp.rtcp);
+    struct iovec iov = { buffer->data, buffer->len };
+    gboolean ret = rtp_interleaved_send_pkt(rtp->client, &iov, 1,
+                                            rtp->tcp.rtcp, false);
+
+    g_byte_array_free(buffer, TRUE);
+
+    return ret;
 }
 
 static void rtp_interleaved_close_transport(ATTR_UNUSED RTP_session *rtp)
@@ -115,6 +218,10 @@ gboolean rtp_interleaved_transport(RTSP_Client *rtsp,
     rtp_s->send_rtcp = rtp_interleaved_send_rtcp;
     rtp_s->close_transport = rtp_interleaved_close_transport;
 
+    /* Nothing is lost on the connection, the packets shed on
+       congestion are dropped on purpose */
+    rtp_s->rtx.payload_type = -1;
+
     rtp_s->transport_string = g_strdup_printf("RTP/AVP/TCP;interleaved=%d-%d;ssrc=%08X",
                                               parsed->rtp_channel,
                                               parsed->rtcp_channel,
@@ -27,53 +27,631 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
-#include <poll.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#ifdef HAVE_LINUX_ERRQUEUE_H
+# include <linux/errqueue.h>
+#endif
+
+#ifdef HAVE_LIBURING
+# include <liburing.h>
+# include <sys/eventfd.h>
+#endif
 
 #include "feng.h"
 #include "rtsp.h"
 #include "rtp.h"
 #include "fnc_log.h"
 #include "netembryo.h"
+#include "media/media.h"
+
+/**
+ * @brief Maximum number of RTP packets queued for a single flush
+ *
+ * Reaching this amount of packets flushes the batch right away.
+ */
+#define RTP_UDP_BATCH_MAX 32
+
+/* Older C libraries don't know about the option yet, even if the
+ * running kernel might (Linux 4.18 or later); the fallback takes care
+ * of the kernels that don't. */
+#if defined(__linux__) && !defined(UDP_SEGMENT)
+# define UDP_SEGMENT 103
+#endif
+
+#ifdef UDP_SEGMENT
+/**
+ * @brief Set once the kernel refused a segmented send
+ *
+ * Starts from the udp-gso option, and is cleared (for all the
+ * sessions) the first time a send with UDP_SEGMENT fails.
+ */
+static gint rtp_udp_gso_enabled = -1;
+#endif
+
+/**
+ * @brief Maximum number of queued buffers written at once on a TCP
+ *        connection
+ */
+#define RTSP_WRITEV_MAX 64
+
+/**
+ * @brief Maximum number of scatter-gather entries of an output buffer
+ */
+#define RTSP_OUT_BUFFER_IOVECS 3
+
+#ifdef RTSP_TCP_ZEROCOPY
+/**
+ * @brief Minimum size of a write to be done with MSG_ZEROCOPY
+ */
+# define RTSP_ZEROCOPY_MIN 16384
+#endif
+
+#ifdef HAVE_LIBURING
+/**
+ * @brief Number of entries of each worker's io_uring
+ */
+#define RTP_URING_ENTRIES 1024
+
+/**
+ * @brief io_uring instance of a worker
+ *
+ * Completions are signalled through an eventfd, watched by the
+ * worker's event loop.
+ */
+struct rtp_uring {
+    struct io_uring ring;
+    int eventfd;
+    ev_io ev_complete;
+};
+
+/**
+ * @brief Batches of a session submitted to io_uring
+ *
+ * Shared by the session and its batches in flight, so that the
+ * session can be closed without waiting for them to complete: it's
+ * then left orphaned, and freed along with the last batch.
+ */
+struct rtp_uring_flight {
+    /** The session the batches were queued on, NULL once closed */
+    RTP_session *rtp;
+    /** Number of batches not completed yet */
+    unsigned int batches;
+};
+#endif
+
+#ifdef HAVE_SENDMMSG
+typedef struct mmsghdr rtp_udp_msg;
+# define RTP_UDP_MSGHDR(m) (&(m)->msg_hdr)
+#else
+typedef struct msghdr rtp_udp_msg;
+# define RTP_UDP_MSGHDR(m) (m)
+#endif
+
+/**
+ * @brief RTP packets queued on a UDP session
+ *
+ * The RTP headers are copied here, while the payloads are referenced
+ * until the batch is flushed.
+ */
+struct rtp_udp_batch {
+    unsigned int count;
+    uint8_t headers[RTP_UDP_BATCH_MAX][RTP_HEADER_SIZE];
+    struct iovec iov[RTP_UDP_BATCH_MAX][RTP_PACKET_IOVECS];
+    size_t sizes[RTP_UDP_BATCH_MAX];
+    rtp_udp_msg msgs[RTP_UDP_BATCH_MAX];
+    struct MParserBuffer *buffers[RTP_UDP_BATCH_MAX];
+
+#ifdef UDP_SEGMENT
+    /** @brief Messages built by @ref rtp_udp_batch_gso */
+    struct {
+        struct iovec iov[RTP_UDP_BATCH_MAX * RTP_PACKET_IOVECS];
+        rtp_udp_msg msgs[RTP_UDP_BATCH_MAX];
+        /** Number of RTP packets carried by each message */
+        unsigned int packets[RTP_UDP_BATCH_MAX];
+        union {
+            char buf[CMSG_SPACE(sizeof(uint16_t))];
+            struct cmsghdr align;
+        } control[RTP_UDP_BATCH_MAX];
+    } gso;
+#endif
+
+#ifdef HAVE_LIBURING
+    /** @brief State of a batch submitted to the worker's io_uring */
+    struct {
+        struct rtp_uring_flight *flight;
+        /** Number of operations not completed yet */
+        unsigned int pending;
+        unsigned int sent;
+        size_t bytes;
+        /** Operations submitted, used as completion data */
+        struct rtp_udp_op {
+            struct rtp_udp_batch *batch;
+            /** Number of RTP packets carried by the message */
+            unsigned int packets;
+        } ops[RTP_UDP_BATCH_MAX];
+    } uring;
+#endif
+};
 
-static gboolean rtp_udp_send_pkt(int sd, struct sockaddr *sa, GByteArray *buffer, RTSP_Client *rtsp)
+/**
+ * @brief Send a number of messages on a socket
+ *
+ * @param sd The (connected) socket to send the messages on
+ * @param msgs The messages to send
+ * @param count The number of messages in @p msgs
+ * @param bytes Incremented by the number of bytes sent
+ *
+ * @return The number of messages sent, or -1 if the first one
+ *         couldn't be sent.
+ */
+static int rtp_udp_send_msgs(int sd, rtp_udp_msg *msgs, unsigned int count,
+                             size_t *bytes)
 {
-    int written = -1;
-    struct pollfd p = { sd, POLLOUT, 0};
-
-    if (poll(&p, 1, 1) < 0) {
-        fnc_perror("poll");
-        goto end;
-    }
-
-    if (p.revents & POLLOUT) {
-        written = sendto(sd, buffer->data, buffer->len,
-                         MSG_EOR | MSG_DONTWAIT,
-                         sa, sizeof(struct sockaddr_storage));
-        if (written >= 0 ) {
-            stats_account_sent(rtsp, written);
-        } else {
-            fnc_perror("sendto");
+    int sent;
+#ifdef HAVE_SENDMMSG
+    int i;
+
+    if ( (sent = sendmmsg(sd, msgs, count, MSG_DONTWAIT)) < 0 )
+        return sent;
+
+    for (i = 0; i < sent; i++)
+        *bytes += msgs[i].msg_len;
+#else
+    for (sent = 0; sent < (int)count; sent++) {
+        ssize_t written = sendmsg(sd, &msgs[sent], MSG_DONTWAIT);
+
+        if ( written < 0 )
+            return sent ? sent : -1;
+
+        *bytes += written;
+    }
+#endif
+
+    return sent;
+}
+
+#ifdef UDP_SEGMENT
+/**
+ * @brief Group the queued packets into segmented (GSO) messages
+ *
+ * @param batch The batch to group the packets of
+ *
+ * @return The number of messages in @ref rtp_udp_batch::gso
+ *
+ * Runs of packets of the same size (as produced when fragmenting a
+ * big frame) are sent as a single datagram that the kernel (or the
+ * network card) splits in segments; the last packet of a run can be
+ * shorter than the others.
+ */
+static unsigned int rtp_udp_batch_gso(struct rtp_udp_batch *batch)
+{
+    unsigned int i = 0, nmsgs = 0, niov = 0;
+
+    while ( i < batch->count ) {
+        struct msghdr *msg = RTP_UDP_MSGHDR(&batch->gso.msgs[nmsgs]);
+        const size_t segment = batch->sizes[i];
+        unsigned int packets = 0;
+
+        memset(msg, 0, sizeof(struct msghdr));
+        msg->msg_iov = &batch->gso.iov[niov];
+
+        do {
+            const size_t iovcnt = RTP_UDP_MSGHDR(&batch->msgs[i])->msg_iovlen;
+
+            memcpy(&batch->gso.iov[niov], batch->iov[i],
+                   iovcnt * sizeof(struct iovec));
+            niov += iovcnt;
+            msg->msg_iovlen += iovcnt;
+
+            packets++;
+        } while ( ++i < batch->count &&
+                  batch->sizes[i - 1] == segment &&
+                  batch->sizes[i] <= segment );
+
+        if ( packets > 1 ) {
+            struct cmsghdr *cmsg;
+            const uint16_t segment_size = segment;
+
+            msg->msg_control = batch->gso.control[nmsgs].buf;
+            msg->msg_controllen = sizeof(batch->gso.control[nmsgs].buf);
+
+            cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(uint16_t));
         }
+
+        batch->gso.packets[nmsgs++] = packets;
     }
 
- end:
-    g_byte_array_free(buffer, true);
+    return nmsgs;
+}
 
-    return written >= 0;
+/**
+ * @brief Send the queued packets as segmented (GSO) messages
+ *
+ * @return The number of packets sent, or -1 if the kernel refused
+ *         the segmented send, in which case the caller should send
+ *         the packets normally.
+ */
+static int rtp_udp_flush_gso(RTP_session *rtp, size_t *bytes)
+{
+    struct rtp_udp_batch *batch = rtp->udp.batch;
+    const unsigned int nmsgs = rtp_udp_batch_gso(batch);
+    unsigned int i, sent_msgs = 0, sent = 0;
+
+    while ( sent_msgs < nmsgs ) {
+        int ret = rtp_udp_send_msgs(rtp->udp.rtp_sd,
+                                    &batch->gso.msgs[sent_msgs],
+                                    nmsgs - sent_msgs,
+                                    bytes);
+
+        if ( ret < 0 ) {
+            switch ( errno ) {
+            case EIO:
+            case EINVAL:
+            case EOPNOTSUPP:
+            case ENOPROTOOPT:
+                if ( sent > 0 )
+                    break;
+
+                fnc_log(FNC_LOG_WARN,
+                        "[rtp] UDP segmentation offload not available (%s), disabling",
+                        strerror(errno));
+                g_atomic_int_set(&rtp_udp_gso_enabled, 0);
+                return -1;
+            case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+            case EWOULDBLOCK:
+#endif
+                break;
+            default:
+                fnc_perror("sendmmsg");
+            }
+            break;
+        }
+
+        for (i = sent_msgs; i < sent_msgs + ret; i++)
+            sent += batch->gso.packets[i];
+
+        sent_msgs += ret;
+    }
+
+    return sent;
 }
+#endif
 
-static gboolean rtp_udp_send_rtp(RTP_session *rtp, GByteArray *buffer)
+/**
+ * @brief Account for a batch whose packets were sent (or dropped)
+ *
+ * @param rtp The session the batch was queued on, NULL if it was
+ *            closed meanwhile
+ * @param batch The batch to release the packets of
+ * @param sent Number of packets actually sent
+ * @param bytes Number of bytes actually sent
+ */
+static void rtp_udp_batch_complete(RTP_session *rtp,
+                                   struct rtp_udp_batch *batch,
+                                   unsigned int sent, size_t bytes)
 {
-    return rtp_udp_send_pkt(rtp->udp.rtp_sd,
-                            rtp->udp.rtp_sa,
-                            buffer, rtp->client);
+    unsigned int i;
+
+    if ( sent < batch->count )
+        fnc_log(FNC_LOG_DEBUG, "[rtp] %u packets dropped",
+                batch->count - sent);
+
+    if ( rtp != NULL )
+        stats_account_sent(rtp->client, bytes);
+    stats_account_batch(batch->count, batch->count - sent);
+
+    for (i = 0; i < batch->count; i++)
+        mparser_buffer_unref(batch->buffers[i]);
+
+    batch->count = 0;
+}
+
+#ifdef HAVE_LIBURING
+/**
+ * @brief Process the completed operations of a worker's io_uring
+ */
+static void rtp_uring_reap(struct rtp_uring *uring)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head, count = 0;
+
+    io_uring_for_each_cqe(&uring->ring, head, cqe) {
+        struct rtp_udp_op *op = io_uring_cqe_get_data(cqe);
+        struct rtp_udp_batch *batch = op->batch;
+
+        count++;
+
+        if ( cqe->res >= 0 ) {
+            batch->uring.sent += op->packets;
+            batch->uring.bytes += cqe->res;
+        } else switch ( -cqe->res ) {
+            case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+            case EWOULDBLOCK:
+#endif
+                break;
+#ifdef UDP_SEGMENT
+            case EIO:
+            case EINVAL:
+            case EOPNOTSUPP:
+            case ENOPROTOOPT:
+                if ( op->packets > 1 &&
+                     g_atomic_int_get(&rtp_udp_gso_enabled) == 1 ) {
+                    fnc_log(FNC_LOG_WARN,
+                            "[rtp] UDP segmentation offload not available (%s), disabling",
+                            strerror(-cqe->res));
+                    g_atomic_int_set(&rtp_udp_gso_enabled, 0);
+                    break;
+                }
+                /* fall through */
+#endif
+            default:
+                fnc_log(FNC_LOG_ERR, "[rtp] sendmsg: %s", strerror(-cqe->res));
+            }
+
+        if ( --batch->uring.pending == 0 ) {
+            struct rtp_uring_flight *flight = batch->uring.flight;
+
+            rtp_udp_batch_complete(flight->rtp, batch,
+                                   batch->uring.sent, batch->uring.bytes);
+            g_slice_free(struct rtp_udp_batch, batch);
+
+            if ( --flight->batches == 0 && flight->rtp == NULL )
+                g_slice_free(struct rtp_uring_flight, flight);
+        }
+    }
+
+    io_uring_cq_advance(&uring->ring, count);
+}
+
+static void rtp_uring_complete_cb(ATTR_UNUSED struct ev_loop *loop,
+                                  ev_io *w,
+                                  ATTR_UNUSED int revents)
+{
+    struct rtp_uring *uring = w->data;
+    eventfd_t value;
+
+    (void)eventfd_read(uring->eventfd, &value);
+
+    rtp_uring_reap(uring);
+}
+
+/**
+ * @brief Create the io_uring instance for a worker
+ *
+ * @param loop The worker's event loop, to watch for completions on
+ *
+ * @return A new instance, or NULL if io_uring is not available, in
+ *         which case the worker uses plain system calls.
+ */
+struct rtp_uring *rtp_uring_new(struct ev_loop *loop)
+{
+    struct rtp_uring *uring = g_slice_new0(struct rtp_uring);
+    int ret;
+
+    if ( (ret = io_uring_queue_init(RTP_URING_ENTRIES, &uring->ring, 0)) < 0 ) {
+        fnc_log(FNC_LOG_WARN, "[rtp] io_uring not available (%s)",
+                strerror(-ret));
+        goto err_alloc;
+    }
+
+    if ( (uring->eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0 ) {
+        fnc_perror("eventfd");
+        goto err_queue;
+    }
+
+    if ( (ret = io_uring_register_eventfd(&uring->ring, uring->eventfd)) < 0 ) {
+        fnc_log(FNC_LOG_WARN, "[rtp] unable to register io_uring eventfd (%s)",
+                strerror(-ret));
+        goto err_eventfd;
+    }
+
+    uring->ev_complete.data = uring;
+    ev_io_init(&uring->ev_complete, rtp_uring_complete_cb,
+               uring->eventfd, EV_READ);
+    ev_io_start(loop, &uring->ev_complete);
+
+    return uring;
+
+ err_eventfd:
+    close(uring->eventfd);
+ err_queue:
+    io_uring_queue_exit(&uring->ring);
+ err_alloc:
+    g_slice_free(struct rtp_uring, uring);
+    return NULL;
+}
+
+/**
+ * @brief Destroy the io_uring instance of a worker
+ *
+ * @param uring The instance to destroy, or NULL
+ * @param loop The worker's event loop
+ *
+ * The completions already available are processed; batches still in
+ * flight at this point (the clients are gone already) are abandoned.
+ */
+void rtp_uring_free(struct rtp_uring *uring, struct ev_loop *loop)
+{
+    if ( uring == NULL )
+        return;
+
+    rtp_uring_reap(uring);
+
+    ev_io_stop(loop, &uring->ev_complete);
+    io_uring_queue_exit(&uring->ring);
+    close(uring->eventfd);
+
+    g_slice_free(struct rtp_uring, uring);
+}
+
+/**
+ * @brief Submit the RTP packets queued on a UDP session to io_uring
+ *
+ * @retval true The batch was handed over to the worker's io_uring; a
+ *              new one was allocated for the session.
+ * @retval false The worker has no io_uring, or its submission queue
+ *               is full; the caller should send the batch directly.
+ *
+ * The batch is released by @ref rtp_uring_reap once all its messages
+ * have completed; the session's socket can be closed meanwhile as
+ * the submitted operations hold their own reference to it, and the
+ * session itself can be freed, see @ref rtp_uring_flight.
+ */
+static gboolean rtp_uring_flush(RTP_session *rtp)
+{
+    struct rtp_uring *uring = rtp->client->worker->uring;
+    struct rtp_udp_batch *batch = rtp->udp.batch;
+    rtp_udp_msg *msgs = batch->msgs;
+    unsigned int i, nmsgs = batch->count;
+
+    if ( uring == NULL ||
+         io_uring_sq_space_left(&uring->ring) < batch->count )
+        return false;
+
+    for (i = 0; i < batch->count; i++)
+        batch->uring.ops[i].packets = 1;
+
+#ifdef UDP_SEGMENT
+    if ( g_atomic_int_get(&rtp_udp_gso_enabled) == 1 ) {
+        nmsgs = rtp_udp_batch_gso(batch);
+        msgs = batch->gso.msgs;
+
+        for (i = 0; i < nmsgs; i++)
+            batch->uring.ops[i].packets = batch->gso.packets[i];
+    }
+#endif
+
+    for (i = 0; i < nmsgs; i++) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&uring->ring);
+
+        io_uring_prep_sendmsg(sqe, rtp->udp.rtp_sd,
+                              RTP_UDP_MSGHDR(&msgs[i]), MSG_DONTWAIT);
+
+        batch->uring.ops[i].batch = batch;
+        io_uring_sqe_set_data(sqe, &batch->uring.ops[i]);
+    }
+
+    if ( rtp->udp.flight == NULL ) {
+        rtp->udp.flight = g_slice_new0(struct rtp_uring_flight);
+        rtp->udp.flight->rtp = rtp;
+    }
+
+    batch->uring.flight = rtp->udp.flight;
+    batch->uring.pending = nmsgs;
+    batch->uring.sent = 0;
+    batch->uring.bytes = 0;
+
+    io_uring_submit(&uring->ring);
+
+    rtp->udp.flight->batches++;
+    rtp->udp.batch = g_slice_new(struct rtp_udp_batch);
+    rtp->udp.batch->count = 0;
+
+    return true;
+}
+#endif
+
+/**
+ * @brief Send all the RTP packets queued on a UDP session
+ *
+ * Packets that cannot be sent because the socket buffer is full are
+ * dropped: there's no point in delaying RTP over UDP.
+ */
+static void rtp_udp_flush_rtp(RTP_session *rtp)
+{
+    struct rtp_udp_batch *batch = rtp->udp.batch;
+    unsigned int sent = 0;
+    size_t bytes = 0;
+
+    if ( batch->count == 0 )
+        return;
+
+#ifdef UDP_SEGMENT
+    if ( g_atomic_int_get(&rtp_udp_gso_enabled) == -1 )
+        g_atomic_int_set(&rtp_udp_gso_enabled, feng_srv.udp_gso);
+#endif
+
+#ifdef HAVE_LIBURING
+    if ( rtp_uring_flush(rtp) )
+        return;
+#endif
+
+#ifdef UDP_SEGMENT
+    if ( g_atomic_int_get(&rtp_udp_gso_enabled) == 1 ) {
+        int ret = rtp_udp_flush_gso(rtp, &bytes);
+
+        if ( ret >= 0 ) {
+            sent = ret;
+            goto done;
+        }
+    }
+#endif
+
+    while ( sent < batch->count ) {
+        int ret = rtp_udp_send_msgs(rtp->udp.rtp_sd,
+                                    &batch->msgs[sent],
+                                    batch->count - sent,
+                                    &bytes);
+
+        if ( ret < 0 ) {
+            if ( errno != EAGAIN && errno != EWOULDBLOCK )
+                fnc_perror("sendmmsg");
+            break;
+        }
+
+        sent += ret;
+    }
+
+#ifdef UDP_SEGMENT
+ done:
+#endif
+    rtp_udp_batch_complete(rtp, batch, sent, bytes);
+}
+
+static gboolean rtp_udp_send_rtp(RTP_session *rtp, const uint8_t *header,
+                                 struct MParserBuffer *buffer)
+{
+    struct rtp_udp_batch *batch = rtp->udp.batch;
+    const unsigned int i = batch->count++;
+    struct msghdr *msg = RTP_UDP_MSGHDR(&batch->msgs[i]);
+
+    memcpy(batch->headers[i], header, RTP_HEADER_SIZE);
+    batch->buffers[i] = mparser_buffer_ref(buffer);
+
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_iov = batch->iov[i];
+    msg->msg_iovlen = rtp_packet_iovec(batch->headers[i], buffer,
+                                       batch->iov[i]);
+    batch->sizes[i] = RTP_HEADER_SIZE + mparser_buffer_size(buffer);
+
+    if ( batch->count == RTP_UDP_BATCH_MAX )
+        rtp_udp_flush_rtp(rtp);
+
+    return true;
 }
 
 static gboolean rtp_udp_send_rtcp(RTP_session *rtp, GByteArray *buffer)
 {
-    return rtp_udp_send_pkt(rtp->udp.rtcp_sd,
-                            rtp->udp.rtcp_sa,
-                            buffer, rtp->client);
+    ssize_t written = send(rtp->udp.rtcp_sd, buffer->data, buffer->len,
+                           MSG_DONTWAIT);
+
+    if ( written >= 0 )
+        stats_account_sent(rtp->client, written);
+    else if ( errno != EAGAIN && errno != EWOULDBLOCK )
+        fnc_perror("send");
+
+    g_byte_array_free(buffer, true);
+
+    return written >= 0;
 }
 
 static void rtp_udp_close_transport(RTP_session *rtp)
@@ -82,6 +660,20 @@ static void rtp_udp_close_transport(RTP_session *rtp)
 
     ev_io_stop(client->loop, &rtp->udp.rtcp_reader);
 
+    rtp_udp_flush_rtp(rtp);
+    g_slice_free(struct rtp_udp_batch, rtp->udp.batch);
+
+#ifdef HAVE_LIBURING
+    /* The batches still in flight are released as they complete,
+       without the session */
+    if ( rtp->udp.flight != NULL ) {
+        if ( rtp->udp.flight->batches > 0 )
+            rtp->udp.flight->rtp = NULL;
+        else
+            g_slice_free(struct rtp_uring_flight, rtp->udp.flight);
+    }
+#endif
+
     close(rtp->udp.rtp_sd);
     close(rtp->udp.rtcp_sd);
 
@@ -89,6 +681,23 @@ static void rtp_udp_close_transport(RTP_session *rtp)
     g_slice_free1(client->sa_len, rtp->udp.rtcp_sa);
 }
 
+static gboolean rtp_udp_multicast_send_rtcp(RTP_session *rtp,
+                                            GByteArray *buffer)
+{
+    ssize_t written = sendto(rtp->udp.rtcp_sd, buffer->data, buffer->len,
+                             MSG_DONTWAIT, rtp->udp.rtcp_sa,
+                             sizeof(struct sockaddr_in));
+
+    if ( written >= 0 )
+        stats_account_sent(rtp->client, written);
+    else if ( errno != EAGAIN && errno != EWOULDBLOCK )
+        fnc_perror("sendto");
+
+    g_byte_array_free(buffer, true);
+
+    return written >= 0;
+}
+
 /**
  * @brief Read incoming RTCP packets from the socket
  */
@@ -109,6 +718,9 @@ static void rtcp_udp_read_cb(ATTR_UNUSED struct ev_loop *loop,
 
 /**
  * @brief Setup unicast UDP transport sockets for an RTP session
+ *
+ * Requests for multicast delivery are handed over to @ref
+ * rtp_multicast_transport.
  */
 gboolean rtp_udp_transport(RTSP_Client *rtsp,
                            RTP_session *rtp_s,
@@ -122,6 +734,9 @@ gboolean rtp_udp_transport(RTSP_Client *rtsp,
     int firstsd;
     in_port_t firstport, rtp_port, rtcp_port;
 
+    if ( parsed->mode == TransportMulticast )
+        return rtp_multicast_transport(rtsp, rtp_s, parsed);
+
     memcpy(sa_p, rtsp->local_sa, sa_len);
 
     /* The client will not provide ports for us, obviously, let's
@@ -234,9 +849,13 @@ gboolean rtp_udp_transport(RTSP_Client *rtsp,
     io->data = rtp_s;
     ev_io_init(io, rtcp_udp_read_cb,
                rtp_s->udp.rtcp_sd, EV_READ);
+    ev_io_start(rtsp->loop, io);
+
+    rtp_s->udp.batch = g_slice_new0(struct rtp_udp_batch);
 
     rtp_s->send_rtp = rtp_udp_send_rtp;
     rtp_s->send_rtcp = rtp_udp_send_rtcp;
+    rtp_s->flush_rtp = rtp_udp_flush_rtp;
     rtp_s->close_transport = rtp_udp_close_transport;
 
     source = neb_sa_get_host((struct sockaddr*) &sa);
@@ -267,6 +886,203 @@ gboolean rtp_udp_transport(RTSP_Client *rtsp,
     return false;
 }
 
+/**
+ * @brief Setup the UDP transport sending an RTP session to a multicast
+ *        group
+ *
+ * @param rtp_s The session to set the transport up for; its client
+ *              has to be set already
+ * @param group IPv4 address and RTP port of the group (a struct
+ *              sockaddr_in)
+ * @param ttl Time-to-live of the packets sent to the group
+ *
+ * The RTP socket is connected to the group like the unicast ones, so
+ * that the packets are sent the same way; the RTCP socket instead
+ * joins the group, to receive the reports of all the receivers, and
+ * addresses the sender reports to it explicitly.
+ *
+ * @see rtp_multicast_transport
+ */
+gboolean rtp_udp_multicast_transport(RTP_session *rtp_s,
+                                     const struct sockaddr *group,
+                                     unsigned int ttl)
+{
+    const struct sockaddr_in *group_in = (const struct sockaddr_in *)group;
+    const socklen_t sa_len = sizeof(struct sockaddr_in);
+    const unsigned char mttl = ttl;
+    const int on = 1;
+    ev_io *io = &rtp_s->udp.rtcp_reader;
+    struct ip_mreq mreq;
+
+    rtp_s->udp.rtp_sd = rtp_s->udp.rtcp_sd = -1;
+
+    if ( (rtp_s->udp.rtp_sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+         (rtp_s->udp.rtcp_sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) {
+        fnc_perror("socket");
+        goto error;
+    }
+
+    if ( setsockopt(rtp_s->udp.rtp_sd, IPPROTO_IP, IP_MULTICAST_TTL,
+                    &mttl, sizeof(mttl)) < 0 ||
+         setsockopt(rtp_s->udp.rtcp_sd, IPPROTO_IP, IP_MULTICAST_TTL,
+                    &mttl, sizeof(mttl)) < 0 ) {
+        fnc_perror("setsockopt IP_MULTICAST_TTL");
+        goto error;
+    }
+
+    rtp_s->udp.rtp_sa = g_slice_copy(sa_len, group_in);
+
+    if ( connect(rtp_s->udp.rtp_sd, rtp_s->udp.rtp_sa, sa_len) < 0 ) {
+        fnc_perror("connect");
+        goto error;
+    }
+
+    rtp_s->udp.rtcp_sa = g_slice_copy(sa_len, group_in);
+    neb_sa_set_port(rtp_s->udp.rtcp_sa, ntohs(group_in->sin_port) + 1);
+
+    /* All the groups of the pool use the same RTCP port; binding to
+     * the group address only receives the datagrams sent to it. */
+    if ( setsockopt(rtp_s->udp.rtcp_sd, SOL_SOCKET, SO_REUSEADDR,
+                    &on, sizeof(on)) < 0 ) {
+        fnc_perror("setsockopt SO_REUSEADDR");
+        goto error;
+    }
+
+    if ( bind(rtp_s->udp.rtcp_sd, rtp_s->udp.rtcp_sa, sa_len) < 0 ) {
+        fnc_perror("bind");
+        goto error;
+    }
+
+    mreq.imr_multiaddr = group_in->sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+    if ( setsockopt(rtp_s->udp.rtcp_sd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                    &mreq, sizeof(mreq)) < 0 ) {
+        fnc_perror("setsockopt IP_ADD_MEMBERSHIP");
+        goto error;
+    }
+
+    rtp_s->udp.batch = g_slice_new0(struct rtp_udp_batch);
+
+    rtp_s->send_rtp = rtp_udp_send_rtp;
+    rtp_s->send_rtcp = rtp_udp_multicast_send_rtcp;
+    rtp_s->flush_rtp = rtp_udp_flush_rtp;
+    rtp_s->close_transport = rtp_udp_close_transport;
+
+    io->data = rtp_s;
+    ev_io_init(io, rtcp_udp_read_cb,
+               rtp_s->udp.rtcp_sd, EV_READ);
+    ev_io_start(rtp_s->client->loop, io);
+
+    return true;
+
+ error:
+    if ( rtp_s->udp.rtp_sa != NULL )
+        g_slice_free1(sa_len, rtp_s->udp.rtp_sa);
+    if ( rtp_s->udp.rtcp_sa != NULL )
+        g_slice_free1(sa_len, rtp_s->udp.rtcp_sa);
+    if ( rtp_s->udp.rtp_sd >= 0 )
+        close(rtp_s->udp.rtp_sd);
+    if ( rtp_s->udp.rtcp_sd >= 0 )
+        close(rtp_s->udp.rtcp_sd);
+    return false;
+}
+
+/**
+ * @brief Length of the data held by an output buffer
+ */
+static size_t rtsp_out_buffer_len(const RTSP_OutBuffer *outbuf)
+{
+    size_t len = outbuf->data->len;
+
+    if ( outbuf->payload )
+        len += mparser_buffer_size(outbuf->payload);
+
+    return len;
+}
+
+/**
+ * @brief Fill the scatter-gather description of an output buffer
+ *
+ * @return The number of entries used in @p iov, at most @ref
+ *         RTSP_OUT_BUFFER_IOVECS.
+ */
+static size_t rtsp_out_buffer_iovec(const RTSP_OutBuffer *outbuf,
+                                    struct iovec *iov)
+{
+    size_t count = 0;
+
+    iov[count].iov_base = outbuf->data->data;
+    iov[count++].iov_len = outbuf->data->len;
+
+    if ( outbuf->payload == NULL )
+        return count;
+
+    if ( outbuf->payload->prefix_size > 0 ) {
+        iov[count].iov_base = outbuf->payload->prefix;
+        iov[count++].iov_len = outbuf->payload->prefix_size;
+    }
+
+    iov[count].iov_base = outbuf->payload->data;
+    iov[count++].iov_len = outbuf->payload->data_size;
+
+    return count;
+}
+
+static void rtsp_out_buffer_free(gpointer data, ATTR_UNUSED gpointer user_data)
+{
+    RTSP_OutBuffer *outbuf = data;
+
+    g_byte_array_free(outbuf->data, TRUE);
+    if ( outbuf->payload )
+        mparser_buffer_unref(outbuf->payload);
+
+    g_slice_free(RTSP_OutBuffer, outbuf);
+}
+
+/**
+ * @brief Add data to a client's output queue
+ *
+ * @param client The client whose queue to push the data on
+ * @param data The GByteArray object to queue for sending
+ * @param payload Media buffer to send after @p data, or NULL; the
+ *                queue takes over the caller's reference.
+ *
+ * The write watcher is not started, as it depends on the loop the
+ * caller is running on.
+ */
+void rtsp_out_queue_push(RTSP_Client *client, GByteArray *data,
+                         struct MParserBuffer *payload)
+{
+    RTSP_OutBuffer *outbuf = g_slice_new0(RTSP_OutBuffer);
+
+    outbuf->data = data;
+    outbuf->payload = payload;
+
+    client->out_bytes += rtsp_out_buffer_len(outbuf);
+    g_queue_push_head(client->out_queue, outbuf);
+}
+
+/**
+ * @brief Release the output queue of a client
+ *
+ * Buffers waiting for a zero-copy completion are released as well:
+ * once the socket is closed the kernel keeps its own references to
+ * the pages it still has to read.
+ */
+void rtsp_out_queue_free(RTSP_Client *client)
+{
+    if ( client->out_queue ) {
+        g_queue_foreach(client->out_queue, rtsp_out_buffer_free, NULL);
+        g_queue_free(client->out_queue);
+    }
+
+    if ( client->zc_pending ) {
+        g_queue_foreach(client->zc_pending, rtsp_out_buffer_free, NULL);
+        g_queue_free(client->zc_pending);
+    }
+}
+
 /**
  * @brief Queue data for write in the client's output queue
  *
@@ -278,16 +1094,145 @@ gboolean rtp_udp_transport(RTSP_Client *rtsp,
  */
 void rtsp_write_data_queue(RTSP_Client *client, GByteArray *data)
 {
-    g_queue_push_head(client->out_queue, data);
+    rtsp_out_queue_push(client, data, NULL);
     ev_io_start(client->loop, &client->ev_io_write);
 }
 
-void rtsp_tcp_read_cb(struct ev_loop *loop, ev_io *w,
+/**
+ * @brief Check whether a client's output is above the high-water mark
+ *
+ * @param client The client the data is written for; tunnelled data is
+ *               queued on the HTTP connection.
+ */
+static gboolean rtsp_out_congested(const RTSP_Client *client)
+{
+    const RTSP_Client *output = client->pair ? client->pair->http_client : client;
+
+    return output->out_queue != NULL &&
+        output->out_bytes >= feng_srv.output_high_water * 1024;
+}
+
+/**
+ * @brief Write data that can be discarded if the client is congested
+ *
+ * @param client The client to write the data to
+ * @param data The GByteArray object to send
+ *
+ * @retval true The data was passed on to @ref RTSP_Client::write_data
+ * @retval false The output queue of the client is above the
+ *               output-high-water mark; the data was freed.
+ *
+ * @note after calling this function, the @p data object should no
+ * longer be referenced by the code path.
+ */
+gboolean rtsp_write_data_droppable(RTSP_Client *client, GByteArray *data)
+{
+    if ( rtsp_out_congested(client) ) {
+        g_byte_array_free(data, true);
+        return false;
+    }
+
+    client->write_data(client, data);
+    return true;
+}
+
+/**
+ * @brief Queue a packet whose payload is referenced from a media buffer
+ *
+ * @param client The client to write the packet to; it has to be a
+ *               plain TCP connection.
+ * @param head The GByteArray object with the data preceding the payload
+ * @param payload The media buffer holding the payload; a reference is
+ *                taken if the packet is queued.
+ * @param droppable Whether the packet can be discarded if the client
+ *                  is congested
+ *
+ * @retval false The packet was discarded, @p head was freed.
+ *
+ * This avoids copying the payload in user space; with zero-copy
+ * writes, it's not copied at all.
+ */
+gboolean rtsp_write_buffer_queue(RTSP_Client *client, GByteArray *head,
+                                 struct MParserBuffer *payload,
+                                 gboolean droppable)
+{
+    if ( droppable && rtsp_out_congested(client) ) {
+        g_byte_array_free(head, true);
+        return false;
+    }
+
+    rtsp_out_queue_push(client, head, mparser_buffer_ref(payload));
+    ev_io_start(client->loop, &client->ev_io_write);
+    return true;
+}
+
+#ifdef RTSP_TCP_ZEROCOPY
+/**
+ * @brief Release the buffers whose zero-copy sends completed
+ *
+ * Completions are read from the socket's error queue; each reports a
+ * range of send identifiers, and since TCP completes them in order,
+ * all the buffers up to the end of the range can be released.
+ */
+static void rtsp_tcp_zerocopy_reap(RTSP_Client *rtsp)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+                 CMSG_SPACE(sizeof(struct sockaddr_storage))];
+
+    if ( rtsp->zc_pending == NULL )
+        return;
+
+    for ( ;; ) {
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control)
+        };
+        struct cmsghdr *cmsg;
+
+        if ( recvmsg(rtsp->sd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0 )
+            return;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            const struct sock_extended_err *serr;
+            RTSP_OutBuffer *outbuf;
+
+            if ( !(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                 !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR) )
+                continue;
+
+            serr = (const struct sock_extended_err *)CMSG_DATA(cmsg);
+            if ( serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0 )
+                continue;
+
+            /* the kernel had to copy the data anyway (e.g. loopback
+               or no scatter-gather support), so zero-copy is only
+               adding overhead */
+            if ( (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && rtsp->zerocopy ) {
+                fnc_log(FNC_LOG_DEBUG, "[rtsp] zero-copy sends copied, disabling");
+                rtsp->zerocopy = false;
+            }
+
+            if ( (int32_t)(serr->ee_data + 1 - rtsp->zc_done) > 0 )
+                rtsp->zc_done = serr->ee_data + 1;
+
+            while ( (outbuf = g_queue_peek_head(rtsp->zc_pending)) != NULL &&
+                    (int32_t)(outbuf->zc_id - rtsp->zc_done) < 0 ) {
+                g_queue_pop_head(rtsp->zc_pending);
+                rtsp_out_buffer_free(outbuf, NULL);
+            }
+        }
+    }
+}
+#else
+# define rtsp_tcp_zerocopy_reap(rtsp)
+#endif
+
+void rtsp_tcp_read_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
                       ATTR_UNUSED int revents)
 {
     guint8 buffer[RTSP_BUFFERSIZE + 1] = { 0, };    /* +1 to control the final '\0' */
     int read_size;
-    RTSP_Client *rtsp = w->data;
+    RTSP_Client *client = w->data, *rtsp = client;
     int sd = rtsp->sd;
 
     /* if we're receiving data for an HTTP tunnel, we have to run it
@@ -295,10 +1240,16 @@ void rtsp_tcp_read_cb(struct ev_loop *loop, ev_io *w,
     if ( rtsp->pair != NULL )
         rtsp = rtsp->pair->http_client;
 
-    if ( (read_size = recv(sd,
-                           buffer,
-                           sizeof(buffer),
-                           0) ) <= 0 )
+    /* pending zero-copy completions keep the socket readable */
+    rtsp_tcp_zerocopy_reap(client);
+
+    read_size = recv(sd, buffer, sizeof(buffer), 0);
+
+    /* accepted sockets are non-blocking */
+    if ( read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+        return;
+
+    if ( read_size <= 0 )
         goto client_close;
 
     stats_account_read(rtsp, read_size);
@@ -324,30 +1275,141 @@ void rtsp_tcp_read_cb(struct ev_loop *loop, ev_io *w,
     goto disconnect;
 
  disconnect:
-    ev_unloop(loop, EVUNLOOP_ONE);
+    rtsp_client_disconnect(client);
+}
+
+/**
+ * @brief Release the first @p written bytes of a client's output queue
+ *
+ * @param rtsp The client to release the queued data of
+ * @param written Number of bytes written
+ * @param zc Whether the data was written with MSG_ZEROCOPY, in which
+ *           case the buffers are kept until the send completes.
+ */
+static void rtsp_out_queue_consume(RTSP_Client *rtsp, size_t written,
+                                   gboolean zc)
+{
+    RTSP_OutBuffer *outbuf;
+
+    while ( written > 0 &&
+            (outbuf = g_queue_peek_tail(rtsp->out_queue)) != NULL ) {
+        const size_t len = rtsp_out_buffer_len(outbuf);
+        const size_t left = len - rtsp->out_offset;
+
+        if ( zc ) {
+            outbuf->zc = true;
+            outbuf->zc_id = rtsp->zc_next;
+        }
+
+        if ( written < left ) {
+            rtsp->out_offset += written;
+            return;
+        }
+
+        written -= left;
+        rtsp->out_offset = 0;
+        rtsp->out_bytes -= len;
+
+        g_queue_pop_tail(rtsp->out_queue);
+
+        /* the send referencing it might have completed already, if
+           the buffer was written by more than one call */
+        if ( outbuf->zc && (int32_t)(outbuf->zc_id - rtsp->zc_done) >= 0 ) {
+            if ( rtsp->zc_pending == NULL )
+                rtsp->zc_pending = g_queue_new();
+            g_queue_push_tail(rtsp->zc_pending, outbuf);
+        } else
+            rtsp_out_buffer_free(outbuf, NULL);
+    }
 }
 
 void rtsp_tcp_write_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
                        ATTR_UNUSED int revents)
 {
     RTSP_Client *rtsp = w->data;
-    GByteArray *outpkt = (GByteArray *)g_queue_pop_tail(rtsp->out_queue);
-    size_t written = 0;
+    struct iovec iov[RTSP_WRITEV_MAX];
+    struct msghdr msg = { .msg_iov = iov };
+    size_t iovcnt = 0, bytes = 0, skip = rtsp->out_offset;
+    int flags = MSG_DONTWAIT;
+    GList *link;
+    ssize_t written;
 
-    if (outpkt == NULL) {
+    rtsp_tcp_zerocopy_reap(rtsp);
+
+    /* gather as many queued buffers as possible, oldest first */
+    for (link = g_queue_peek_tail_link(rtsp->out_queue);
+         link != NULL && iovcnt + RTSP_OUT_BUFFER_IOVECS <= RTSP_WRITEV_MAX;
+         link = link->prev) {
+        bytes += rtsp_out_buffer_len(link->data);
+        iovcnt += rtsp_out_buffer_iovec(link->data, &iov[iovcnt]);
+    }
+
+    if ( iovcnt == 0 ) {
         ev_io_stop(loop, &rtsp->ev_io_write);
         return;
     }
-    written = send(rtsp->sd, outpkt->data, outpkt->len, MSG_DONTWAIT);
-    if ( written < outpkt->len ) {
-        fnc_perror("");
-        /* verify if this ever happens, as it is it'll still be popped
-           from the queue */
-        if ( errno == EAGAIN )
+
+    /* skip what was written already of the oldest buffer */
+    bytes -= skip;
+    while ( skip >= iov[msg.msg_iovlen].iov_len )
+        skip -= iov[msg.msg_iovlen++].iov_len;
+
+    iov[msg.msg_iovlen].iov_base = (guint8*)iov[msg.msg_iovlen].iov_base + skip;
+    iov[msg.msg_iovlen].iov_len -= skip;
+
+    msg.msg_iov = &iov[msg.msg_iovlen];
+    msg.msg_iovlen = iovcnt - msg.msg_iovlen;
+
+#ifdef RTSP_TCP_ZEROCOPY
+    /* pinning the pages only pays off for big enough writes */
+    if ( rtsp->zerocopy && bytes >= RTSP_ZEROCOPY_MIN )
+        flags |= MSG_ZEROCOPY;
+
+ retry:
+#endif
+    written = sendmsg(rtsp->sd, &msg, flags);
+    if ( written < 0 ) {
+        switch ( errno ) {
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+        case EINTR:
             return;
-    } else {
-        stats_account_sent(rtsp, written);
+#ifdef RTSP_TCP_ZEROCOPY
+        case ENOBUFS:
+            /* out of memory to track the pinned pages */
+            if ( flags & MSG_ZEROCOPY ) {
+                flags &= ~MSG_ZEROCOPY;
+                goto retry;
+            }
+            break;
+#endif
+        }
+
+        /* the connection is gone, the reader will notice; there's no
+           use in keeping the data around */
+        fnc_perror("sendmsg");
+        rtsp_out_queue_consume(rtsp, rtsp->out_bytes - rtsp->out_offset, false);
+        ev_io_stop(loop, &rtsp->ev_io_write);
+        return;
     }
 
-    g_byte_array_free(outpkt, TRUE);
+    stats_account_sent(rtsp, written);
+
+#ifdef RTSP_TCP_ZEROCOPY
+    if ( flags & MSG_ZEROCOPY ) {
+        rtsp_out_queue_consume(rtsp, written, true);
+        rtsp->zc_next++;
+    } else
+#endif
+        rtsp_out_queue_consume(rtsp, written, false);
+
+    if ( g_queue_is_empty(rtsp->out_queue) ) {
+        ev_io_stop(loop, &rtsp->ev_io_write);
+
+        /* the reply of an HTTP tunnel's GET half is out */
+        if ( rtsp->detach_drained )
+            rtsp_client_detach(rtsp);
+    }
 }
@@ -28,14 +28,16 @@
 
 #include <stdbool.h>
 #include <math.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "fnc_log.h"
 #include "rtsp.h"
+#include "rtp.h"
 #include "feng.h"
 #include "media/media.h"
 #include "uri.h"
 
-#define SDP_EL "\r\n"
 #define DEFAULT_TTL 32
 
 #define NTP_time(t) ((float)t + 2208988800U)
@@ -59,6 +61,7 @@ static void sdp_track_descr(gpointer element, gpointer user_data)
      * twice.
      */
     MediaType type;
+    int rtx_payload_type;
 
     /* Associative-array of media types and their SDP strings.
      *
@@ -82,17 +85,242 @@ static void sdp_track_descr(gpointer element, gpointer user_data)
      * @TODO shawill: probably the transport should not be hard coded,
      * but obtained in some way
      *
-     * We assume a single payload type, it might not be the correct
-     * handling, but since we currently lack some better structure. */
+     * We assume a single media payload type, it might not be the
+     * correct handling, but since we currently lack some better
+     * structure. */
     g_string_append_printf(descr, "%s 0 RTP/AVP %u",
                            sdp_media_types[type],
                            track->payload_type);
 
+    /* The retransmission stream uses a second payload type */
+    if ( (rtx_payload_type = rtp_rtx_payload_type(track)) >= 0 )
+        g_string_append_printf(descr, " %d", rtx_payload_type);
+
     g_string_append(descr, SDP_EL);
 
     g_string_append(descr, track->sdp_description->str);
+
+    rtp_rtx_sdp_descr(track, descr);
+}
+
+/**
+ * @defgroup sdp_cache Session descriptions cache
+ *
+ * The media part of the description of a stored file only depends on
+ * the file itself, and producing it requires opening and probing the
+ * file with the demuxer; it's thus kept in a cache, bounded by the
+ * describe-cache-size option, and validated against the modification
+ * time and size of the file at each request.
+ *
+ * @{
+ */
+
+/**
+ * @brief Cached description of a stored file
+ */
+typedef struct {
+    gchar *path;        /*!< path of the resource within the vhost, key */
+    time_t mtime;       /*!< modification time of the file when described */
+    off_t size;         /*!< size of the file when described */
+    GString *media;     /*!< media-level part of the description */
+    GList *link;        /*!< link of the entry in @ref sdp_cache_lru */
+} SDP_CacheEntry;
+
+/**
+ * @brief Mutex regulating access to the descriptions cache
+ *
+ * It protects @ref sdp_cache, @ref sdp_cache_lru and @ref
+ * sdp_cache_bytes, as DESCRIBE requests are served by all the
+ * workers.
+ */
+static GStaticMutex sdp_cache_lock = G_STATIC_MUTEX_INIT;
+
+/** @brief Cached descriptions, by path */
+static GHashTable *sdp_cache;
+
+/** @brief Cached descriptions, most recently used first */
+static GQueue sdp_cache_lru = G_QUEUE_INIT;
+
+/** @brief Size of the descriptions in the cache */
+static size_t sdp_cache_bytes;
+
+static void sdp_cache_entry_free(gpointer entry_gen)
+{
+    SDP_CacheEntry *entry = entry_gen;
+
+    g_free(entry->path);
+    g_string_free(entry->media, true);
+    g_slice_free(SDP_CacheEntry, entry);
+}
+
+/**
+ * @brief Drop an entry from the cache
+ *
+ * @note To be called with @ref sdp_cache_lock held.
+ */
+static void sdp_cache_remove(SDP_CacheEntry *entry)
+{
+    g_queue_delete_link(&sdp_cache_lru, entry->link);
+    sdp_cache_bytes -= entry->media->len;
+
+    /* this frees the entry */
+    g_hash_table_remove(sdp_cache, entry->path);
+}
+
+/**
+ * @brief Look up a valid description in the cache
+ *
+ * @param path The path of the resource within the vhost
+ * @param st The current status of the file
+ *
+ * @return A copy of the cached media description, or NULL if there
+ *         is none for the current version of the file.
+ */
+static GString *sdp_cache_lookup(const char *path, const struct stat *st)
+{
+    SDP_CacheEntry *entry;
+    GString *media = NULL;
+
+    g_static_mutex_lock(&sdp_cache_lock);
+
+    if ( sdp_cache == NULL ||
+         (entry = g_hash_table_lookup(sdp_cache, path)) == NULL )
+        goto end;
+
+    if ( entry->mtime != st->st_mtime || entry->size != st->st_size ) {
+        fnc_log(FNC_LOG_DEBUG, "[SDP] %s changed, dropping cached description",
+                path);
+        sdp_cache_remove(entry);
+        goto end;
+    }
+
+    g_queue_unlink(&sdp_cache_lru, entry->link);
+    g_queue_push_head_link(&sdp_cache_lru, entry->link);
+
+    media = g_string_new_len(entry->media->str, entry->media->len);
+
+ end:
+    g_static_mutex_unlock(&sdp_cache_lock);
+    return media;
+}
+
+/**
+ * @brief Add a description to the cache
+ *
+ * @param path The path of the resource within the vhost
+ * @param st The status of the file the description was made from
+ * @param media The media description to copy into the cache
+ *
+ * The least recently used descriptions are dropped to make room for
+ * the new one.
+ */
+static void sdp_cache_insert(const char *path, const struct stat *st,
+                             const GString *media)
+{
+    const size_t limit = (size_t)feng_srv.describe_cache_size * 1024;
+    SDP_CacheEntry *entry;
+
+    if ( media->len > limit )
+        return;
+
+    g_static_mutex_lock(&sdp_cache_lock);
+
+    if ( sdp_cache == NULL )
+        sdp_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                          NULL, sdp_cache_entry_free);
+
+    /* Another worker might have described the file meanwhile */
+    if ( (entry = g_hash_table_lookup(sdp_cache, path)) != NULL )
+        sdp_cache_remove(entry);
+
+    while ( sdp_cache_bytes + media->len > limit )
+        sdp_cache_remove(g_queue_peek_tail(&sdp_cache_lru));
+
+    entry = g_slice_new(SDP_CacheEntry);
+    entry->path = g_strdup(path);
+    entry->mtime = st->st_mtime;
+    entry->size = st->st_size;
+    entry->media = g_string_new_len(media->str, media->len);
+
+    g_queue_push_head(&sdp_cache_lru, entry);
+    entry->link = g_queue_peek_head_link(&sdp_cache_lru);
+    sdp_cache_bytes += media->len;
+
+    g_hash_table_insert(sdp_cache, entry->path, entry);
+
+    g_static_mutex_unlock(&sdp_cache_lock);
 }
 
+/**
+ * @brief Create the media-level part of a description
+ *
+ * @param path The path of the resource within the vhost
+ * @param mtime Where to save the modification time of the resource
+ *
+ * @return A new GString with the range and the tracks' descriptions,
+ *         or NULL if the resource was not found or no demuxer was
+ *         found to handle it.
+ *
+ * Descriptions of stored files are taken from the cache when
+ * possible; virtual resources are always opened, as they are shared
+ * with the clients playing them anyway. Renditions manifests are
+ * opened as well, since their description comes from one of the
+ * files they list, which the cache couldn't tell changed.
+ */
+static GString *sdp_media_descr(const char *path, time_t *mtime)
+{
+    const gboolean cacheable = !g_str_has_prefix(path, "/virtual/") &&
+                               !g_str_has_suffix(path, ".abr");
+    GString *media = NULL;
+    Resource *resource;
+    double duration;
+    struct stat st;
+
+    if ( cacheable ) {
+        gchar *mrl = g_strjoin("/",
+                               feng_default_vhost->document_root,
+                               path,
+                               NULL);
+        int res = stat(mrl, &st);
+
+        g_free(mrl);
+
+        if ( res < 0 )
+            return NULL;
+
+        if ( (media = sdp_cache_lookup(path, &st)) != NULL ) {
+            *mtime = st.st_mtime;
+            return media;
+        }
+    }
+
+    fnc_log(FNC_LOG_DEBUG, "[SDP] opening %s", path);
+    if ( !(resource = r_open(path)) )
+        return NULL;
+
+    media = g_string_new("");
+    *mtime = resource->mtime;
+
+    if ((duration = resource->duration) > 0 &&
+        duration != HUGE_VAL)
+        g_string_append_printf(media, "a=range:npt=0-%f"SDP_EL, duration);
+
+    g_list_foreach(resource->tracks,
+                   sdp_track_descr,
+                   media);
+
+    r_close(resource);
+
+    if ( cacheable )
+        sdp_cache_insert(path, &st, media);
+
+    return media;
+}
+
+/**
+ * @}
+ */
+
 /**
  * @brief Create description for an SDP session
  *
@@ -106,12 +334,11 @@ static GString *sdp_session_descr(RTSP_Client *rtsp, RFC822_Request *req)
 {
     URI *uri = req->uri;
     GString *descr = NULL;
-    double duration;
+    GString *media;
+    time_t mtime;
 
     float currtime_float, restime_float;
 
-    Resource *resource;
-
     char *path;
 
     const char *inet_family;
@@ -124,8 +351,7 @@ static GString *sdp_session_descr(RTSP_Client *rtsp, RFC822_Request *req)
     inet_family = rtsp->peer_sa->sa_family == AF_INET6 ? "IP6" : "IP4";
     path = g_uri_unescape_string(uri->path, "/");
 
-    fnc_log(FNC_LOG_DEBUG, "[SDP] opening %s", path);
-    if ( !(resource = r_open(path)) ) {
+    if ( !(media = sdp_media_descr(path, &mtime)) ) {
         fnc_log(FNC_LOG_ERR, "[SDP] %s not found", path);
         g_free(path);
         return NULL;
@@ -136,7 +362,7 @@ static GString *sdp_session_descr(RTSP_Client *rtsp, RFC822_Request *req)
 
     /* Near enough approximation to run it now */
     currtime_float = NTP_time(time(NULL));
-    restime_float = resource->mtime ? NTP_time(resource->mtime) : currtime_float;
+    restime_float = mtime ? NTP_time(mtime) : currtime_float;
 
     /* Network type: Internet; Address type: IP4. */
     g_string_append_printf(descr, "o=- %.0f %.0f IN %s %s"SDP_EL,
@@ -164,15 +390,8 @@ static GString *sdp_session_descr(RTSP_Client *rtsp, RFC822_Request *req)
     // control attribute. We should look if aggregate metod is supported?
     g_string_append(descr, "a=control:*"SDP_EL);
 
-    if ((duration = resource->duration) > 0 &&
-        duration != HUGE_VAL)
-        g_string_append_printf(descr, "a=range:npt=0-%f"SDP_EL, duration);
-
-    g_list_foreach(resource->tracks,
-                   sdp_track_descr,
-                   descr);
-
-    r_close(resource);
+    g_string_append_len(descr, media->str, media->len);
+    g_string_free(media, true);
 
     fnc_log(FNC_LOG_INFO, "[SDP] description:\n%s", descr->str);
 
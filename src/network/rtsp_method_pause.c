@@ -27,6 +27,7 @@
 #include "feng.h"
 #include "rtsp.h"
 #include "rtp.h"
+#include "media/media.h"
 
 /**
  *  Actually pause playing the media using mediathread
@@ -43,6 +44,7 @@ void rtsp_do_pause(RTSP_Client *rtsp)
     range->begin_time += ev_now(rtsp->loop) - range->playback_time;
     range->playback_time = -0.1;
 
+    r_stop(rtsp_sess->resource);
     rtp_session_gslist_pause(rtsp_sess->rtp_sessions);
 
     ev_timer_stop(rtsp->loop, &rtsp->ev_timeout);
@@ -34,6 +34,92 @@
 #include "fnc_log.h"
 #include "media/media.h"
 
+/**
+ * @brief Join the sessions already playing a shared resource
+ *
+ * @param rtsp_sess The session to start playing
+ * @param range The range requested for the session
+ *
+ * @retval true The RTP sessions were registered with their tracks,
+ *              starting at the first queued keyframe, and @p range
+ *              was moved to start there.
+ * @retval false The other sessions are too far from the requested
+ *               time, or no keyframe is queued yet.
+ */
+static gboolean join_shared(RTSP_session *rtsp_sess, RTSP_Range *range)
+{
+    const double window = feng_default_vhost->shared_join_window;
+    double begin = HUGE_VAL;
+    GSList *it;
+
+    for ( it = rtsp_sess->rtp_sessions; it != NULL; it = it->next ) {
+        RTP_session *rtp_s = it->data;
+        struct MParserBuffer *buffer;
+
+        bq_consumer_new(rtp_s);
+
+        if ( (buffer = bq_consumer_sync(rtp_s)) == NULL ||
+             fabs(buffer->delivery - range->begin_time) > window )
+            goto fail;
+
+        begin = MIN(begin, buffer->delivery);
+    }
+
+    fnc_log(FNC_LOG_DEBUG, "joining shared resource at %f (requested %f)",
+            begin, range->begin_time);
+
+    range->begin_time = begin;
+    return true;
+
+ fail:
+    for ( it = rtsp_sess->rtp_sessions; it != NULL; it = it->next )
+        bq_consumer_free(it->data);
+
+    return false;
+}
+
+/**
+ * @brief Move a session to a private copy of its shared resource
+ *
+ * @param rtsp_sess The session to move
+ *
+ * @retval true The session now uses a private resource.
+ * @retval false The resource couldn't be opened again; the session
+ *               is left untouched.
+ *
+ * @note The RTP sessions must not be playing.
+ */
+static gboolean unshare(RTSP_session *rtsp_sess)
+{
+    Resource *shared = rtsp_sess->resource;
+    Resource *resource;
+    GSList *it;
+
+    if ( (resource = r_unshare(shared)) == NULL )
+        return false;
+
+    /* Make sure all the tracks are there before switching any */
+    for ( it = rtsp_sess->rtp_sessions; it != NULL; it = it->next ) {
+        RTP_session *rtp_s = it->data;
+
+        if ( r_find_track(resource, rtp_s->track->name) == NULL ) {
+            r_close(resource);
+            return false;
+        }
+    }
+
+    for ( it = rtsp_sess->rtp_sessions; it != NULL; it = it->next ) {
+        RTP_session *rtp_s = it->data;
+
+        rtp_s->track = r_find_track(resource, rtp_s->track->name);
+    }
+
+    rtsp_sess->resource = resource;
+    r_close(shared);
+
+    return true;
+}
+
 /**
  * Actually starts playing the media using mediathread
  *
@@ -41,19 +127,39 @@
  *
  * @retval RTSP_Ok Operation successful
  * @retval RTSP_InvalidRange Seek couldn't be completed
+ * @retval RTSP_InternalServerError A private copy of a shared
+ *         resource couldn't be opened
  */
 static RTSP_ResponseCode do_play(RTSP_session * rtsp_sess)
 {
     RTSP_Range *range = g_queue_peek_head(rtsp_sess->play_requests);
 
-    /* Don't try to seek if the source is not seekable;
+    /* r_play() won't try to seek if the source is not seekable;
      * parse_range_header() would have already ensured the range is
      * valid for the resource, and in particular ensured that if the
      * resource is not seekable we only have the “0-” range selected.
      */
-    if ( rtsp_sess->resource->seek != NULL &&
-         r_seek(rtsp_sess->resource, range->begin_time) )
+    switch ( r_play(rtsp_sess->resource, range->begin_time) ) {
+    case RESOURCE_OK:
+        break;
+    case RESOURCE_BUSY:
+        /* Other sessions are playing the shared resource already;
+         * join them if they are close enough to the requested time,
+         * otherwise seek our own copy of it. */
+        if ( join_shared(rtsp_sess, range) )
+            break;
+
+        r_stop(rtsp_sess->resource);
+
+        if ( !unshare(rtsp_sess) )
+            return RTSP_InternalServerError;
+
+        if ( r_play(rtsp_sess->resource, range->begin_time) != RESOURCE_OK )
+            return RTSP_InvalidRange;
+        break;
+    default:
         return RTSP_InvalidRange;
+    }
 
     rtsp_sess->cur_state = RTSP_SERVER_PLAYING;
 
@@ -226,7 +226,9 @@ void RTSP_setup(RTSP_Client *rtsp, RFC822_Request *req)
         goto cleanup;
     }
 
+    g_mutex_lock(rtsp->stats_lock);
     rtsp_s->rtp_sessions = g_slist_append(rtsp_s->rtp_sessions, rtp_s);
+    g_mutex_unlock(rtsp->stats_lock);
 
     send_setup_reply(rtsp, req, rtsp_s, rtp_s);
 
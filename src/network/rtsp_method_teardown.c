@@ -34,10 +34,17 @@
  */
 void RTSP_teardown(RTSP_Client *rtsp, RFC822_Request *req)
 {
+    RTSP_session *session = rtsp->session;
+
     if ( !rfc822_request_check_url(rtsp, req) )
         return;
-    rtsp_session_free(rtsp->session);
+
+    /* unlisted first, the statistics might be reading it */
+    g_mutex_lock(rtsp->stats_lock);
     rtsp->session = NULL;
+    g_mutex_unlock(rtsp->stats_lock);
+
+    rtsp_session_free(session);
 
     rtsp_quick_response(rtsp, req, RTSP_Ok);
 }
@@ -23,6 +23,7 @@
 #include <config.h>
 
 #include <errno.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #if HAVE_LINUX_SOCKIOS_H
@@ -36,27 +37,55 @@
 #include "fnc_log.h"
 #include "feng.h"
 
-static gboolean rtsp_sctp_send_pkt(RTSP_Client *rtsp, GByteArray *buffer,
+static gboolean rtsp_sctp_send_iov(RTSP_Client *rtsp,
+                                   struct iovec *iov, size_t iovcnt,
                                    const struct sctp_sndrcvinfo *sctp_info)
 {
-    int written = sctp_send(rtsp->sd,
-                            buffer->data, buffer->len,
-                            sctp_info,
-                            MSG_DONTWAIT | MSG_EOR);
+    char control[CMSG_SPACE(sizeof(struct sctp_sndrcvinfo))];
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = iovcnt,
+        .msg_control = control,
+        .msg_controllen = sizeof(control)
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    int written;
 
-    stats_account_sent(rtsp, written);
-    g_byte_array_free(buffer, TRUE);
+    /* This is what sctp_send() does, but with a scatter-gather list */
+    cmsg->cmsg_level = IPPROTO_SCTP;
+    cmsg->cmsg_type = SCTP_SNDRCV;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct sctp_sndrcvinfo));
+    memcpy(CMSG_DATA(cmsg), sctp_info, sizeof(struct sctp_sndrcvinfo));
+
+    written = sendmsg(rtsp->sd, &msg, MSG_DONTWAIT | MSG_EOR);
 
     if ( written < 0 ) {
         fnc_perror("");
         return FALSE;
-    } else
-        return TRUE;
+    }
+
+    stats_account_sent(rtsp, written);
+    return TRUE;
+}
+
+static gboolean rtsp_sctp_send_pkt(RTSP_Client *rtsp, GByteArray *buffer,
+                                   const struct sctp_sndrcvinfo *sctp_info)
+{
+    struct iovec iov = { buffer->data, buffer->len };
+    gboolean ret = rtsp_sctp_send_iov(rtsp, &iov, 1, sctp_info);
+
+    g_byte_array_free(buffer, TRUE);
+
+    return ret;
 }
 
-static gboolean rtp_sctp_send_rtp(RTP_session *rtp, GByteArray *buffer)
+static gboolean rtp_sctp_send_rtp(RTP_session *rtp, const uint8_t *header,
+                                  struct MParserBuffer *buffer)
 {
-    return rtsp_sctp_send_pkt(rtp->client, buffer, &rtp->sctp.rtp);
+    struct iovec iov[RTP_PACKET_IOVECS];
+    size_t iovcnt = rtp_packet_iovec(header, buffer, iov);
+
+    return rtsp_sctp_send_iov(rtp->client, iov, iovcnt, &rtp->sctp.rtp);
 }
 
 static gboolean rtp_sctp_send_rtcp(RTP_session *rtp, GByteArray *buffer)
@@ -104,6 +133,9 @@ gboolean rtp_sctp_transport(RTSP_Client *rtsp,
     rtp_s->send_rtcp = rtp_sctp_send_rtcp;
     rtp_s->close_transport = rtp_sctp_close_transport;
 
+    /* Nothing is lost on the association */
+    rtp_s->rtx.payload_type = -1;
+
     rtp_s->transport_string = g_strdup_printf("RTP/AVP/SCTP;server_streams=%d-%d;ssrc=%08X",
                                               parsed->rtp_channel,
                                               parsed->rtcp_channel,
@@ -129,7 +161,7 @@ void rtsp_sctp_send_rtsp(RTSP_Client *client, GByteArray *buffer)
     rtsp_sctp_send_pkt(client, buffer, &sctp_channel_zero);
 }
 
-void rtsp_sctp_read_cb(struct ev_loop *loop, ev_io *w,
+void rtsp_sctp_read_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
                        ATTR_UNUSED int revents)
 {
     RTSP_Client *rtsp = w->data;
@@ -163,11 +195,17 @@ void rtsp_sctp_read_cb(struct ev_loop *loop, ev_io *w,
     }
 #endif
 
-    buffer = g_byte_array_sized_new(initial_size);
-
-    g_byte_array_set_size(buffer, initial_size);
+    /* continue the message left incomplete by the previous read */
+    if ( (buffer = rtsp->sctp_partial) != NULL ) {
+        rtsp->sctp_partial = NULL;
+        size = buffer->len;
+        g_byte_array_set_size(buffer, size + initial_size);
+    } else {
+        buffer = g_byte_array_sized_new(initial_size);
+        g_byte_array_set_size(buffer, initial_size);
+    }
 
-    do {
+    for ( ;; ) {
         int flags;
 
         int partial = sctp_recvmsg(rtsp->sd,
@@ -194,6 +232,17 @@ void rtsp_sctp_read_cb(struct ev_loop *loop, ev_io *w,
             disconnect = 1;
             goto end;
         } else if ( partial < 0 ) {
+            /* accepted sockets are non-blocking; keep what was read
+               of the message until the rest arrives */
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                if ( size > 0 ) {
+                    g_byte_array_set_size(buffer, size);
+                    rtsp->sctp_partial = buffer;
+                    return;
+                }
+                goto end;
+            }
+
             fnc_perror("sctp_recvmsg");
             disconnect = 1;
             goto end;
@@ -203,11 +252,9 @@ void rtsp_sctp_read_cb(struct ev_loop *loop, ev_io *w,
 
         if ( flags & MSG_EOR )
             break;
-        else if ( size >= buffer->len ) {
+        else if ( size >= buffer->len )
             g_byte_array_set_size(buffer, buffer->len + buffer_chunk_size);
-            continue;
-        }
-    } while ( 0 /* The loop will continue or break itself */ );
+    }
 
     g_byte_array_set_size(buffer, size);
 
@@ -228,5 +275,5 @@ void rtsp_sctp_read_cb(struct ev_loop *loop, ev_io *w,
     g_byte_array_free(buffer, TRUE);
 
     if ( disconnect )
-        ev_unloop(loop, EVUNLOOP_ONE);
+        rtsp_client_disconnect(rtsp);
 }
@@ -227,7 +227,8 @@ static gboolean RTSP_handle_interleaved(RTSP_Client *rtsp) {
 
 gboolean rtsp_connection_limit(RTSP_Client *rtsp, RFC822_Request *req)
 {
-    if (rtsp->vhost->connection_count > rtsp->vhost->max_connections) {
+    if ((guint)g_atomic_int_get(&rtsp->vhost->connection_count) >
+        rtsp->vhost->max_connections) {
         const char *twin = rtsp->vhost->twin;
         fnc_log(FNC_LOG_INFO, "Max connection reached");
         if (twin) {
@@ -411,6 +412,9 @@ void RTSP_handler(RTSP_Client * rtsp)
         case RFC822_State_HTTP_Idle:
             ret = HTTP_handle_idle(rtsp);
             break;
+        case RFC822_State_HTTP_Join:
+            ret = HTTP_handle_join(rtsp);
+            break;
         }
     } while(ret);
 #else
@@ -423,7 +427,8 @@ void RTSP_handler(RTSP_Client * rtsp)
         [RFC822_State_Interleaved] = RTSP_handle_interleaved,
         [RFC822_State_HTTP_Headers] = HTTP_handle_headers,
         [RFC822_State_HTTP_Content] = HTTP_handle_content,
-        [RFC822_State_HTTP_Idle] = HTTP_handle_idle
+        [RFC822_State_HTTP_Idle] = HTTP_handle_idle,
+        [RFC822_State_HTTP_Join] = HTTP_handle_join
     };
 
     while ( handlers[rtsp->status](rtsp) );
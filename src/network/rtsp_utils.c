@@ -96,13 +96,17 @@ void rtsp_session_editlist_free(RTSP_session *session)
  */
 RTSP_session *rtsp_session_new(RTSP_Client *rtsp)
 {
-    RTSP_session *new = rtsp->session = g_slice_new0(RTSP_session);
+    RTSP_session *new = g_slice_new0(RTSP_session);
 
     new->session_id = g_strdup_printf("%08x%08x",
                                       g_random_int(),
                                       g_random_int());
     new->play_requests = g_queue_new();
 
+    g_mutex_lock(rtsp->stats_lock);
+    rtsp->session = new;
+    g_mutex_unlock(rtsp->stats_lock);
+
     return new;
 }
 
@@ -118,6 +122,9 @@ void rtsp_session_free(RTSP_session *session)
     if ( !session )
         return;
 
+    if ( session->cur_state == RTSP_SERVER_PLAYING )
+        r_stop(session->resource);
+
     /* Release all the connected RTP sessions */
     rtp_session_gslist_free(session->rtp_sessions);
     g_slist_free(session->rtp_sessions);
@@ -126,6 +133,7 @@ void rtsp_session_free(RTSP_session *session)
     g_queue_free(session->play_requests);
 
     g_free(session->resource_uri);
+    r_rendition_cancel(session->abr.pending);
     r_close(session->resource);
 
     g_free(session->session_id);
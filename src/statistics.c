@@ -29,12 +29,25 @@
 
 #include "feng.h"
 #include "network/rtsp.h"
+#include "network/rtp.h"
 #include "media/media.h"
 
 static size_t stats_total_bytes_sent;
 static size_t stats_total_bytes_read;
 static time_t stats_start_time;
 
+/* UDP batches are flushed by all the workers at once */
+G_LOCK_DEFINE_STATIC(stats_batch);
+static guint64 stats_udp_batches;
+static guint64 stats_udp_batch_packets;
+static guint64 stats_udp_dropped;
+static size_t stats_udp_batch_max;
+static guint64 stats_tcp_shed;
+static guint64 stats_rtp_bursts;
+static guint64 stats_rtp_burst_packets;
+static size_t stats_rtp_burst_max;
+static size_t stats_rtp_burst_max_bytes;
+
 /**
  * @brief Initialize the statistics
  *
@@ -64,6 +77,135 @@ void stats_account_sent(RTSP_Client *rtsp, size_t bytes)
     stats_total_bytes_read += bytes;
 }
 
+/**
+ * @brief Account for a batch of RTP packets flushed on UDP
+ *
+ * @param packets Number of packets in the batch
+ * @param dropped Number of packets of the batch that could not be sent
+ */
+void stats_account_batch(size_t packets, size_t dropped)
+{
+    G_LOCK(stats_batch);
+
+    stats_udp_batches++;
+    stats_udp_batch_packets += packets;
+    stats_udp_dropped += dropped;
+    stats_udp_batch_max = MAX(stats_udp_batch_max, packets);
+
+    G_UNLOCK(stats_batch);
+}
+
+/**
+ * @brief Account for RTP packets discarded for congested TCP clients
+ *
+ * @param packets Number of packets discarded
+ */
+void stats_account_shed(size_t packets)
+{
+    G_LOCK(stats_batch);
+    stats_tcp_shed += packets;
+    G_UNLOCK(stats_batch);
+}
+
+/**
+ * @brief Account for the RTP packets sent at once for a session
+ *
+ * @param packets Number of packets sent
+ * @param bytes Number of payload bytes sent
+ *
+ * Used to verify the effect of the pacing settings.
+ */
+void stats_account_burst(size_t packets, size_t bytes)
+{
+    G_LOCK(stats_batch);
+
+    stats_rtp_bursts++;
+    stats_rtp_burst_packets += packets;
+    stats_rtp_burst_max = MAX(stats_rtp_burst_max, packets);
+    stats_rtp_burst_max_bytes = MAX(stats_rtp_burst_max_bytes, bytes);
+
+    G_UNLOCK(stats_batch);
+}
+
+/**
+ * @brief Publish the counters of an RTP session for the statistics
+ *
+ * @param rtp The session to publish the counters of
+ *
+ * Called by the worker serving the session, whenever they change;
+ * the sessions of clients not listed (multicast senders) have no
+ * lock and are not reported.
+ */
+void stats_publish_rtp(RTP_session *rtp)
+{
+    RTSP_Client *client = rtp->client;
+
+    if ( client->stats_lock == NULL )
+        return;
+
+    g_mutex_lock(client->stats_lock);
+
+    rtp->published.pkt_count = rtp->pkt_count;
+    rtp->published.octet_count = rtp->octet_count;
+    rtp->published.rtx_packets = rtp->rtx.packets;
+    rtp->published.clock_rate = rtp->track->clock_rate;
+    rtp->published.receiver = rtp->receiver;
+
+    g_mutex_unlock(client->stats_lock);
+}
+
+/**
+ * @brief Produce per RTP session statistics
+ *
+ * The reception statistics are the ones last reported by the client
+ * through RTCP; the rates are reported in percents, the times in
+ * milliseconds.
+ *
+ * Only the fields set up before the session is listed, and the
+ * published counters, are read: the session belongs to a different
+ * worker.
+ *
+ * @note feed to g_slist_foreach, with the client's stats_lock held
+ */
+
+static void rtp_session_stats(gpointer r, gpointer s)
+{
+    RTP_session *rtp = r;
+    const RTP_ReceiverStats *receiver = &rtp->published.receiver;
+    json_object *sessions_stats = s;
+    json_object *stats = json_object_new_object();
+
+    json_object_object_add(stats, "uri",
+        json_object_new_string(rtp->uri));
+    json_object_object_add(stats, "ssrc",
+        json_object_new_int(rtp->ssrc));
+    json_object_object_add(stats, "packets_sent",
+        json_object_new_int(rtp->published.pkt_count));
+    json_object_object_add(stats, "octets_sent",
+        json_object_new_int(rtp->published.octet_count));
+    if ( rtp->rtx.payload_type >= 0 )
+        json_object_object_add(stats, "packets_retransmitted",
+            json_object_new_int(rtp->published.rtx_packets));
+    json_object_object_add(stats, "reports",
+        json_object_new_int(receiver->reports));
+
+    if ( receiver->reports > 0 ) {
+        json_object_object_add(stats, "fraction_lost",
+            json_object_new_double(receiver->fraction_lost * 100.0 / 256));
+        json_object_object_add(stats, "packets_lost",
+            json_object_new_int(receiver->packets_lost));
+        json_object_object_add(stats, "jitter",
+            json_object_new_double(receiver->jitter * 1000.0 /
+                                   rtp->published.clock_rate));
+    }
+
+    if ( receiver->rtt >= 0 )
+        json_object_object_add(stats, "rtt",
+            json_object_new_double(receiver->rtt * 1000));
+
+    json_object_array_add(sessions_stats, stats);
+}
+
 /**
  * @brief Produce per client statistics
  *
@@ -73,11 +215,22 @@ void stats_account_sent(RTSP_Client *rtsp, size_t bytes)
 static void client_stats(gpointer c, gpointer s)
 {
     RTSP_Client *client = c;
-    RTSP_session *session = client->session;
+    RTSP_session *session;
     json_object *clients_stats = s;
-    json_object *stats = json_object_new_object();
-    // Sessionless clients are querying stats, let's ignore them.
-    if (!session) return;
+    json_object *stats, *sessions_stats;
+
+    g_mutex_lock(client->stats_lock);
+
+    // Sessionless clients are querying stats, let's ignore them; the
+    // ones still setting up their first RTP session too.
+    if ( (session = client->session) == NULL ||
+         session->rtp_sessions == NULL ) {
+        g_mutex_unlock(client->stats_lock);
+        return;
+    }
+
+    stats = json_object_new_object();
+    sessions_stats = json_object_new_array();
     json_object_object_add(stats, "resource_uri",
         json_object_new_string(session->resource_uri));
     json_object_object_add(stats, "user_agent",
@@ -90,6 +243,12 @@ static void client_stats(gpointer c, gpointer s)
         json_object_new_int(client->bytes_sent));
     json_object_object_add(stats, "bytes_read",
         json_object_new_int(client->bytes_read));
+
+    g_slist_foreach(session->rtp_sessions, rtp_session_stats, sessions_stats);
+    json_object_object_add(stats, "rtp_sessions", sessions_stats);
+
+    g_mutex_unlock(client->stats_lock);
+
     json_object_array_add(clients_stats, stats);
 }
 
@@ -113,6 +272,39 @@ void feng_send_statistics(RTSP_Client *rtsp)
     json_object_object_add(stats, "uptime",
         json_object_new_int(time(NULL) - stats_start_time));
 
+    G_LOCK(stats_batch);
+
+    json_object_object_add(stats, "udp_batches",
+        json_object_new_int(stats_udp_batches));
+
+    json_object_object_add(stats, "udp_batch_average",
+        json_object_new_double(stats_udp_batches ?
+                               (double)stats_udp_batch_packets / stats_udp_batches : 0));
+
+    json_object_object_add(stats, "udp_batch_max",
+        json_object_new_int(stats_udp_batch_max));
+
+    json_object_object_add(stats, "udp_dropped",
+        json_object_new_int(stats_udp_dropped));
+
+    json_object_object_add(stats, "tcp_shed",
+        json_object_new_int(stats_tcp_shed));
+
+    json_object_object_add(stats, "rtp_bursts",
+        json_object_new_int(stats_rtp_bursts));
+
+    json_object_object_add(stats, "rtp_burst_average",
+        json_object_new_double(stats_rtp_bursts ?
+                               (double)stats_rtp_burst_packets / stats_rtp_bursts : 0));
+
+    json_object_object_add(stats, "rtp_burst_max",
+        json_object_new_int(stats_rtp_burst_max));
+
+    json_object_object_add(stats, "rtp_burst_max_bytes",
+        json_object_new_int(stats_rtp_burst_max_bytes));
+
+    G_UNLOCK(stats_batch);
+
     clients_each(client_stats, clients_stats);
 
     json_object_object_add(stats, "clients",
@@ -0,0 +1,310 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <string.h>
+
+#include "src/media/media.h"
+#include <glib.h>
+#include "gtest-extra.h"
+
+/* The parser is tested on its own: the functions it uses to produce
+ * packets are replaced here by ones collecting them. */
+
+static GPtrArray *packets;
+
+void fnc_log(ATTR_UNUSED unsigned int level, ATTR_UNUSED const char *fmt, ...)
+{
+}
+
+void sdp_descr_append_rtpmap(Track *track)
+{
+    g_string_append_printf(track->sdp_description, "a=rtpmap:%u %s/%d\r\n",
+                           track->payload_type, track->encoding_name,
+                           track->clock_rate);
+}
+
+struct MParserBuffer *mparser_buffer_new(ATTR_UNUSED Track *tr, size_t size)
+{
+    struct MParserBuffer *buffer = g_new0(struct MParserBuffer, 1);
+
+    buffer->data = g_malloc(size);
+    buffer->data_size = size;
+
+    return buffer;
+}
+
+struct MParserBuffer *mparser_buffer_new_slice(Track *tr, const uint8_t *data,
+                                               size_t size)
+{
+    struct MParserBuffer *buffer = mparser_buffer_new(tr, size);
+
+    memcpy(buffer->data, data, size);
+
+    return buffer;
+}
+
+void track_write(ATTR_UNUSED Track *tr, struct MParserBuffer *buffer)
+{
+    g_ptr_array_add(packets, buffer);
+}
+
+static void packets_free()
+{
+    unsigned int i;
+
+    for ( i = 0; i < packets->len; i++ ) {
+        struct MParserBuffer *buffer = g_ptr_array_index(packets, i);
+
+        g_free(buffer->data);
+        g_free(buffer);
+    }
+
+    g_ptr_array_free(packets, true);
+}
+
+/* Parameter sets of a 640x360 Main profile stream */
+static const uint8_t vps[] = {
+    0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00,
+    0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x5d, 0x95, 0x98, 0x09
+};
+static const uint8_t sps[] = {
+    0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00,
+    0x03, 0x00, 0x00, 0x03, 0x00, 0x5d, 0xa0, 0x02, 0x80, 0x80, 0x2d, 0x16,
+    0x59, 0x59, 0xa4, 0x93, 0x2b, 0xc0, 0x5a
+};
+static const uint8_t pps[] = {
+    0x44, 0x01, 0xc1, 0x72, 0xb4, 0x62, 0x40
+};
+
+static const char expected_fmtp[] =
+    "a=rtpmap:96 H265/90000\r\n"
+    "a=fmtp:96 sprop-vps=QAEMAf//AWAAAAMAkAAAAwAAAwBdlZgJ; "
+    "sprop-sps=QgEBAWAAAAMAkAAAAwAAAwBdoAKAgC0WWVmkkyvAWg==; "
+    "sprop-pps=RAHBcrRiQA==\r\n";
+
+static void track_init(Track *track, GByteArray *extradata)
+{
+    memset(track, 0, sizeof(Track));
+
+    track->payload_type = 96;
+    track->clock_rate = 90000;
+    track->encoding_name = (char *)"H265";
+    track->media_type = MP_video;
+    track->sdp_description = g_string_new(NULL);
+    track->extradata = extradata->data;
+    track->extradata_len = extradata->len;
+}
+
+static void append_annexb(GByteArray *stream, const uint8_t *nal, size_t size)
+{
+    static const uint8_t startcode[] = { 0x00, 0x00, 0x00, 0x01 };
+
+    g_byte_array_append(stream, startcode, sizeof(startcode));
+    g_byte_array_append(stream, nal, size);
+}
+
+static void append_length(GByteArray *stream, size_t size, size_t length_size)
+{
+    while ( length_size-- > 0 ) {
+        const uint8_t byte = size >> (8 * length_size);
+        g_byte_array_append(stream, &byte, 1);
+    }
+}
+
+/* An IDR_W_RADL slice of the given size */
+static uint8_t *idr_slice(size_t size)
+{
+    uint8_t *nal = g_malloc(size);
+    size_t i;
+
+    nal[0] = 19 << 1;
+    nal[1] = 0x01;
+    for ( i = 2; i < size; i++ )
+        nal[i] = 0x80 | (i & 0x7f);
+
+    return nal;
+}
+
+void test_h265_init_annexb()
+{
+    GByteArray *extradata = g_byte_array_new();
+    Track track;
+
+    append_annexb(extradata, vps, sizeof(vps));
+    append_annexb(extradata, sps, sizeof(sps));
+    append_annexb(extradata, pps, sizeof(pps));
+
+    track_init(&track, extradata);
+
+    g_assert_cmpint(h265_init(&track), ==, 0);
+    g_assert(!track.h265.is_hvcc);
+    g_assert_cmpstr(track.sdp_description->str, ==, expected_fmtp);
+
+    g_string_free(track.sdp_description, true);
+    g_byte_array_free(extradata, true);
+}
+
+void test_h265_init_hvcc()
+{
+    GByteArray *extradata = g_byte_array_new();
+    uint8_t header[23] = { 0x01, 0x01, 0x60 };
+    const uint8_t *sets[] = { vps, sps, pps };
+    const size_t sizes[] = { sizeof(vps), sizeof(sps), sizeof(pps) };
+    Track track;
+    unsigned int i;
+
+    header[21] = 0x0f;          /* lengthSizeMinusOne = 3 */
+    header[22] = 3;             /* numOfArrays */
+    g_byte_array_append(extradata, header, sizeof(header));
+
+    for ( i = 0; i < 3; i++ ) {
+        const uint8_t array[3] = { 0x80 | (32 + i), 0x00, 0x01 };
+
+        g_byte_array_append(extradata, array, sizeof(array));
+        append_length(extradata, sizes[i], 2);
+        g_byte_array_append(extradata, sets[i], sizes[i]);
+    }
+
+    track_init(&track, extradata);
+
+    g_assert_cmpint(h265_init(&track), ==, 0);
+    g_assert(track.h265.is_hvcc);
+    g_assert_cmpint(track.h265.nal_length_size, ==, 4);
+    g_assert_cmpstr(track.sdp_description->str, ==, expected_fmtp);
+
+    /* truncated records are refused */
+    g_string_free(track.sdp_description, true);
+    track_init(&track, extradata);
+    track.extradata_len -= 2;
+    g_assert_cmpint(h265_init(&track), ==, -1);
+
+    g_string_free(track.sdp_description, true);
+    g_byte_array_free(extradata, true);
+}
+
+void test_h265_parse_ap()
+{
+    GByteArray *frame = g_byte_array_new();
+    GByteArray *extradata = g_byte_array_new();
+    uint8_t *idr = idr_slice(100);
+    struct MParserBuffer *buffer;
+    const uint8_t *p;
+    Track track;
+
+    track_init(&track, extradata);
+    packets = g_ptr_array_new();
+
+    append_annexb(frame, vps, sizeof(vps));
+    append_annexb(frame, sps, sizeof(sps));
+    append_annexb(frame, pps, sizeof(pps));
+    append_annexb(frame, idr, 100);
+
+    g_assert_cmpint(h265_parse(&track, frame->data, frame->len), ==, 0);
+
+    /* all the units fit in a single aggregation packet */
+    g_assert_cmpint(packets->len, ==, 1);
+    buffer = g_ptr_array_index(packets, 0);
+    g_assert(buffer->marker);
+    g_assert_cmpint(buffer->data_size, ==,
+                    2 + 4*2 + sizeof(vps) + sizeof(sps) + sizeof(pps) + 100);
+
+    p = buffer->data;
+    g_assert_cmpint(p[0], ==, 48 << 1);
+    g_assert_cmpint(p[1], ==, 0x01);
+    p += 2;
+
+    g_assert_cmpint((p[0] << 8) | p[1], ==, sizeof(vps));
+    g_assert(memcmp(p + 2, vps, sizeof(vps)) == 0);
+    p += 2 + sizeof(vps);
+    g_assert_cmpint((p[0] << 8) | p[1], ==, sizeof(sps));
+    g_assert(memcmp(p + 2, sps, sizeof(sps)) == 0);
+    p += 2 + sizeof(sps);
+    g_assert_cmpint((p[0] << 8) | p[1], ==, sizeof(pps));
+    g_assert(memcmp(p + 2, pps, sizeof(pps)) == 0);
+    p += 2 + sizeof(pps);
+    g_assert_cmpint((p[0] << 8) | p[1], ==, 100);
+    g_assert(memcmp(p + 2, idr, 100) == 0);
+
+    packets_free();
+    g_string_free(track.sdp_description, true);
+    g_free(idr);
+    g_byte_array_free(frame, true);
+    g_byte_array_free(extradata, true);
+}
+
+void test_h265_parse_fu()
+{
+    static const uint8_t aud[] = { 35 << 1, 0x01, 0x50 };
+    GByteArray *frame = g_byte_array_new();
+    GByteArray *extradata = g_byte_array_new();
+    GByteArray *payload = g_byte_array_new();
+    uint8_t *idr = idr_slice(3000);
+    struct MParserBuffer *buffer;
+    Track track;
+    unsigned int i;
+
+    track_init(&track, extradata);
+    track.h265.is_hvcc = true;
+    track.h265.nal_length_size = 4;
+    packets = g_ptr_array_new();
+
+    append_length(frame, sizeof(aud), 4);
+    g_byte_array_append(frame, aud, sizeof(aud));
+    append_length(frame, 3000, 4);
+    g_byte_array_append(frame, idr, 3000);
+
+    g_assert_cmpint(h265_parse(&track, frame->data, frame->len), ==, 0);
+
+    /* the access unit delimiter alone, then three fragments */
+    g_assert_cmpint(packets->len, ==, 4);
+
+    buffer = g_ptr_array_index(packets, 0);
+    g_assert(!buffer->marker);
+    g_assert_cmpint(buffer->prefix_size, ==, 0);
+    g_assert_cmpint(buffer->data_size, ==, sizeof(aud));
+
+    for ( i = 1; i < packets->len; i++ ) {
+        buffer = g_ptr_array_index(packets, i);
+
+        g_assert_cmpint(buffer->prefix_size, ==, 3);
+        g_assert_cmpint(buffer->prefix[0], ==, 49 << 1);
+        g_assert_cmpint(buffer->prefix[1], ==, 0x01);
+        g_assert_cmpint(buffer->prefix[2] & 0x3f, ==, 19);
+        g_assert_cmpint(!!(buffer->prefix[2] & 0x80), ==, i == 1);
+        g_assert_cmpint(!!(buffer->prefix[2] & 0x40), ==, i == packets->len - 1);
+        g_assert_cmpint(buffer->marker, ==, i == packets->len - 1);
+        g_assert_cmpint(buffer->prefix_size + buffer->data_size, <=, DEFAULT_MTU);
+
+        g_byte_array_append(payload, buffer->data, buffer->data_size);
+    }
+
+    /* the fragments carry the unit without its header */
+    g_assert_cmpint(payload->len, ==, 3000 - 2);
+    g_assert(memcmp(payload->data, idr + 2, 3000 - 2) == 0);
+
+    packets_free();
+    g_string_free(track.sdp_description, true);
+    g_free(idr);
+    g_byte_array_free(payload, true);
+    g_byte_array_free(frame, true);
+    g_byte_array_free(extradata, true);
+}
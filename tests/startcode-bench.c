@@ -0,0 +1,101 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Microbenchmark of the start code scanning kernels.
+ *
+ * Build it with "make tests/startcode-bench", and run it on raw Annex B
+ * bitstreams (.h264, .h265, .m2v, .m4v elementary streams):
+ *
+ *   tests/startcode-bench sample.h264 [...]
+ *
+ * Each file is scanned from start code to start code, as the parsers
+ * do, by every kernel the CPU supports, for about half a second each.
+ */
+
+#include <stdlib.h>
+#include <glib.h>
+
+#include "src/media/startcode.h"
+
+#define BENCH_SECONDS 0.5
+
+static unsigned int bench_scan(startcode_find_fn find,
+                               const uint8_t *data, size_t len)
+{
+    const uint8_t *end = data + len, *p = data;
+    unsigned int found = 0;
+
+    while ( (p = find(p, end)) < end ) {
+        found++;
+        p += 3;
+    }
+
+    return found;
+}
+
+int main(int argc, char *argv[])
+{
+    int i;
+
+    if ( argc < 2 ) {
+        g_printerr("usage: %s bitstream...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for ( i = 1; i < argc; i++ ) {
+        const struct startcode_kernel *kernel;
+        GError *error = NULL;
+        gchar *data;
+        gsize len;
+
+        if ( !g_file_get_contents(argv[i], &data, &len, &error) ) {
+            g_printerr("%s\n", error->message);
+            g_error_free(error);
+            return EXIT_FAILURE;
+        }
+
+        for ( kernel = startcode_kernels; kernel->name != NULL; kernel++ ) {
+            GTimer *timer;
+            unsigned int rounds = 0, found = 0;
+            double elapsed;
+
+            if ( kernel->supported != NULL && !kernel->supported() )
+                continue;
+
+            timer = g_timer_new();
+            do {
+                found = bench_scan(kernel->find, (const uint8_t*)data, len);
+                rounds++;
+            } while ( (elapsed = g_timer_elapsed(timer, NULL)) < BENCH_SECONDS );
+            g_timer_destroy(timer);
+
+            g_print("%s: %-5s %u start codes, %8.1f MB/s\n",
+                    argv[i], kernel->name, found,
+                    (double)len * rounds / elapsed / 1e6);
+        }
+
+        g_free(data);
+    }
+
+    return EXIT_SUCCESS;
+}
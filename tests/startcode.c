@@ -0,0 +1,82 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "src/media/startcode.h"
+#include <glib.h>
+#include "gtest-extra.h"
+
+static const uint8_t *naive_find(const uint8_t *p, const uint8_t *end)
+{
+    for ( ; end - p >= 3; p++ )
+        if ( p[0] == 0 && p[1] == 0 && p[2] == 1 )
+            return p;
+
+    return end;
+}
+
+void test_startcode_simple()
+{
+    static const uint8_t stream[] = {
+        0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x1e,
+        0x00, 0x00, 0x01, 0x68, 0xce, 0x38, 0x80
+    };
+    const uint8_t *end = stream + sizeof(stream);
+
+    g_assert(startcode_find(stream, end) == stream + 1);
+    g_assert(startcode_find(stream + 2, end) == stream + 8);
+    g_assert(startcode_find(stream + 9, end) == end);
+    g_assert(startcode_find(stream, stream) == stream);
+
+    /* the start code has to fit before the end */
+    g_assert(startcode_find(stream + 8, stream + 10) == stream + 10);
+    g_assert(startcode_find(stream + 8, stream + 11) == stream + 8);
+}
+
+void test_startcode_kernels()
+{
+    const struct startcode_kernel *kernel;
+    uint8_t buffer[256];
+    unsigned int round;
+
+    for ( kernel = startcode_kernels; kernel->name != NULL; kernel++ ) {
+        if ( kernel->supported != NULL && !kernel->supported() )
+            continue;
+
+        for ( round = 0; round < 64; round++ ) {
+            unsigned int i, begin, end;
+
+            /* mostly zeroes and ones, so that start codes and near
+             * misses are frequent */
+            for ( i = 0; i < sizeof(buffer); i++ ) {
+                const gint32 r = g_test_rand_int_range(0, 8);
+                buffer[i] = r < 4 ? 0 : r < 6 ? 1 : g_test_rand_int_range(2, 256);
+            }
+
+            for ( begin = 0; begin < 40; begin++ )
+                for ( end = sizeof(buffer) - 40; end <= sizeof(buffer); end++ )
+                    if ( kernel->find(buffer + begin, buffer + end) !=
+                         naive_find(buffer + begin, buffer + end) )
+                        gte_fail("kernel %s mismatch at %u-%u",
+                                 kernel->name, begin, end);
+        }
+    }
+}